@@ -126,15 +126,22 @@ LUALIB_API const char *(luaL_findtable) (lua_State *L, int idx,
 
 
 
+/*
+** Characters are added to the buffer array until it fills up, then they're
+** moved to a growable buffer on the stack (see lua_newbuffer) which becomes
+** the storage for the result.
+*/
 typedef struct luaL_Buffer {
   char *p;			/* current position in buffer */
-  int lvl;  /* number of strings in the stack (level) */
+  char *base;  /* start of the current buffer */
+  char *end;  /* end of the current buffer */
+  int lvl;  /* number of values in the stack (level) */
   lua_State *L;
   char buffer[LUAL_BUFFERSIZE];
 } luaL_Buffer;
 
 #define luaL_addchar(B,c) \
-  ((void)((B)->p < ((B)->buffer+LUAL_BUFFERSIZE) || luaL_prepbuffer(B)), \
+  ((void)((B)->p < (B)->end || luaL_prepbuffer(B)), \
    (*(B)->p++ = (char)(c)))
 
 /* compatibility only */
@@ -66,6 +66,12 @@ typedef int (*lua_Writer) (lua_State *L, const void* p, size_t sz, void* ud);
 typedef void * (*lua_Alloc) (void *ud, void *ptr, size_t osize, size_t nsize);
 
 
+/*
+** prototype for functions which release the data of an external string
+*/
+typedef void (*lua_FreeString) (void *ud, const char *s, size_t len);
+
+
 /*
 ** basic types
 */
@@ -236,6 +242,7 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSTEP		5
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
+#define LUA_GCCOMPACT		8
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -347,6 +354,136 @@ typedef void (*lua_Hook) (lua_State *L, lua_Debug *ar);
 typedef void (*lua_GCHook) (lua_State *L, int event, int state);
 LUA_API void lua_setgchook (lua_State *L, lua_GCHook func);
 
+/*
+** Fast paths for operating directly on the array part of a table. These
+** functions return 0 without doing anything if the range isn't covered by
+** the array part (or the values are of the wrong type), in which case the
+** caller should fall back to the generic functions.
+*/
+
+/**
+ * Inserts the value on the top of the stack at position pos in the table,
+ * moving up the elements from pos to the end of the array. The value is
+ * popped from the stack if the function succeeds.
+ */
+LUA_API int lua_arrayinsert (lua_State *L, int idx, int pos);
+
+/**
+ * Removes the element at position pos from the table, moving down the
+ * elements after it, and pushes the removed element onto the stack.
+ */
+LUA_API int lua_arrayremove (lua_State *L, int idx, int pos);
+
+/**
+ * Pushes the concatenation of the elements i through j of the table separated
+ * by sep. All of the elements must be strings or numbers.
+ */
+LUA_API int lua_arrayconcat (lua_State *L, int idx, const char *sep, size_t lsep, int i, int j);
+
+/**
+ * Pushes the elements i through j of the table onto the stack. The caller
+ * is responsible for ensuring there is enough room on the stack.
+ */
+LUA_API int lua_arrayunpack (lua_State *L, int idx, int i, int j);
+
+/**
+ * Sorts the elements 1 through n of the table using the < operator. All of
+ * the elements must be numbers or all of them must be strings.
+ */
+LUA_API int lua_arraysort (lua_State *L, int idx, int n);
+
+/**
+ * Copies the elements f through e of the table at src to positions t onward
+ * in the table at dst (which may be the same table), without invoking any
+ * metamethods.
+ */
+LUA_API int lua_arraymove (lua_State *L, int src, int f, int e, int t, int dst);
+
+/**
+ * Pushes a copy of the table onto the stack. If deep is non-zero, the tables
+ * stored as values in the table are copied as well, preserving any sharing
+ * and cycles between them. The metatables are shared with the originals.
+ */
+LUA_API void lua_clonetable (lua_State *L, int idx, int deep);
+
+/**
+ * Makes the table immutable. Any later attempt to set a field in the table
+ * or change its metatable raises an error. Frozen tables are stored in a form
+ * which is optimized for look ups.
+ */
+LUA_API void lua_freezetable (lua_State *L, int idx);
+
+/**
+ * Returns 1 if the value at the given index is a frozen table, and 0
+ * otherwise.
+ */
+LUA_API int lua_isfrozen (lua_State *L, int idx);
+
+/**
+ * Pushes the len characters of the string at the given index starting at
+ * offset start (counting from 0). Long substrings reference the data of the
+ * original string rather than storing a copy.
+ */
+LUA_API void lua_pushsubstring (lua_State *L, int idx, size_t start, size_t len);
+
+/**
+ * Pushes a string which references len characters of memory owned by the
+ * host, without copying them. The data must be followed by a null terminator
+ * and must not change until freefn (which may be NULL) is called with ud and
+ * the data when the string is collected. freefn is called from inside the
+ * garbage collector, so it must not call back into Lua. Short strings are
+ * copied, in which case freefn is called before this function returns.
+ */
+LUA_API void lua_pushexternalstring (lua_State *L, const char *s, size_t len,
+                                     lua_FreeString freefn, void *ud);
+
+/*
+** Buffers for building a long string in place, so that the data doesn't
+** need to be copied into the string when it's finished. A buffer is stored
+** on the stack like a string, but it must not be used as one until it's
+** finished.
+*/
+
+/**
+ * Pushes a new buffer with room for size characters onto the stack and
+ * returns a pointer to its data.
+ */
+LUA_API char *lua_newbuffer (lua_State *L, size_t size);
+
+/**
+ * Changes the size of the buffer at the given index, keeping its contents,
+ * and returns the new pointer to its data.
+ */
+LUA_API char *lua_resizebuffer (lua_State *L, int idx, size_t size);
+
+/**
+ * Replaces the buffer at the given index with a string holding its first
+ * len characters.
+ */
+LUA_API void lua_finishbuffer (lua_State *L, int idx, size_t len);
+
+/*
+** Statistics about the chains in a hash, which can be used to check how well
+** the hash function distributes a particular set of keys.
+*/
+typedef struct lua_HashStats {
+  int numKeys;          /* number of keys stored in the hash */
+  int numNodes;         /* number of buckets */
+  int numChains;        /* number of buckets which have at least one key */
+  int maxChainLength;   /* number of keys in the fullest bucket */
+} lua_HashStats;
+
+/**
+ * Fills in the statistics for the hash part of the table. Tables which store
+ * their keys using a shape have no hash part.
+ */
+LUA_API void lua_gettablehashstats (lua_State *L, int idx, lua_HashStats *stats);
+
+/**
+ * Fills in the statistics for the pool of interned strings.
+ */
+LUA_API void lua_getstringhashstats (lua_State *L, lua_HashStats *stats);
+
 
 LUA_API int lua_getstack (lua_State *L, int level, lua_Debug *ar);
 LUA_API int lua_getinfo (lua_State *L, const char *what, lua_Debug *ar);
@@ -1,9 +1,17 @@
 buildmasm = true
 
+newoption {
+    trigger     = "parallel-sort",
+    description = "Sort large arrays on multiple threads in table.sort"
+}
+
 solution "Rocket"
     configurations { "Debug", "Release" }
     location "build"
     defines { "_CRT_SECURE_NO_WARNINGS", "_CRT_SECURE_NO_DEPRECATE" }
+    if _OPTIONS["parallel-sort"] then
+        defines { "ROCKET_PARALLEL_SORT" }
+    end
     vpaths { 
         ["Header Files"] = "**.h",
         ["Source Files"] = { "**.cpp", "**.c", "**.asm", "**.inl" },
@@ -30,6 +38,8 @@ project "Rocket"
     links { "AuxLib", "Parser" }
 	if os.is("windows") then
 		linkoptions { [[/DEF:"../src/Rocket.def"]] }
+	elseif _OPTIONS["parallel-sort"] then
+		links { "pthread" }
 	end
     defines { "ROCKET_EXPORTS", "LUA_CORE" }
      
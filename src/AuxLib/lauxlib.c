@@ -389,53 +389,46 @@ LUALIB_API const char *luaL_findtable (lua_State *L, int idx,
 */
 
 
-#define bufflen(B)	((B)->p - (B)->buffer)
-#define bufffree(B)	((size_t)(LUAL_BUFFERSIZE - bufflen(B)))
+#define bufflen(B)	((size_t)((B)->p - (B)->base))
+#define bufffree(B)	((size_t)((B)->end - (B)->p))
 
-#define LIMIT	(LUA_MINSTACK/2)
 
-
-static int emptybuffer (luaL_Buffer *B) {
+/*
+** Makes room for at least n more characters. Once the buffer array is full,
+** the contents are moved to a buffer on the stack, which is doubled in size
+** each time it fills up. The value on the top of the stack is kept there if
+** top is set.
+*/
+static void growbuffer (luaL_Buffer *B, size_t n, int top) {
+  lua_State *L = B->L;
   size_t l = bufflen(B);
-  if (l == 0) return 0;  /* put nothing on stack */
-  else {
-    lua_pushlstring(B->L, B->buffer, l);
-    B->p = B->buffer;
-    B->lvl++;
-    return 1;
-  }
-}
-
-
-static void adjuststack (luaL_Buffer *B) {
-  if (B->lvl > 1) {
-    lua_State *L = B->L;
-    int toget = 1;  /* number of levels to concat */
-    size_t toplen = lua_strlen(L, -1);
-    do {
-      size_t l = lua_strlen(L, -(toget+1));
-      if (B->lvl - toget + 1 >= LIMIT || toplen > l) {
-        toplen += l;
-        toget++;
-      }
-      else break;
-    } while (toget < B->lvl);
-    lua_concat(L, toget);
-    B->lvl = B->lvl - toget + 1;
+  size_t size = 2 * (size_t)(B->end - B->base);
+  if (size < l + n) size = l + n;
+  if (B->lvl == 0) {
+    B->base = lua_newbuffer(L, size);
+    memcpy(B->base, B->buffer, l);
+    if (top) lua_insert(L, -2);  /* put buffer before the value */
+    B->lvl = 1;
   }
+  else
+    B->base = lua_resizebuffer(L, top ? -2 : -1, size);
+  B->p = B->base + l;
+  B->end = B->base + size;
 }
 
 
 LUALIB_API char *luaL_prepbuffer (luaL_Buffer *B) {
-  if (emptybuffer(B))
-    adjuststack(B);
-  return B->buffer;
+  if (bufffree(B) < LUAL_BUFFERSIZE)
+    growbuffer(B, LUAL_BUFFERSIZE, 0);
+  return B->p;
 }
 
 
 LUALIB_API void luaL_addlstring (luaL_Buffer *B, const char *s, size_t l) {
-  while (l--)
-    luaL_addchar(B, *s++);
+  if (bufffree(B) < l)
+    growbuffer(B, l, 0);
+  memcpy(B->p, s, l);
+  B->p += l;
 }
 
 
@@ -445,8 +438,10 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 
 
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
-  emptybuffer(B);
-  lua_concat(B->L, B->lvl);
+  if (B->lvl == 0)
+    lua_pushlstring(B->L, B->buffer, bufflen(B));
+  else
+    lua_finishbuffer(B->L, -1, bufflen(B));
   B->lvl = 1;
 }
 
@@ -455,23 +450,18 @@ LUALIB_API void luaL_addvalue (luaL_Buffer *B) {
   lua_State *L = B->L;
   size_t vl;
   const char *s = lua_tolstring(L, -1, &vl);
-  if (vl <= bufffree(B)) {  /* fit into buffer? */
-    memcpy(B->p, s, vl);  /* put it there */
-    B->p += vl;
-    lua_pop(L, 1);  /* remove from stack */
-  }
-  else {
-    if (emptybuffer(B))
-      lua_insert(L, -2);  /* put buffer before new value */
-    B->lvl++;  /* add new value into B stack */
-    adjuststack(B);
-  }
+  if (bufffree(B) < vl)
+    growbuffer(B, vl, 1);
+  memcpy(B->p, s, vl);
+  B->p += vl;
+  lua_pop(L, 1);  /* remove from stack */
 }
 
 
 LUALIB_API void luaL_buffinit (lua_State *L, luaL_Buffer *B) {
   B->L = L;
-  B->p = B->buffer;
+  B->p = B->base = B->buffer;
+  B->end = B->buffer + LUAL_BUFFERSIZE;
   B->lvl = 0;
 }
 
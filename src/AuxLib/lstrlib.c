@@ -6,6 +6,8 @@
 
 
 #include <ctype.h>
+#include <limits.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -25,6 +27,260 @@
 
 
 
+/*
+** {======================================================
+** SIMD KERNELS
+** =======================================================
+*/
+
+/*
+** Vectorized versions of the inner loops for case mapping, reversing and
+** plain searching. They're compiled for SSE2 and AVX2 and selected at run
+** time based on what the processor supports, with the scalar loops used
+** for everything else.
+*/
+#if (defined(__GNUC__) || defined(__clang__)) && \
+    (defined(__i386__) || defined(__x86_64__))
+#include <immintrin.h>
+#define STR_SIMD
+#define TARGET_SSE2	__attribute__((target("sse2")))
+#define TARGET_AVX2	__attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#include <immintrin.h>
+#define STR_SIMD
+#define TARGET_SSE2
+#define TARGET_AVX2
+#endif
+
+
+static void casemap_scalar (char *d, const char *s, size_t l, int upper) {
+  size_t i;
+  for (i = 0; i < l; i++)
+    d[i] = (char)(upper ? toupper(uchar(s[i])) : tolower(uchar(s[i])));
+}
+
+
+#if defined(STR_SIMD)
+
+#define SIMD_NONE	0
+#define SIMD_SSE2	1
+#define SIMD_AVX2	2
+
+
+static int simdlevel (void) {
+  static int level = -1;
+  if (level < 0) {
+    int l = SIMD_NONE;
+#if defined(_MSC_VER)
+    int info[4];
+    int maxleaf;
+    __cpuid(info, 0);
+    maxleaf = info[0];
+    __cpuid(info, 1);
+    if (info[3] & (1 << 26)) l = SIMD_SSE2;
+    /* AVX2 also needs the OS to save the AVX registers */
+    if (maxleaf >= 7 && (info[2] & (1 << 27)) && (info[2] & (1 << 28)) &&
+        (_xgetbv(0) & 6) == 6) {
+      __cpuidex(info, 7, 0);
+      if (info[1] & (1 << 5)) l = SIMD_AVX2;
+    }
+#else
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) l = SIMD_AVX2;
+    else if (__builtin_cpu_supports("sse2")) l = SIMD_SSE2;
+#endif
+    level = l;
+  }
+  return level;
+}
+
+
+/* index of the lowest set bit in a non-zero mask */
+static int lowestbit (unsigned int mask) {
+#if defined(_MSC_VER)
+  unsigned long i;
+  _BitScanForward(&i, mask);
+  return (int)i;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+
+/*
+** The case mapping kernels handle blocks of ASCII characters, which is
+** only valid if the locale maps ASCII letters like the C locale does.
+*/
+static int asciicase (void) {
+  int c;
+  for (c = 'a'; c <= 'z'; c++) {
+    if (toupper(c) != c - 'a' + 'A' || tolower(c - 'a' + 'A') != c)
+      return 0;
+  }
+  return 1;
+}
+
+
+/* returns the number of characters mapped, which is a multiple of 16 */
+TARGET_SSE2 static size_t casemap_sse2 (char *d, const char *s, size_t l,
+                                        int upper) {
+  /* letters of the case being changed are offset to the range -128..-103 */
+  const __m128i offset = _mm_set1_epi8((char)(0x80 - (upper ? 'a' : 'A')));
+  const __m128i limit = _mm_set1_epi8((char)(-128 + 26));
+  const __m128i flip = _mm_set1_epi8(0x20);
+  size_t i;
+  for (i = 0; i + 16 <= l; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    if (_mm_movemask_epi8(v) != 0)  /* non-ASCII characters? */
+      casemap_scalar(d + i, s + i, 16, upper);
+    else {
+      __m128i letter = _mm_cmplt_epi8(_mm_add_epi8(v, offset), limit);
+      v = _mm_xor_si128(v, _mm_and_si128(letter, flip));
+      _mm_storeu_si128((__m128i *)(d + i), v);
+    }
+  }
+  return i;
+}
+
+
+/* returns the number of characters mapped, which is a multiple of 32 */
+TARGET_AVX2 static size_t casemap_avx2 (char *d, const char *s, size_t l,
+                                        int upper) {
+  const __m256i offset = _mm256_set1_epi8((char)(0x80 - (upper ? 'a' : 'A')));
+  const __m256i limit = _mm256_set1_epi8((char)(-128 + 26));
+  const __m256i flip = _mm256_set1_epi8(0x20);
+  size_t i;
+  for (i = 0; i + 32 <= l; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    if (_mm256_movemask_epi8(v) != 0)  /* non-ASCII characters? */
+      casemap_scalar(d + i, s + i, 32, upper);
+    else {
+      __m256i letter = _mm256_cmpgt_epi8(limit, _mm256_add_epi8(v, offset));
+      v = _mm256_xor_si256(v, _mm256_and_si256(letter, flip));
+      _mm256_storeu_si256((__m256i *)(d + i), v);
+    }
+  }
+  return i;
+}
+
+
+/* returns the number of characters reversed, which is a multiple of 16 */
+TARGET_SSE2 static size_t reverse_sse2 (char *d, const char *s, size_t l) {
+  size_t i;
+  for (i = 0; i + 16 <= l; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+    /* swap the bytes in each word, then reverse the order of the words */
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0, 1, 2, 3));
+    v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2));
+    _mm_storeu_si128((__m128i *)(d + l - i - 16), v);
+  }
+  return i;
+}
+
+
+/* returns the number of characters reversed, which is a multiple of 32 */
+TARGET_AVX2 static size_t reverse_avx2 (char *d, const char *s, size_t l) {
+  const __m256i mask = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8,
+                                        7, 6, 5, 4, 3, 2, 1, 0,
+                                        15, 14, 13, 12, 11, 10, 9, 8,
+                                        7, 6, 5, 4, 3, 2, 1, 0);
+  size_t i;
+  for (i = 0; i + 32 <= l; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+    /* reverse each half, then swap the halves */
+    v = _mm256_shuffle_epi8(v, mask);
+    v = _mm256_permute2x128_si256(v, v, 1);
+    _mm256_storeu_si256((__m256i *)(d + l - i - 32), v);
+  }
+  return i;
+}
+
+
+/*
+** Searches for s2 (at least 2 characters long) in s1 by comparing the first
+** and last characters of s2 against 16 positions at once, and only comparing
+** the rest at the positions where both match. Sets *i to the number of
+** positions checked when there's no match.
+*/
+TARGET_SSE2 static const char *memfind_sse2 (const char *s1, size_t l1,
+                                             const char *s2, size_t l2,
+                                             size_t *i) {
+  const __m128i first = _mm_set1_epi8(s2[0]);
+  const __m128i last = _mm_set1_epi8(s2[l2-1]);
+  for (*i = 0; *i + l2 - 1 + 16 <= l1; *i += 16) {
+    const char *s = s1 + *i;
+    __m128i a = _mm_loadu_si128((const __m128i *)s);
+    __m128i b = _mm_loadu_si128((const __m128i *)(s + l2 - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int bit = lowestbit(mask);
+      if (memcmp(s + bit + 1, s2 + 1, l2 - 2) == 0)
+        return s + bit;
+      mask &= mask - 1;
+    }
+  }
+  return NULL;
+}
+
+
+TARGET_AVX2 static const char *memfind_avx2 (const char *s1, size_t l1,
+                                             const char *s2, size_t l2,
+                                             size_t *i) {
+  const __m256i first = _mm256_set1_epi8(s2[0]);
+  const __m256i last = _mm256_set1_epi8(s2[l2-1]);
+  for (*i = 0; *i + l2 - 1 + 32 <= l1; *i += 32) {
+    const char *s = s1 + *i;
+    __m256i a = _mm256_loadu_si256((const __m256i *)s);
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + l2 - 1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first),
+                         _mm256_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int bit = lowestbit(mask);
+      if (memcmp(s + bit + 1, s2 + 1, l2 - 2) == 0)
+        return s + bit;
+      mask &= mask - 1;
+    }
+  }
+  return NULL;
+}
+
+#endif
+
+
+static void casemap (char *d, const char *s, size_t l, int upper) {
+  size_t i = 0;
+#if defined(STR_SIMD)
+  if (l >= 32 && asciicase()) {
+    int level = simdlevel();
+    if (level >= SIMD_AVX2) i = casemap_avx2(d, s, l, upper);
+    else if (level >= SIMD_SSE2) i = casemap_sse2(d, s, l, upper);
+  }
+#endif
+  casemap_scalar(d + i, s + i, l - i, upper);
+}
+
+
+static void reverse (char *d, const char *s, size_t l) {
+  size_t i = 0;
+#if defined(STR_SIMD)
+  if (l >= 32) {
+    int level = simdlevel();
+    if (level >= SIMD_AVX2) i = reverse_avx2(d, s, l);
+    else if (level >= SIMD_SSE2) i = reverse_sse2(d, s, l);
+  }
+#endif
+  for (; i < l; i++)
+    d[l-i-1] = s[i];
+}
+
+/* }====================================================== */
+
+
 static int str_len (lua_State *L) {
   size_t l;
   luaL_checklstring(L, 1, &l);
@@ -42,13 +298,14 @@ static ptrdiff_t posrelat (ptrdiff_t pos, size_t len) {
 
 static int str_sub (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
-  ptrdiff_t start = posrelat(luaL_checkinteger(L, 2), l);
-  ptrdiff_t end = posrelat(luaL_optinteger(L, 3, -1), l);
+  ptrdiff_t start, end;
+  luaL_checklstring(L, 1, &l);
+  start = posrelat(luaL_checkinteger(L, 2), l);
+  end = posrelat(luaL_optinteger(L, 3, -1), l);
   if (start < 1) start = 1;
   if (end > (ptrdiff_t)l) end = (ptrdiff_t)l;
   if (start <= end)
-    lua_pushlstring(L, s+start-1, end-start+1);
+    lua_pushsubstring(L, 1, start-1, end-start+1);
   else lua_pushliteral(L, "");
   return 1;
 }
@@ -56,49 +313,53 @@ static int str_sub (lua_State *L) {
 
 static int str_reverse (lua_State *L) {
   size_t l;
-  luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
-  luaL_buffinit(L, &b);
-  while (l--) luaL_addchar(&b, s[l]);
-  luaL_pushresult(&b);
+  reverse(lua_newbuffer(L, l), s, l);
+  lua_finishbuffer(L, -1, l);
   return 1;
 }
 
 
 static int str_lower (lua_State *L) {
   size_t l;
-  size_t i;
-  luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
-  luaL_buffinit(L, &b);
-  for (i=0; i<l; i++)
-    luaL_addchar(&b, tolower(uchar(s[i])));
-  luaL_pushresult(&b);
+  casemap(lua_newbuffer(L, l), s, l, 0);
+  lua_finishbuffer(L, -1, l);
   return 1;
 }
 
 
 static int str_upper (lua_State *L) {
   size_t l;
-  size_t i;
-  luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
-  luaL_buffinit(L, &b);
-  for (i=0; i<l; i++)
-    luaL_addchar(&b, toupper(uchar(s[i])));
-  luaL_pushresult(&b);
+  casemap(lua_newbuffer(L, l), s, l, 1);
+  lua_finishbuffer(L, -1, l);
   return 1;
 }
 
 static int str_rep (lua_State *L) {
   size_t l;
-  luaL_Buffer b;
+  size_t total;
+  size_t filled;
+  char *d;
   const char *s = luaL_checklstring(L, 1, &l);
   int n = luaL_checkint(L, 2);
-  luaL_buffinit(L, &b);
-  while (n-- > 0)
-    luaL_addlstring(&b, s, l);
-  luaL_pushresult(&b);
+  if (n <= 0 || l == 0) {
+    lua_pushliteral(L, "");
+    return 1;
+  }
+  if (l > ((size_t)-1 - 1) / (size_t)n)
+    return luaL_error(L, "resulting string too large");
+  total = l * (size_t)n;
+  d = lua_newbuffer(L, total);
+  memcpy(d, s, l);
+  /* double the copied part each time, so there are only log(n) copies */
+  for (filled = l; filled < total; ) {
+    size_t m = (filled <= total - filled) ? filled : total - filled;
+    memcpy(d + filled, d, m);
+    filled += m;
+  }
+  lua_finishbuffer(L, -1, total);
   return 1;
 }
 
@@ -167,10 +428,65 @@ static int str_dump (lua_State *L) {
 #define CAP_UNFINISHED	(-1)
 #define CAP_POSITION	(-2)
 
+/*
+** Patterns are compiled into a list of items, one for each element of the
+** pattern, so that matching doesn't need to parse the pattern again at each
+** step. Character classes and sets are expanded into bit sets. Since the
+** classes depend on the locale, a compiled pattern assumes the locale isn't
+** changed while it's cached.
+*/
+
+/* item types */
+#define P_END		0	/* end of pattern */
+#define P_CHAR		1	/* single character */
+#define P_ANY		2	/* `.' */
+#define P_SET		3	/* character class or set */
+#define P_OPEN		4	/* start capture */
+#define P_POSITION	5	/* position capture */
+#define P_CLOSE		6	/* end capture */
+#define P_BALANCE	7	/* %bxy */
+#define P_FRONTIER	8	/* %f[set] */
+#define P_BACKREF	9	/* %1 - %9 */
+#define P_ENDANCHOR	10	/* `$' at the end of the pattern */
+#define P_ERROR		11	/* malformed pattern; raises an error if reached */
+
+typedef unsigned char CharSet[32];
+
+#define testset(set,c)	((set)[uchar(c) >> 3] & (1 << (uchar(c) & 7)))
+
+typedef struct PatItem {
+  unsigned char op;
+  unsigned char rep;  /* `?', `*', `+', `-' or 0 for single characters */
+  unsigned char c1, c2;  /* character, or the delimiters for %b */
+  int set;  /* index of the set, or of the message for P_ERROR */
+} PatItem;
+
+typedef struct Pattern {
+  int nitems;
+  int nsets;
+  int anchor;  /* index of the items compiled without a leading `^', or 0 */
+  int firstset;  /* set which must match the first character, or -1 */
+  size_t prefixlen;  /* length of the literal characters which start a match */
+  PatItem *items;
+  CharSet *sets;
+  char *prefix;
+} Pattern;
+
+
+static const char *const patterrors[] = {
+  "malformed pattern (ends with " LUA_QL("%%") ")",
+  "malformed pattern (missing " LUA_QL("]") ")",
+  "missing " LUA_QL("[") " after " LUA_QL("%%f") " in pattern",
+  "unbalanced pattern"
+};
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
   const char *src_end;  /* end (`\0') of source string */
+  int src_index;  /* stack index of source string */
   lua_State *L;
+  const CharSet *sets;  /* sets of the compiled pattern */
   int level;  /* total number of captures (finished or unfinished) */
   struct {
     const char *init;
@@ -199,18 +515,26 @@ static int capture_to_close (MatchState *ms) {
 }
 
 
-static const char *classend (MatchState *ms, const char *p) {
+/*
+** Returns the end of the single character class at p, or NULL if it's
+** malformed, in which case *err is set to the error.
+*/
+static const char *classend (const char *p, int *err) {
   switch (*p++) {
     case L_ESC: {
-      if (*p == '\0')
-        luaL_error(ms->L, "malformed pattern (ends with " LUA_QL("%%") ")");
+      if (*p == '\0') {
+        *err = 0;
+        return NULL;
+      }
       return p+1;
     }
     case '[': {
       if (*p == '^') p++;
       do {  /* look for a `]' */
-        if (*p == '\0')
-          luaL_error(ms->L, "malformed pattern (missing " LUA_QL("]") ")");
+        if (*p == '\0') {
+          *err = 1;
+          return NULL;
+        }
         if (*(p++) == L_ESC && *p != '\0')
           p++;  /* skip escapes (e.g. `%]') */
       } while (*p != ']');
@@ -242,6 +566,11 @@ static int match_class (int c, int cl) {
 }
 
 
+static int isclass (int cl) {
+  return strchr("acdlpsuwxz", tolower(cl)) != NULL && cl != '\0';
+}
+
+
 static int matchbracketclass (int c, const char *p, const char *ec) {
   int sig = 1;
   if (*(p+1) == '^') {
@@ -265,33 +594,294 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
 }
 
 
-static int singlematch (int c, const char *p, const char *ep) {
-  switch (*p) {
-    case '.': return 1;  /* matches any char */
-    case L_ESC: return match_class(c, uchar(*(p+1)));
-    case '[': return matchbracketclass(c, p, ep-1);
-    default:  return (uchar(*p) == c);
+/*
+** Builds the set of characters matched by the class at p (either a `%'
+** class or a `[' set ending at ep) and returns its index.
+*/
+static int addset (Pattern *pat, const char *p, const char *ep) {
+  int c;
+  if (pat->sets != NULL) {
+    unsigned char *set = pat->sets[pat->nsets];
+    memset(set, 0, sizeof(CharSet));
+    for (c = 0; c <= UCHAR_MAX; c++) {
+      int m = (*p == L_ESC) ? match_class(c, uchar(*(p+1)))
+                            : matchbracketclass(c, p, ep-1);
+      if (m) set[c >> 3] |= (unsigned char)(1 << (c & 7));
+    }
+  }
+  return pat->nsets++;
+}
+
+
+static void additem (Pattern *pat, int op, const char *p) {
+  PatItem *item;
+  if (pat->items == NULL) {  /* only counting? */
+    pat->nitems++;
+    return;
+  }
+  item = &pat->items[pat->nitems++];
+  item->op = (unsigned char)op;
+  item->rep = 0;
+  item->c1 = item->c2 = 0;
+  item->set = -1;
+  if (p != NULL) {
+    item->c1 = uchar(*p);
+    item->c2 = uchar(*(p+1));
   }
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p);
+#define lastitem(pat)	((pat)->items ? &(pat)->items[(pat)->nitems-1] : NULL)
+
+
+static void adderror (Pattern *pat, int err) {
+  additem(pat, P_ERROR, NULL);
+  if (pat->items) lastitem(pat)->set = err;
+}
+
+
+/*
+** Compiles the pattern p. If pat->items is NULL, this only counts the
+** number of items and sets needed.
+*/
+static void compilepattern (Pattern *pat, const char *p) {
+  for (;;) {
+    const char *ep;
+    int err;
+    switch (*p) {
+      case '\0': {  /* end of pattern */
+        additem(pat, P_END, NULL);
+        return;
+      }
+      case '(': {
+        if (*(p+1) == ')') {  /* position capture? */
+          additem(pat, P_POSITION, NULL);
+          p += 2;
+        }
+        else {
+          additem(pat, P_OPEN, NULL);
+          p++;
+        }
+        continue;
+      }
+      case ')': {
+        additem(pat, P_CLOSE, NULL);
+        p++;
+        continue;
+      }
+      case '$': {
+        if (*(p+1) == '\0') {  /* is the `$' the last char in pattern? */
+          additem(pat, P_ENDANCHOR, NULL);
+          p++;
+          continue;
+        }
+        break;
+      }
+      case L_ESC: {
+        if (*(p+1) == 'b') {  /* balanced string? */
+          if (*(p+2) == '\0' || *(p+3) == '\0') {
+            adderror(pat, 3);
+            return;
+          }
+          additem(pat, P_BALANCE, p+2);
+          p += 4;
+          continue;
+        }
+        else if (*(p+1) == 'f') {  /* frontier? */
+          p += 2;
+          if (*p != '[') {
+            adderror(pat, 2);
+            return;
+          }
+          ep = classend(p, &err);
+          if (ep == NULL) {
+            adderror(pat, err);
+            return;
+          }
+          additem(pat, P_FRONTIER, NULL);
+          err = addset(pat, p, ep);
+          if (pat->items) lastitem(pat)->set = err;
+          p = ep;
+          continue;
+        }
+        else if (isdigit(uchar(*(p+1)))) {  /* capture results (%0-%9)? */
+          additem(pat, P_BACKREF, p+1);
+          p += 2;
+          continue;
+        }
+        break;
+      }
+    }
+    /* it is a single character item */
+    ep = classend(p, &err);
+    if (ep == NULL) {
+      adderror(pat, err);
+      return;
+    }
+    if (*p == '.')
+      additem(pat, P_ANY, NULL);
+    else if (*p == '[' || (*p == L_ESC && isclass(uchar(*(p+1))))) {
+      additem(pat, P_SET, NULL);
+      err = addset(pat, p, ep);
+      if (pat->items) lastitem(pat)->set = err;
+    }
+    else
+      additem(pat, P_CHAR, (*p == L_ESC) ? p+1 : p);
+    if (*ep == '?' || *ep == '*' || *ep == '+' || *ep == '-') {
+      if (pat->items) lastitem(pat)->rep = uchar(*ep);
+      ep++;
+    }
+    p = ep;
+  }
+}
+
+
+/*
+** Finds what the characters at the start of a match must be, which is used
+** to skip over positions where the pattern can't match.
+*/
+static void findprefix (Pattern *pat) {
+  const PatItem *item = pat->items;
+  pat->prefixlen = 0;
+  pat->firstset = -1;
+  for (;; item++) {
+    if (item->op == P_OPEN || item->op == P_POSITION || item->op == P_CLOSE)
+      continue;  /* captures don't consume characters */
+    if (item->op != P_CHAR || (item->rep != 0 && item->rep != '+'))
+      break;
+    pat->prefix[pat->prefixlen++] = (char)item->c1;
+    if (item->rep == '+')
+      break;  /* following characters can be the same one */
+  }
+  if (pat->prefixlen == 0 && item->op == P_SET &&
+      (item->rep == 0 || item->rep == '+'))
+    pat->firstset = item->set;
+}
+
+
+/*
+** Compiles the pattern and pushes it onto the stack as a userdata. The items
+** for the whole pattern, where a leading `^' is an ordinary character as
+** gmatch needs, come first. If the pattern is anchored, the items for the
+** rest of it follow, starting at pat->anchor.
+*/
+static const Pattern *newpattern (lua_State *L, const char *p) {
+  Pattern count;
+  Pattern *pat;
+  size_t size;
+  count.nitems = count.nsets = 0;
+  count.items = NULL;
+  count.sets = NULL;
+  compilepattern(&count, p);
+  if (*p == '^') compilepattern(&count, p+1);
+  size = sizeof(Pattern) + count.nitems * sizeof(PatItem) +
+         count.nsets * sizeof(CharSet) + count.nitems;
+  pat = (Pattern *)lua_newuserdata(L, size);
+  pat->items = (PatItem *)(pat + 1);
+  pat->sets = (CharSet *)(pat->items + count.nitems);
+  pat->prefix = (char *)(pat->sets + count.nsets);
+  pat->nitems = pat->nsets = 0;
+  pat->anchor = 0;
+  compilepattern(pat, p);
+  if (*p == '^') {
+    pat->anchor = pat->nitems;
+    compilepattern(pat, p+1);
+  }
+  findprefix(pat);
+  return pat;
+}
+
+
+/* maximum number of compiled patterns or formats kept in each cache */
+#define CACHE_SIZE	64
+
+/*
+** Compiled patterns and formats are cached in registry tables keyed by the
+** source string. The number of entries is stored at index 1, and the table
+** is emptied when it gets full. If the value at index idx is in the named
+** cache, this pushes the compiled form and returns it. Otherwise it pushes
+** the cache and returns NULL; the caller should then push the compiled form
+** and call addcached.
+*/
+static void *findcached (lua_State *L, const char *name, int idx) {
+  int n;
+  lua_getfield(L, LUA_REGISTRYINDEX, name);
+  if (lua_istable(L, -1)) {
+    lua_pushvalue(L, idx);
+    lua_rawget(L, -2);
+    if (lua_isuserdata(L, -1)) {  /* cached? */
+      lua_remove(L, -2);  /* remove cache */
+      return lua_touserdata(L, -1);
+    }
+    lua_pop(L, 1);
+    lua_rawgeti(L, -1, 1);
+    n = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+  }
+  else n = CACHE_SIZE;
+  if (n >= CACHE_SIZE) {  /* create a new cache */
+    lua_pop(L, 1);
+    lua_createtable(L, 1, CACHE_SIZE);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, LUA_REGISTRYINDEX, name);
+    n = 0;
+  }
+  lua_pushinteger(L, n + 1);
+  lua_rawseti(L, -2, 1);
+  return NULL;
+}
+
+
+/*
+** Adds the compiled form on the top of the stack to the cache below it,
+** keyed by the value at index idx, and removes the cache from the stack.
+*/
+static void addcached (lua_State *L, int idx) {
+  lua_pushvalue(L, idx);
+  lua_pushvalue(L, -2);
+  lua_rawset(L, -4);  /* cache[source] = compiled form */
+  lua_remove(L, -2);  /* remove cache */
+}
+
+
+/*
+** Returns the compiled form of the pattern at index idx, which is pushed
+** onto the stack so that it's kept alive while it's in use.
+*/
+static const Pattern *getpattern (lua_State *L, int idx) {
+  const Pattern *pat = (const Pattern *)findcached(L, "_PATTERNS", idx);
+  if (pat == NULL) {
+    pat = newpattern(L, lua_tostring(L, idx));
+    addcached(L, idx);
+  }
+  return pat;
+}
+
+
+static int singlematch (const MatchState *ms, int c, const PatItem *item) {
+  switch (item->op) {
+    case P_CHAR: return (item->c1 == c);
+    case P_ANY: return 1;  /* matches any char */
+    default: return testset(ms->sets[item->set], c);
+  }
+}
+
+
+static const char *match (MatchState *ms, const char *s, const PatItem *item);
 
 
 static const char *matchbalance (MatchState *ms, const char *s,
-                                   const char *p) {
-  if (*p == 0 || *(p+1) == 0)
-    luaL_error(ms->L, "unbalanced pattern");
-  if (*s != *p) return NULL;
+                                   const PatItem *item) {
+  if (uchar(*s) != item->c1) return NULL;
   else {
-    int b = *p;
-    int e = *(p+1);
+    int b = item->c1;
+    int e = item->c2;
     int cont = 1;
     while (++s < ms->src_end) {
-      if (*s == e) {
+      if (uchar(*s) == e) {
         if (--cont == 0) return s+1;
       }
-      else if (*s == b) cont++;
+      else if (uchar(*s) == b) cont++;
     }
   }
   return NULL;  /* string ends out of balance */
@@ -299,13 +889,13 @@ static const char *matchbalance (MatchState *ms, const char *s,
 
 
 static const char *max_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *item) {
   ptrdiff_t i = 0;  /* counts maximum expand for item */
-  while ((s+i)<ms->src_end && singlematch(uchar(*(s+i)), p, ep))
+  while ((s+i)<ms->src_end && singlematch(ms, uchar(*(s+i)), item))
     i++;
   /* keeps trying to match with the maximum repetitions */
   while (i>=0) {
-    const char *res = match(ms, (s+i), ep+1);
+    const char *res = match(ms, (s+i), item+1);
     if (res) return res;
     i--;  /* else didn't match; reduce 1 repetition to try again */
   }
@@ -314,12 +904,12 @@ static const char *max_expand (MatchState *ms, const char *s,
 
 
 static const char *min_expand (MatchState *ms, const char *s,
-                                 const char *p, const char *ep) {
+                                 const PatItem *item) {
   for (;;) {
-    const char *res = match(ms, s, ep+1);
+    const char *res = match(ms, s, item+1);
     if (res != NULL)
       return res;
-    else if (s<ms->src_end && singlematch(uchar(*s), p, ep))
+    else if (s<ms->src_end && singlematch(ms, uchar(*s), item))
       s++;  /* try with one more repetition */
     else return NULL;
   }
@@ -327,25 +917,25 @@ static const char *min_expand (MatchState *ms, const char *s,
 
 
 static const char *start_capture (MatchState *ms, const char *s,
-                                    const char *p, int what) {
+                                    const PatItem *item, int what) {
   const char *res;
   int level = ms->level;
   if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
   ms->capture[level].init = s;
   ms->capture[level].len = what;
   ms->level = level+1;
-  if ((res=match(ms, s, p)) == NULL)  /* match failed? */
+  if ((res=match(ms, s, item)) == NULL)  /* match failed? */
     ms->level--;  /* undo capture */
   return res;
 }
 
 
 static const char *end_capture (MatchState *ms, const char *s,
-                                  const char *p) {
+                                  const PatItem *item) {
   int l = capture_to_close(ms);
   const char *res;
   ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
-  if ((res = match(ms, s, p)) == NULL)  /* match failed? */
+  if ((res = match(ms, s, item)) == NULL)  /* match failed? */
     ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
   return res;
 }
@@ -362,77 +952,65 @@ static const char *match_capture (MatchState *ms, const char *s, int l) {
 }
 
 
-static const char *match (MatchState *ms, const char *s, const char *p) {
+static const char *match (MatchState *ms, const char *s, const PatItem *item) {
   init: /* using goto's to optimize tail recursion */
-  switch (*p) {
-    case '(': {  /* start capture */
-      if (*(p+1) == ')')  /* position capture? */
-        return start_capture(ms, s, p+2, CAP_POSITION);
-      else
-        return start_capture(ms, s, p+1, CAP_UNFINISHED);
+  switch (item->op) {
+    case P_OPEN: {  /* start capture */
+      return start_capture(ms, s, item+1, CAP_UNFINISHED);
     }
-    case ')': {  /* end capture */
-      return end_capture(ms, s, p+1);
+    case P_POSITION: {  /* position capture */
+      return start_capture(ms, s, item+1, CAP_POSITION);
     }
-    case L_ESC: {
-      switch (*(p+1)) {
-        case 'b': {  /* balanced string? */
-          s = matchbalance(ms, s, p+2);
-          if (s == NULL) return NULL;
-          p+=4; goto init;  /* else return match(ms, s, p+4); */
-        }
-        case 'f': {  /* frontier? */
-          const char *ep; char previous;
-          p += 2;
-          if (*p != '[')
-            luaL_error(ms->L, "missing " LUA_QL("[") " after "
-                               LUA_QL("%%f") " in pattern");
-          ep = classend(ms, p);  /* points to what is next */
-          previous = (s == ms->src_init) ? '\0' : *(s-1);
-          if (matchbracketclass(uchar(previous), p, ep-1) ||
-             !matchbracketclass(uchar(*s), p, ep-1)) return NULL;
-          p=ep; goto init;  /* else return match(ms, s, ep); */
-        }
-        default: {
-          if (isdigit(uchar(*(p+1)))) {  /* capture results (%0-%9)? */
-            s = match_capture(ms, s, uchar(*(p+1)));
-            if (s == NULL) return NULL;
-            p+=2; goto init;  /* else return match(ms, s, p+2) */
-          }
-          goto dflt;  /* case default */
-        }
-      }
+    case P_CLOSE: {  /* end capture */
+      return end_capture(ms, s, item+1);
+    }
+    case P_BALANCE: {  /* balanced string */
+      s = matchbalance(ms, s, item);
+      if (s == NULL) return NULL;
+      item++; goto init;  /* else return match(ms, s, item+1); */
     }
-    case '\0': {  /* end of pattern */
+    case P_FRONTIER: {
+      char previous = (s == ms->src_init) ? '\0' : *(s-1);
+      if (testset(ms->sets[item->set], previous) ||
+         !testset(ms->sets[item->set], *s)) return NULL;
+      item++; goto init;  /* else return match(ms, s, item+1); */
+    }
+    case P_BACKREF: {  /* capture results (%0-%9) */
+      s = match_capture(ms, s, item->c1);
+      if (s == NULL) return NULL;
+      item++; goto init;  /* else return match(ms, s, item+1) */
+    }
+    case P_END: {  /* end of pattern */
       return s;  /* match succeeded */
     }
-    case '$': {
-      if (*(p+1) == '\0')  /* is the `$' the last char in pattern? */
-        return (s == ms->src_end) ? s : NULL;  /* check end of string */
-      else goto dflt;
+    case P_ENDANCHOR: {
+      return (s == ms->src_end) ? s : NULL;  /* check end of string */
     }
-    default: dflt: {  /* it is a pattern item */
-      const char *ep = classend(ms, p);  /* points to what is next */
-      int m = s<ms->src_end && singlematch(uchar(*s), p, ep);
-      switch (*ep) {
+    case P_ERROR: {
+      luaL_error(ms->L, patterrors[item->set]);
+      return NULL;
+    }
+    default: {  /* it is a single character item */
+      int m = s<ms->src_end && singlematch(ms, uchar(*s), item);
+      switch (item->rep) {
         case '?': {  /* optional */
           const char *res;
-          if (m && ((res=match(ms, s+1, ep+1)) != NULL))
+          if (m && ((res=match(ms, s+1, item+1)) != NULL))
             return res;
-          p=ep+1; goto init;  /* else return match(ms, s, ep+1); */
+          item++; goto init;  /* else return match(ms, s, item+1); */
         }
         case '*': {  /* 0 or more repetitions */
-          return max_expand(ms, s, p, ep);
+          return max_expand(ms, s, item);
         }
         case '+': {  /* 1 or more repetitions */
-          return (m ? max_expand(ms, s+1, p, ep) : NULL);
+          return (m ? max_expand(ms, s+1, item) : NULL);
         }
         case '-': {  /* 0 or more repetitions (minimum) */
-          return min_expand(ms, s, p, ep);
+          return min_expand(ms, s, item);
         }
         default: {
           if (!m) return NULL;
-          s++; p=ep; goto init;  /* else return match(ms, s+1, ep); */
+          s++; item++; goto init;  /* else return match(ms, s+1, item+1); */
         }
       }
     }
@@ -445,8 +1023,21 @@ static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative `l1' */
+  else if (l2 == 1) return (const char *)memchr(s1, *s2, l1);
   else {
     const char *init;  /* to search for a `*s2' inside `s1' */
+#if defined(STR_SIMD)
+    if (l1 >= l2 + 32) {
+      size_t i = 0;
+      int level = simdlevel();
+      if (level >= SIMD_AVX2) init = memfind_avx2(s1, l1, s2, l2, &i);
+      else if (level >= SIMD_SSE2) init = memfind_sse2(s1, l1, s2, l2, &i);
+      else init = NULL;
+      if (init != NULL) return init;
+      s1 += i;  /* search the rest below */
+      l1 -= i;
+    }
+#endif
     l2--;  /* 1st char will be checked by `memchr' */
     l1 = l1-l2;  /* `s2' cannot be found after that */
     while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
@@ -463,11 +1054,30 @@ static const char *lmemfind (const char *s1, size_t l1,
 }
 
 
+/*
+** Returns the first position from s where a match of the pattern could
+** start, or NULL if there's none.
+*/
+static const char *nextstart (const Pattern *pat, const char *s,
+                                const char *e) {
+  if (pat->prefixlen > 0)
+    return lmemfind(s, e - s, pat->prefix, pat->prefixlen);
+  if (pat->firstset >= 0) {
+    const unsigned char *set = pat->sets[pat->firstset];
+    for (; s < e; s++) {
+      if (testset(set, *s)) return s;
+    }
+    return NULL;
+  }
+  return s;
+}
+
+
 static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
     if (i == 0)  /* ms->level == 0, too */
-      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
+      lua_pushsubstring(ms->L, ms->src_index, s - ms->src_init, e - s);  /* add whole match */
     else
       luaL_error(ms->L, "invalid capture index");
   }
@@ -477,7 +1087,7 @@ static void push_onecapture (MatchState *ms, int i, const char *s,
     if (l == CAP_POSITION)
       lua_pushinteger(ms->L, ms->capture[i].init - ms->src_init + 1);
     else
-      lua_pushlstring(ms->L, ms->capture[i].init, l);
+      lua_pushsubstring(ms->L, ms->src_index, ms->capture[i].init - ms->src_init, l);
   }
 }
 
@@ -511,15 +1121,20 @@ static int str_find_aux (lua_State *L, int find) {
   }
   else {
     MatchState ms;
-    int anchor = (*p == '^') ? (p++, 1) : 0;
+    const Pattern *pat = getpattern(L, 2);
+    const PatItem *item = pat->items + pat->anchor;
     const char *s1=s+init;
     ms.L = L;
     ms.src_init = s;
+    ms.src_index = 1;
     ms.src_end = s+l1;
+    ms.sets = (const CharSet *)pat->sets;
     do {
       const char *res;
+      if (!pat->anchor && (s1 = nextstart(pat, s1, ms.src_end)) == NULL)
+        break;  /* can't match anywhere else */
       ms.level = 0;
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=match(&ms, s1, item)) != NULL) {
         if (find) {
           lua_pushinteger(L, s1-s+1);  /* start */
           lua_pushinteger(L, res-s);   /* end */
@@ -528,7 +1143,7 @@ static int str_find_aux (lua_State *L, int find) {
         else
           return push_captures(&ms, s1, res);
       }
-    } while (s1++ < ms.src_end && !anchor);
+    } while (s1++ < ms.src_end && !pat->anchor);
   }
   lua_pushnil(L);  /* not found */
   return 1;
@@ -549,17 +1164,21 @@ static int gmatch_aux (lua_State *L) {
   MatchState ms;
   size_t ls;
   const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
-  const char *p = lua_tostring(L, lua_upvalueindex(2));
+  const Pattern *pat = (const Pattern *)lua_touserdata(L, lua_upvalueindex(2));
   const char *src;
   ms.L = L;
   ms.src_init = s;
+  ms.src_index = lua_upvalueindex(1);
   ms.src_end = s+ls;
+  ms.sets = (const CharSet *)pat->sets;
   for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
        src <= ms.src_end;
        src++) {
     const char *e;
+    if ((src = nextstart(pat, src, ms.src_end)) == NULL)
+      break;  /* can't match anywhere else */
     ms.level = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
+    if ((e = match(&ms, src, pat->items)) != NULL) {
       lua_Integer newstart = e-s;
       if (e == src) newstart++;  /* empty match? go at least one position */
       lua_pushinteger(L, newstart);
@@ -575,6 +1194,8 @@ static int gmatch (lua_State *L) {
   luaL_checkstring(L, 1);
   luaL_checkstring(L, 2);
   lua_settop(L, 2);
+  getpattern(L, 2);  /* the iterator keeps the compiled pattern */
+  lua_replace(L, 2);
   lua_pushinteger(L, 0);
   lua_pushcclosure(L, gmatch_aux, 3);
   return 1;
@@ -644,24 +1265,39 @@ static void add_value (MatchState *ms, luaL_Buffer *b, const char *s,
 static int str_gsub (lua_State *L) {
   size_t srcl;
   const char *src = luaL_checklstring(L, 1, &srcl);
-  const char *p = luaL_checkstring(L, 2);
   int  tr = lua_type(L, 3);
-  int max_s = luaL_optint(L, 4, srcl+1);
-  int anchor = (*p == '^') ? (p++, 1) : 0;
+  int max_s;
+  const Pattern *pat;
+  const PatItem *item;
+  int anchor;
   int n = 0;
   MatchState ms;
   luaL_Buffer b;
+  luaL_checkstring(L, 2);
+  max_s = luaL_optint(L, 4, srcl+1);
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
+  lua_settop(L, 4);  /* the compiled pattern goes above the arguments */
+  pat = getpattern(L, 2);
+  item = pat->items + pat->anchor;
+  anchor = pat->anchor;
   luaL_buffinit(L, &b);
   ms.L = L;
   ms.src_init = src;
+  ms.src_index = 1;
   ms.src_end = src+srcl;
+  ms.sets = (const CharSet *)pat->sets;
   while (n < max_s) {
     const char *e;
+    if (!anchor) {
+      const char *next = nextstart(pat, src, ms.src_end);
+      if (next == NULL) break;  /* no more matches */
+      luaL_addlstring(&b, src, next - src);  /* keep the skipped text */
+      src = next;
+    }
     ms.level = 0;
-    e = match(&ms, src, p);
+    e = match(&ms, src, item);
     if (e) {
       n++;
       add_value(&ms, &b, src, e);
@@ -722,11 +1358,45 @@ static void addquoted (lua_State *L, luaL_Buffer *b, int arg) {
   luaL_addchar(b, '"');
 }
 
-static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
+/*
+** Format strings are parsed into a list of items, which are cached like
+** patterns so that each call only has to format the arguments. The most
+** common conversions are written directly rather than through sprintf.
+*/
+
+/* item types */
+#define F_LITERAL	0	/* text copied from the format string */
+#define F_SPRINTF	1	/* conversion done with sprintf */
+#define F_INT		2	/* plain %d or %i */
+#define F_HEX		3	/* plain %x or %X */
+#define F_STRING	4	/* plain %s */
+#define F_FIXED		5	/* %.Nf */
+#define F_QUOTED	6	/* %q */
+#define F_ERROR		7	/* invalid format; raises an error if reached */
+
+typedef struct FormatItem {
+  unsigned char type;
+  char conv;  /* conversion character */
+  unsigned char precision;  /* for F_FIXED */
+  const char *error;  /* message for F_ERROR */
+  size_t start, len;  /* text of a F_LITERAL in the format string */
+  char form[MAX_FORMAT];  /* to store the format (`%...') */
+} FormatItem;
+
+typedef struct Format {
+  int nitems;
+  FormatItem items[1];
+} Format;
+
+
+static const char *scanformat (const char *strfrmt, char *form,
+                               const char **error) {
   const char *p = strfrmt;
   while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
-  if ((size_t)(p - strfrmt) >= sizeof(FLAGS))
-    luaL_error(L, "invalid format (repeated flags)");
+  if ((size_t)(p - strfrmt) >= sizeof(FLAGS)) {
+    *error = "invalid format (repeated flags)";
+    return NULL;
+  }
   if (isdigit(uchar(*p))) p++;  /* skip width */
   if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   if (*p == '.') {
@@ -734,8 +1404,10 @@ static const char *scanformat (lua_State *L, const char *strfrmt, char *form) {
     if (isdigit(uchar(*p))) p++;  /* skip precision */
     if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
   }
-  if (isdigit(uchar(*p)))
-    luaL_error(L, "invalid format (width or precision too long)");
+  if (isdigit(uchar(*p))) {
+    *error = "invalid format (width or precision too long)";
+    return NULL;
+  }
   *(form++) = '%';
   strncpy(form, strfrmt, p - strfrmt + 1);
   form += p - strfrmt + 1;
@@ -753,69 +1425,263 @@ static void addintlen (char *form) {
 }
 
 
-static int str_format (lua_State *L) {
-  int arg = 1;
-  size_t sfl;
-  const char *strfrmt = luaL_checklstring(L, arg, &sfl);
+static FormatItem *addformatitem (Format *fmt, int type) {
+  FormatItem *item = &fmt->items[fmt->nitems++];
+  item->type = (unsigned char)type;
+  item->conv = '\0';
+  item->precision = 0;
+  item->error = NULL;
+  item->start = item->len = 0;
+  item->form[0] = '\0';
+  return item;
+}
+
+
+static void compileformat (Format *fmt, const char *strfrmt, size_t sfl) {
+  const char *init = strfrmt;
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
+  fmt->nitems = 0;
   while (strfrmt < strfrmt_end) {
-    if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
-    else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+    if (*strfrmt != L_ESC) {
+      FormatItem *item = addformatitem(fmt, F_LITERAL);
+      item->start = strfrmt - init;
+      while (strfrmt < strfrmt_end && *strfrmt != L_ESC) strfrmt++;
+      item->len = strfrmt - init - item->start;
+    }
+    else if (*++strfrmt == L_ESC) {  /* %% */
+      FormatItem *item = addformatitem(fmt, F_LITERAL);
+      item->start = strfrmt - init;
+      item->len = 1;
+      strfrmt++;
+    }
     else { /* format item */
-      char form[MAX_FORMAT];  /* to store the format (`%...') */
-      char buff[MAX_ITEM];  /* to store the formatted item */
-      arg++;
-      strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          sprintf(buff, form, (int)luaL_checknumber(L, arg));
+      FormatItem *item = addformatitem(fmt, F_SPRINTF);
+      const char *error = NULL;
+      strfrmt = scanformat(strfrmt, item->form, &error);
+      if (strfrmt == NULL) {
+        item->type = F_ERROR;
+        item->error = error;
+        return;
+      }
+      item->conv = *strfrmt++;
+      switch (item->conv) {
+        case 'c': case 'e': case 'E': case 'g': case 'G': {
+          break;
+        }
+        case 'd': case 'i': {
+          if (item->form[2] == '\0') item->type = F_INT;
+          addintlen(item->form);
           break;
         }
-        case 'd':  case 'i': {
-          addintlen(form);
-          sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
+        case 'x': case 'X': {
+          if (item->form[2] == '\0') item->type = F_HEX;
+          addintlen(item->form);
           break;
         }
-        case 'o':  case 'u':  case 'x':  case 'X': {
-          addintlen(form);
-          sprintf(buff, form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
+        case 'o': case 'u': {
+          addintlen(item->form);
           break;
         }
-        case 'e':  case 'E': case 'f':
-        case 'g': case 'G': {
-          sprintf(buff, form, (double)luaL_checknumber(L, arg));
+        case 'f': {
+          /* %.Nf with a single digit precision */
+          if (item->form[1] == '.' && isdigit(uchar(item->form[2])) &&
+              item->form[3] == 'f') {
+            item->type = F_FIXED;
+            item->precision = (unsigned char)(item->form[2] - '0');
+          }
           break;
         }
         case 'q': {
-          addquoted(L, &b, arg);
-          continue;  /* skip the 'addsize' at the end */
+          item->type = F_QUOTED;
+          break;
         }
         case 's': {
-          size_t l;
-          const char *s = luaL_checklstring(L, arg, &l);
-          if (!strchr(form, '.') && l >= 100) {
-            /* no precision and string is too long to be formatted;
-               keep original string */
-            lua_pushvalue(L, arg);
-            luaL_addvalue(&b);
-            continue;  /* skip the `addsize' at the end */
+          if (item->form[2] == '\0') item->type = F_STRING;
+          break;
+        }
+        default: {  /* also treat cases `pnLlh' */
+          item->type = F_ERROR;
+          return;
+        }
+      }
+    }
+  }
+}
+
+
+/*
+** Returns the parsed form of the format string at index idx, which is pushed
+** onto the stack so that it's kept alive while it's in use.
+*/
+static const Format *getformat (lua_State *L, int idx) {
+  Format *fmt = (Format *)findcached(L, "_FORMATS", idx);
+  if (fmt == NULL) {
+    size_t sfl, i;
+    int n = 1;
+    const char *strfrmt = lua_tolstring(L, idx, &sfl);
+    for (i = 0; i < sfl; i++) {  /* each `%' starts at most two items */
+      if (strfrmt[i] == L_ESC) n += 2;
+    }
+    fmt = (Format *)lua_newuserdata(L, sizeof(Format) +
+                                       (n - 1) * sizeof(FormatItem));
+    compileformat(fmt, strfrmt, sfl);
+    addcached(L, idx);
+  }
+  return fmt;
+}
+
+
+/* writes the digits of n backwards ending at e and returns the start */
+static char *adddigits (char *e, unsigned LUA_INTFRM_T n, int base,
+                        const char *digits) {
+  do {
+    *--e = digits[n % base];
+    n /= base;
+  } while (n != 0);
+  return e;
+}
+
+
+/*
+** Formats x with precision digits after the decimal point into the buffer
+** ending at e and returns the start, or NULL if the result can't be
+** guaranteed to match sprintf.
+*/
+static char *addfixed (char *e, double x, int precision) {
+  static const double scale[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9
+  };
+  int negative = (x < 0 || (x == 0 && 1 / x < 0));
+  double scaled = fabs(x) * scale[precision];
+  double r, frac;
+  int i;
+  /* keep the error from the multiplication well below the distance to the
+     rounding point, since sprintf rounds the exact value of x */
+  if (!(scaled < 1e12)) return NULL;  /* also catches NaN */
+  r = floor(scaled);
+  frac = scaled - r;
+  if (fabs(frac - 0.5) < 1e-3) return NULL;
+  if (frac > 0.5) r += 1;
+  for (i = 0; i < precision; i++) {
+    double d = fmod(r, 10);
+    *--e = (char)('0' + (int)d);
+    r = (r - d) / 10;
+  }
+  if (precision > 0) *--e = '.';
+  do {
+    double d = fmod(r, 10);
+    *--e = (char)('0' + (int)d);
+    r = (r - d) / 10;
+  } while (r != 0);
+  if (negative) *--e = '-';
+  return e;
+}
+
+
+static int str_format (lua_State *L) {
+  int arg = 1;
+  const char *strfrmt = luaL_checkstring(L, arg);
+  const Format *fmt = getformat(L, arg);
+  int i;
+  luaL_Buffer b;
+  /* the cache keeps the format alive, since no Lua code runs until we're
+     done with it, so it doesn't need to take up an argument's index */
+  lua_pop(L, 1);
+  luaL_buffinit(L, &b);
+  for (i = 0; i < fmt->nitems; i++) {
+    const FormatItem *item = &fmt->items[i];
+    char buff[MAX_ITEM];  /* to store the formatted item */
+    char *e = buff + MAX_ITEM;
+    char *s = NULL;
+    if (item->type == F_LITERAL) {
+      luaL_addlstring(&b, strfrmt + item->start, item->len);
+      continue;
+    }
+    arg++;
+    switch (item->type) {
+      case F_INT: {
+        LUA_INTFRM_T n = (LUA_INTFRM_T)luaL_checknumber(L, arg);
+        unsigned LUA_INTFRM_T u = (unsigned LUA_INTFRM_T)n;
+        s = adddigits(e, (n < 0) ? 0u - u : u, 10, "0123456789");
+        if (n < 0) *--s = '-';
+        break;
+      }
+      case F_HEX: {
+        unsigned LUA_INTFRM_T u =
+            (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg);
+        s = adddigits(e, u, 16, (item->conv == 'x') ? "0123456789abcdef"
+                                                     : "0123456789ABCDEF");
+        break;
+      }
+      case F_FIXED: {
+        double x = (double)luaL_checknumber(L, arg);
+        s = addfixed(e, x, item->precision);
+        if (s == NULL) {
+          sprintf(buff, item->form, x);
+          s = buff;
+          e = buff + strlen(buff);
+        }
+        break;
+      }
+      case F_STRING: {
+        size_t l;
+        const char *str = luaL_checklstring(L, arg, &l);
+        /* short strings are copied up to an embedded zero like sprintf */
+        luaL_addlstring(&b, str, (l < 100) ? strlen(str) : l);
+        continue;
+      }
+      case F_QUOTED: {
+        addquoted(L, &b, arg);
+        continue;
+      }
+      case F_ERROR: {
+        if (item->error != NULL)
+          return luaL_error(L, "%s", item->error);
+        return luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
+                             LUA_QL("format"), item->conv);
+      }
+      default: {
+        switch (item->conv) {
+          case 'c': {
+            sprintf(buff, item->form, (int)luaL_checknumber(L, arg));
+            break;
           }
-          else {
-            sprintf(buff, form, s);
+          case 'd':  case 'i': {
+            sprintf(buff, item->form,
+                    (LUA_INTFRM_T)luaL_checknumber(L, arg));
+            break;
+          }
+          case 'o':  case 'u':  case 'x':  case 'X': {
+            sprintf(buff, item->form,
+                    (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
+            break;
+          }
+          case 'e':  case 'E': case 'f':
+          case 'g': case 'G': {
+            sprintf(buff, item->form,
+                    (double)luaL_checknumber(L, arg));
+            break;
+          }
+          case 's': {
+            size_t l;
+            const char *str = luaL_checklstring(L, arg, &l);
+            if (!strchr(item->form, '.') && l >= 100) {
+              /* no precision and string is too long to be formatted;
+                 keep original string */
+              lua_pushvalue(L, arg);
+              luaL_addvalue(&b);
+              continue;
+            }
+            sprintf(buff, item->form, str);
             break;
           }
         }
-        default: {  /* also treat cases `pnLlh' */
-          return luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
-                               LUA_QL("format"), *(strfrmt - 1));
-        }
+        s = buff;
+        e = buff + strlen(buff);
+        break;
       }
-      luaL_addlstring(&b, buff, strlen(buff));
     }
+    luaL_addlstring(&b, s, e - s);
   }
   luaL_pushresult(&b);
   return 1;
@@ -5,6 +5,7 @@
 */
 
 
+#include <limits.h>
 #include <stddef.h>
 
 #define ltablib_c
@@ -99,6 +100,8 @@ static int tinsert (lua_State *L) {
       int i;
       pos = luaL_checkint(L, 2);  /* 2nd argument is the position */
       if (pos > e) e = pos;  /* `grow' array if necessary */
+      else if (lua_arrayinsert(L, 1, pos))  /* move up in the array part? */
+        return 0;
       for (i = e; i > pos; i--) {  /* move up elements */
         lua_rawgeti(L, 1, i-1);
         lua_rawseti(L, 1, i);  /* t[i] = t[i-1] */
@@ -121,6 +124,8 @@ static int tremove (lua_State *L) {
   if (!(1 <= pos && pos <= e))  /* position is outside bounds? */
    return 0;  /* nothing to remove */
   luaL_setn(L, 1, e - 1);  /* t.n = n-1 */
+  if (lua_arrayremove(L, 1, pos))  /* move down in the array part? */
+    return 1;
   lua_rawgeti(L, 1, pos);  /* result = t[pos] */
   for ( ;pos<e; pos++) {
     lua_rawgeti(L, 1, pos+1);
@@ -149,6 +154,8 @@ static int tconcat (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   i = luaL_optint(L, 3, 1);
   last = luaL_opt(L, luaL_checkint, 4, luaL_getn(L, 1));
+  if (lua_arrayconcat(L, 1, sep, lsep, i, last))  /* build in one piece? */
+    return 1;
   luaL_buffinit(L, &b);
   for (; i < last; i++) {
     addfield(L, &b, i);
@@ -161,6 +168,75 @@ static int tconcat (lua_State *L) {
 }
 
 
+/*
+** Copy elements (1[f], ..., 1[e]) into (tt[t], tt[t+1], ...), where tt is
+** the table in the 5th argument (or the 1st one if absent). Follows the
+** semantics of table.move from Lua 5.3.
+*/
+static int tmove (lua_State *L) {
+  int f = luaL_checkint(L, 2);
+  int e = luaL_checkint(L, 3);
+  int t = luaL_checkint(L, 4);
+  int tt = !lua_isnoneornil(L, 5) ? 5 : 1;  /* destination table */
+  luaL_checktype(L, 1, LUA_TTABLE);
+  luaL_checktype(L, tt, LUA_TTABLE);
+  if (e >= f) {  /* otherwise, nothing to move */
+    int n, i;
+    luaL_argcheck(L, f > 0 || e < INT_MAX + f, 3,
+                  "too many elements to move");
+    n = e - f + 1;  /* number of elements to move */
+    luaL_argcheck(L, t <= INT_MAX - n + 1, 4,
+                  "destination wrap around");
+    if (lua_arraymove(L, 1, f, e, t, tt)) {  /* copy in one piece? */
+      lua_pushvalue(L, tt);
+      return 1;
+    }
+    if (t > e || t <= f || (tt != 1 && !lua_rawequal(L, 1, tt))) {
+      for (i = 0; i < n; i++) {
+        lua_pushinteger(L, f + i);
+        lua_gettable(L, 1);
+        lua_pushinteger(L, t + i);
+        lua_insert(L, -2);
+        lua_settable(L, tt);
+      }
+    }
+    else {
+      for (i = n - 1; i >= 0; i--) {
+        lua_pushinteger(L, f + i);
+        lua_gettable(L, 1);
+        lua_pushinteger(L, t + i);
+        lua_insert(L, -2);
+        lua_settable(L, tt);
+      }
+    }
+  }
+  lua_pushvalue(L, tt);  /* return destination table */
+  return 1;
+}
+
+
+static int tclone (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_clonetable(L, 1, lua_toboolean(L, 2));
+  return 1;
+}
+
+
+static int tfreeze (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_freezetable(L, 1);
+  lua_settop(L, 1);
+  return 1;  /* return the table */
+}
+
+
+static int tisfrozen (lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_pushboolean(L, lua_isfrozen(L, 1));
+  return 1;
+}
+
+
 
 /*
 ** {======================================================
@@ -258,6 +334,8 @@ static int sort (lua_State *L) {
   luaL_checkstack(L, 40, "");  /* assume array is smaller than 2^40 */
   if (!lua_isnoneornil(L, 2))  /* is there a 2nd argument? */
     luaL_checktype(L, 2, LUA_TFUNCTION);
+  else if (lua_arraysort(L, 1, n))  /* default order on a plain array? */
+    return 0;
   lua_settop(L, 2);  /* make sure there is two arguments */
   auxsort(L, 1, n);
   return 0;
@@ -267,12 +345,16 @@ static int sort (lua_State *L) {
 
 
 static const luaL_Reg tab_funcs[] = {
+  {"clone", tclone},
   {"concat", tconcat},
   {"foreach", foreach},
   {"foreachi", foreachi},
+  {"freeze", tfreeze},
   {"getn", getn},
   {"maxn", maxn},
   {"insert", tinsert},
+  {"isfrozen", tisfrozen},
+  {"move", tmove},
   {"remove", tremove},
   {"setn", setn},
   {"sort", sort},
@@ -88,6 +88,8 @@ Prototype* Prototype_Create(lua_State* L)
     prototype->upValue              = NULL;
     prototype->numPrototypes        = 0;
     prototype->prototype            = NULL;
+    prototype->numTableTemplates    = 0;
+    prototype->tableTemplate        = NULL;
     prototype->local                = NULL;
     prototype->numLocals            = 0;
     prototype->lineDefined          = 0;
@@ -150,10 +152,166 @@ static Instruction EncodeAsD(Opcode opcode, int a, int d)
     return opcode | (a << 8) | ((d + 32767) << 16); 
 }
 
-static void ConvertInstruction(Instruction*& dst, const Instruction*& src)
+#define RK_CONST(x) (x & 256)
+
+/**
+ * The code being converted, used to find the table constructors which can be
+ * replaced with templates.
+ */
+struct TemplateSource
+{
+    const Instruction*  code;
+    const Value*        constant;
+    const char*         isJumpTarget;   // One entry for each instruction.
+};
+
+/**
+ * Converts a size from the "floating point byte" format used for the
+ * operands of NewTable.
+ */
+static int DecodeTableSize(int x)
 {
+    int e = (x >> 3) & 31;
+    return (e == 0) ? x : ((x & 7) + 8) << (e - 1);
+}
 
-#define RK_CONST(x) (x & 256)
+/**
+ * Marks the instructions in the code which can be jumped to.
+ */
+static void FindJumpTargets(const Instruction* code, int codeSize, char* isJumpTarget)
+{
+    memset( isJumpTarget, 0, codeSize );
+    for (int pc = 0; pc < codeSize; ++pc)
+    {
+        Instruction inst = code[pc];
+        int target = -1;
+        switch (LUA_GET_OPCODE(inst))
+        {
+        case Opcode_Jmp:
+        case Opcode_ForLoop:
+        case Opcode_ForPrep:
+            target = pc + 1 + LUA_GET_sBx(inst);
+            break;
+        case Opcode_Eq:
+        case Opcode_Lt:
+        case Opcode_Le:
+        case Opcode_Test:
+        case Opcode_TestSet:
+        case Opcode_TForLoop:
+            target = pc + 2;
+            break;
+        case Opcode_LoadBool:
+            if (LUA_GET_C(inst) != 0)
+            {
+                target = pc + 2;
+            }
+            break;
+        case Opcode_SetList:
+            if (LUA_GET_C(inst) == 0)
+            {
+                // The next word is the block number, not an instruction.
+                ++pc;
+            }
+            break;
+        default:
+            break;
+        }
+        if (target >= 0 && target < codeSize)
+        {
+            isJumpTarget[target] = 1;
+        }
+    }
+}
+
+/**
+ * Returns the number of instructions in the table constructor which starts
+ * with the NewTable instruction at src if the constructor only contains
+ * constants, otherwise returns 0. The fields of such a constructor are
+ * loaded into registers with LoadK, LoadBool or LoadNil and stored with
+ * SetList, or stored directly with SetTable using constant keys and values.
+ * Only as many fields as the sizes given to NewTable are included, and the
+ * constructor stops before any instruction which is jumped to, so the code
+ * after the constructor (such as the start of a loop) isn't mistaken for a
+ * part of it.
+ */
+static int GetConstantConstructorSize(const Instruction* src, const Instruction* end, const TemplateSource* source)
+{
+
+    ASSERT( LUA_GET_OPCODE(*src) == Opcode_NewTable );
+    int a = LUA_GET_A(*src);
+
+    int maxListItems = DecodeTableSize(LUA_GET_B(*src));
+    int maxHashItems = DecodeTableSize(LUA_GET_C(*src));
+
+    int size = 0;
+    int numLoaded = 0;  // Number of list items waiting to be stored.
+    int numListItems = 0;
+    int numHashItems = 0;
+
+    const Instruction* s = src + 1;
+    while (s < end && !source->isJumpTarget[s - source->code])
+    {
+
+        Instruction inst = *s;
+        Opcode opcode = LUA_GET_OPCODE(inst);
+        int ia = LUA_GET_A(inst);
+        int b  = LUA_GET_B(inst);
+        int c  = LUA_GET_C(inst);
+
+        if ((opcode == Opcode_LoadK || opcode == Opcode_LoadBool || opcode == Opcode_LoadNil) &&
+            ia == a + 1 + numLoaded)
+        {
+            int last = (opcode == Opcode_LoadNil) ? b : ia;
+            if ((opcode == Opcode_LoadBool && c != 0) || last - a > LFIELDS_PER_FLUSH ||
+                numListItems + last - a > maxListItems)
+            {
+                break;
+            }
+            numLoaded = last - a;
+        }
+        else if (opcode == Opcode_SetTable && ia == a && RK_CONST(b) && RK_CONST(c) &&
+                 numHashItems < maxHashItems)
+        {
+            // A nil or NaN key is an error which needs to be raised when the
+            // code is run.
+            const Value* key = &source->constant[b & 255];
+            if (Value_GetIsNil(key) || Value_GetIsNaN(key))
+            {
+                break;
+            }
+            ++numHashItems;
+        }
+        else if (opcode == Opcode_SetList && ia == a && b != 0 && b == numLoaded)
+        {
+            if (c == 0)
+            {
+                ++s;
+            }
+            numListItems += numLoaded;
+            numLoaded = 0;
+        }
+        else
+        {
+            break;
+        }
+
+        ++s;
+
+        // The constructor can only end once all of the items have been stored.
+        if (numLoaded == 0)
+        {
+            size = static_cast<int>(s - src);
+        }
+
+    }
+
+    return size;
+
+}
+
+static void ConvertInstruction(Instruction*& dst, const Instruction*& src, const Instruction* end,
+    const TemplateSource* source, int& numTemplates)
+{
 
     static const Opcode arithOp[] =
         {
@@ -286,10 +444,28 @@ static void ConvertInstruction(Instruction*& dst, const Instruction*& src)
         }
         break;
     case Opcode_NewTable:
-        // TODO: We need to encode b and c differently since they can be
-        // larger than a single byte. To avoid problems for the moment,
-        // we just make them 0.
-        *dst = EncodeABC(opcode, a, 0, 0); 
+        {
+            // Constructors which only contain constants are replaced with a
+            // copy of a table built when the code is converted.
+            int size = 0;
+            if (source != NULL && numTemplates < 65536)
+            {
+                size = GetConstantConstructorSize(src, end, source);
+            }
+            if (size > 0)
+            {
+                *dst = EncodeAD(Opcode_NewTableT, a, numTemplates);
+                ++numTemplates;
+                src += size - 1;
+            }
+            else
+            {
+                // TODO: We need to encode b and c differently since they can be
+                // larger than a single byte. To avoid problems for the moment,
+                // we just make them 0.
+                *dst = EncodeABC(opcode, a, 0, 0);
+            }
+        }
         break;
     case Opcode_Self:
         *dst = EncodeABC(RK_CONST(c) ? Opcode_SelfC : Opcode_Self, a, b, c & 255); 
@@ -386,22 +562,32 @@ static void ConvertInstruction(Instruction*& dst, const Instruction*& src)
 
 }
 
-int Prototype_GetConvertedCodeSize(const Instruction* src, int codeSize)
+/**
+ * If source is NULL, the size doesn't take into account the constructors
+ * which are replaced with table templates.
+ */
+static int Prototype_GetConvertedCodeSize(const Instruction* src, int codeSize, const TemplateSource* source)
 {
     int size = 0;
+    int numTemplates = 0;
     const Instruction* end = src + codeSize;
     while (src < end)
     {
         Instruction buffer[32];
         Instruction* dst = buffer;
-        ConvertInstruction(dst, src);
+        ConvertInstruction(dst, src, end, source, numTemplates);
         ASSERT(dst < buffer + 32);
         size += static_cast<int>(dst - buffer);
     }
     return size;
 }
 
-static int GetJumpAdjustment(const char* adjustment, int jump)
+int Prototype_GetConvertedCodeSize(const Instruction* src, int codeSize)
+{
+    return Prototype_GetConvertedCodeSize(src, codeSize, NULL);
+}
+
+static int GetJumpAdjustment(const int* adjustment, int jump)
 {
     int result = 0;
     if (jump > 0)
@@ -421,7 +607,7 @@ static int GetJumpAdjustment(const char* adjustment, int jump)
     return result;
 }
 
-static void AdjustJump(Instruction* dst, const char* adjustment)
+static void AdjustJump(Instruction* dst, const int* adjustment)
 {
 
     Opcode opcode = VM_GET_OPCODE(*dst); 
@@ -444,31 +630,37 @@ static void AdjustJump(Instruction* dst, const char* adjustment)
             sd += GetJumpAdjustment(adjustment, sd);
             *dst = EncodeAsD(opcode, a, sd);
         }
+        break;
+    case Opcode_NewTableT:
+        // D is the index of the template, not a jump offset.
+        break;
     }
 
 }
 
 /** Translates an instruction block from standard Lua opcodes to our own encoding.
  * src and dst can be the same. */
-static void Prototype_ConvertCode(lua_State* L, Instruction* _dst, const Instruction* src, int* dstLine, const int* srcLine, int dstCodeSize, int codeSize)
+static void Prototype_ConvertCode(lua_State* L, Instruction* _dst, const Instruction* src, int* dstLine, const int* srcLine, int dstCodeSize, int codeSize,
+    const TemplateSource* source)
 {
 
     // Track how much jumps needs to be adjusted based on the change
     // in size of instructions during our conversion process.
-    char* adjustment = AllocateArray<char>(L, codeSize);
-    memset( adjustment, 0, sizeof(char) * codeSize );
+    int* adjustment = AllocateArray<int>(L, codeSize);
+    memset( adjustment, 0, sizeof(int) * codeSize );
 
     char* dstSizes = AllocateArray<char>(L, dstCodeSize);
     memset( dstSizes, 0, sizeof(char) * dstCodeSize );
 
-    char* srcSizes = AllocateArray<char>(L, codeSize);
-    memset( srcSizes, 0, sizeof(char) * codeSize );
+    int* srcSizes = AllocateArray<int>(L, codeSize);
+    memset( srcSizes, 0, sizeof(int) * codeSize );
 
     int dstIp = 0;
     int srcIp = 0;
 
     Instruction* dst = _dst;
     const Instruction* end = src + codeSize;
+    int numTemplates = 0;
 
     while (src < end)
     {
@@ -476,7 +668,7 @@ static void Prototype_ConvertCode(lua_State* L, Instruction* _dst, const Instruc
         const Instruction* s = src;
         const Instruction* d = dst;
 
-        ConvertInstruction(dst, src);
+        ConvertInstruction(dst, src, end, source, numTemplates);
 
         int srcSize = static_cast<int>(src - s);
         int dstSize = static_cast<int>(dst - d);
@@ -515,9 +707,129 @@ static void Prototype_ConvertCode(lua_State* L, Instruction* _dst, const Instruc
         srcIp += srcSize;
     }
 
-    FreeArray<char>(L, adjustment, codeSize);
+    FreeArray<int>(L, adjustment, codeSize);
     FreeArray<char>(L, dstSizes, dstCodeSize);
-    FreeArray<char>(L, srcSizes, codeSize);
+    FreeArray<int>(L, srcSizes, codeSize);
+
+}
+
+/**
+ * Builds the table for a constructor which only contains constants (as
+ * identified by GetConstantConstructorSize) by running its instructions.
+ */
+static Table* Prototype_CreateTableTemplate(lua_State* L, const Instruction* src, int size, Value* constant)
+{
+
+    Table* table = Table_Create(L, 0, 0);
+
+    Value item[LFIELDS_PER_FLUSH];
+    const Instruction* end = src + size;
+    int a = LUA_GET_A(*src);
+
+    for (++src; src < end; ++src)
+    {
+        Instruction inst = *src;
+        int ia = LUA_GET_A(inst);
+        int b  = LUA_GET_B(inst);
+        int c  = LUA_GET_C(inst);
+        switch (LUA_GET_OPCODE(inst))
+        {
+        case Opcode_LoadK:
+            item[ia - a - 1] = constant[LUA_GET_Bx(inst)];
+            break;
+        case Opcode_LoadBool:
+            SetValue( &item[ia - a - 1], b != 0 );
+            break;
+        case Opcode_LoadNil:
+            Value_SetRangeNil( &item[ia - a - 1], &item[b - a] );
+            break;
+        case Opcode_SetTable:
+            Table_SetTable( L, table, &constant[b & 255], &constant[c & 255] );
+            break;
+        case Opcode_SetList:
+            {
+                if (c == 0)
+                {
+                    c = *(++src);
+                }
+                int offset = (c - 1) * LFIELDS_PER_FLUSH;
+                if (!Table_FillArray( L, table, offset + 1, item, b ))
+                {
+                    for (int i = 1; i <= b; ++i)
+                    {
+                        Table_SetTable( L, table, i + offset, &item[i - 1] );
+                    }
+                }
+            }
+            break;
+        default:
+            ASSERT(0);
+        }
+    }
+
+    return table;
+
+}
+
+/**
+ * Creates the template tables for the constructors in the prototype which
+ * only contain constants.
+ */
+static void Prototype_CreateTableTemplates(lua_State* L, Prototype* prototype, const TemplateSource* source)
+{
+
+    const Instruction* start = prototype->code;
+    const Instruction* end   = start + prototype->codeSize;
+
+    // Find the number of templates first so we can allocate the array. The
+    // code is walked in the same way as ConvertInstruction so that the
+    // templates are numbered in the same order.
+    for (int pass = 0; pass < 2; ++pass)
+    {
+
+        int numTemplates = 0;
+        const Instruction* src = start;
+
+        while (src < end && numTemplates < 65536)
+        {
+            Opcode opcode = LUA_GET_OPCODE(*src);
+            int size = 0;
+            if (opcode == Opcode_NewTable)
+            {
+                size = GetConstantConstructorSize(src, end, source);
+            }
+            if (size > 0)
+            {
+                if (pass == 1)
+                {
+                    Table* table = Prototype_CreateTableTemplate(L, src, size, prototype->constant);
+                    prototype->tableTemplate[numTemplates] = table;
+                    ++prototype->numTableTemplates;
+                    Gc_IncrementReference(&L->gc, prototype, table);
+                }
+                ++numTemplates;
+                src += size;
+            }
+            else if (opcode == Opcode_SetList && LUA_GET_C(*src) == 0)
+            {
+                src += 2;
+            }
+            else
+            {
+                ++src;
+            }
+        }
+
+        if (pass == 0)
+        {
+            if (numTemplates == 0)
+            {
+                return;
+            }
+            prototype->tableTemplate = AllocateArray<Table*>(L, numTemplates);
+        }
+
+    }
 
 }
 
@@ -526,7 +838,17 @@ void Prototype_ConvertCode(lua_State* L, Prototype* prototype)
     
     ASSERT(prototype->convertedCode == NULL);
 
-    int convertedCodeSize = Prototype_GetConvertedCodeSize(prototype->code, prototype->codeSize);
+    char* isJumpTarget = AllocateArray<char>(L, prototype->codeSize);
+    FindJumpTargets(prototype->code, prototype->codeSize, isJumpTarget);
+
+    TemplateSource source;
+    source.code         = prototype->code;
+    source.constant     = prototype->constant;
+    source.isJumpTarget = isJumpTarget;
+
+    Prototype_CreateTableTemplates(L, prototype, &source);
+
+    int convertedCodeSize = Prototype_GetConvertedCodeSize(prototype->code, prototype->codeSize, &source);
     prototype->convertedCode = AllocateArray<Instruction>(L, convertedCodeSize);
     prototype->convertedCodeSize = convertedCodeSize;
 
@@ -541,7 +863,10 @@ void Prototype_ConvertCode(lua_State* L, Prototype* prototype)
         prototype->convertedSourceLine,
         prototype->sourceLine,
         prototype->convertedCodeSize,
-        prototype->codeSize);
+        prototype->codeSize,
+        &source);
+
+    FreeArray<char>(L, isJumpTarget, prototype->codeSize);
     
     for (int i = 0; i < prototype->numPrototypes; ++i)
     {
@@ -759,6 +1084,10 @@ void Prototype_Destroy(lua_State* L, Prototype* prototype, bool releaseRefs)
         {
             Gc_DecrementReference(L, gc, prototype->prototype[i]);
         }
+        for (int i = 0; i < prototype->numTableTemplates; ++i)
+        {
+            Gc_DecrementReference(L, gc, prototype->tableTemplate[i]);
+        }
         if (prototype->source != NULL)
         {
             Gc_DecrementReference(L, gc, prototype->source);
@@ -770,6 +1099,7 @@ void Prototype_Destroy(lua_State* L, Prototype* prototype, bool releaseRefs)
     Free(L, prototype->constant, prototype->numConstants * sizeof(Value));
     Free(L, prototype->upValue, prototype->maxUpValues * sizeof(String*));
     Free(L, prototype->prototype, prototype->numPrototypes * sizeof(Prototype*));
+    Free(L, prototype->tableTemplate, prototype->numTableTemplates * sizeof(Table*));
     Free(L, prototype->local, prototype->numLocals * sizeof(LocVar));
 
     if (prototype->sourceLine != NULL)
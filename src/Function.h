@@ -40,6 +40,8 @@ struct Prototype : public Gc_Object
     String**            upValue;
     int                 numPrototypes;
     Prototype**         prototype;
+    int                 numTableTemplates;
+    Table**             tableTemplate;  // Tables for constructors which only contain constants.
 
     LocVar*             local;
     int                 numLocals;
@@ -14,6 +14,7 @@
 #include "UpValue.h"
 
 #include <stdio.h>
+#include <string.h>
 
 namespace
 {
@@ -78,8 +79,11 @@ static void Gc_FreeObject(lua_State* L, Gc* gc, Gc_Object* object, bool releaseR
     switch (object->type)
     {
     case LUA_TSTRING:
-        StringPool_Remove( L, &L->stringPool, static_cast<String*>(object) );
-        String_Destroy( L, static_cast<String*>(object) );
+        if (!String_GetIsLong(static_cast<String*>(object)))
+        {
+            StringPool_Remove( L, &L->stringPool, static_cast<String*>(object) );
+        }
+        String_Destroy( L, static_cast<String*>(object), releaseRefs );
         break;
     case LUA_TTABLE:
         Table_Destroy( L, static_cast<Table*>(object), releaseRefs );
@@ -113,9 +117,11 @@ void Gc_Initialize(lua_State* L, Gc* gc)
 {
     gc->first       = NULL;
     gc->firstGrey   = NULL;
+    gc->firstWeak   = NULL;
     gc->state       = Gc_State_Paused;
     gc->threshold   = _gcThreshold;
     gc->scanMark    = 0;
+    gc->compact     = false;
 
     // Compute the size of the young object array so that it's unlikely we'll
     // overflow it before hitting our threshold for running the young collector.
@@ -175,6 +181,7 @@ void* Gc_AllocateObject(lua_State* L, int type, size_t size)
     }
 
     object->refCount    = 0;
+    object->fixed       = false;
     object->young       = false;
     object->scanMark    = gc->scanMark;
 
@@ -237,6 +244,157 @@ static void Gc_MarkValue(Gc* gc, Value* value)
     }
 }
 
+static void Gc_MarkNodes(Gc* gc, TableNode* node, int numNodes)
+{
+    TableNode* end = node + numNodes;
+    while (node < end)
+    {
+        // Dead nodes keep their keys for iteration.
+        Gc_MarkValue(gc, &node->key);
+        if (!node->dead)
+        {
+            Gc_MarkValue(gc, &node->value);
+        }
+        ++node;
+    }
+}
+
+/**
+ * Marks the nodes of a weak table. Entries which are only referenced by weak
+ * references are not marked. For weak keys, the value is only marked if the
+ * key is reachable (ephemeron semantics), which may not be known until later
+ * in the mark phase; those are handled by Gc_MarkEphemerons. The keys of dead
+ * nodes are only needed for iteration, so they are always treated as weak.
+ */
+static void Gc_MarkWeakNodes(Gc* gc, Table* table, TableNode* node, int numNodes)
+{
+    TableNode* end = node + numNodes;
+    while (node < end)
+    {
+        bool weakKey = table->weakKeys || node->dead;
+        if (!weakKey || Value_GetIsString(&node->key))
+        {
+            Gc_MarkValue(gc, &node->key);
+        }
+        if (!node->dead)
+        {
+            if (table->weakValues)
+            {
+                if (Value_GetIsString(&node->value))
+                {
+                    Gc_MarkValue(gc, &node->value);
+                }
+            }
+            else if (!Gc_GetIsClearable(&node->key))
+            {
+                Gc_MarkValue(gc, &node->value);
+            }
+        }
+        ++node;
+    }
+}
+
+static void Gc_MarkWeakTable(Gc* gc, Table* table)
+{
+
+    if (table->weakValues)
+    {
+        if (!table->numericArray)
+        {
+            for (int i = 0; i < table->size; ++i)
+            {
+                if (Value_GetIsString(&table->element[i]))
+                {
+                    Gc_MarkValue(gc, &table->element[i]);
+                }
+            }
+        }
+    }
+    else
+    {
+        // The array keys are numbers, so they can't be collected.
+        if (!table->numericArray)
+        {
+            for (int i = 0; i < table->size; ++i)
+            {
+                Gc_MarkValue(gc, &table->element[i]);
+            }
+        }
+    }
+
+    Gc_MarkWeakNodes(gc, table, table->nodes, table->numNodes);
+    Gc_MarkWeakNodes(gc, table, table->oldNodes, table->numOldNodes);
+
+    // The shape keys are strings, so only the values can be weak.
+    const Shape* shape = table->shape;
+    if (shape != NULL)
+    {
+        for (int i = 0; i < shape->numKeys; ++i)
+        {
+            Gc_MarkObject(gc, shape->key[i]);
+            if (!table->weakValues || Value_GetIsString(&table->slot[i]))
+            {
+                Gc_MarkValue(gc, &table->slot[i]);
+            }
+        }
+    }
+
+    // Remember the table so that we can clear out the dead entries before the
+    // sweep.
+    table->nextWeak = gc->firstWeak;
+    gc->firstWeak = table;
+
+}
+
+/**
+ * Marks the values in the weak key tables whose keys have been marked. Returns
+ * true if anything new was marked.
+ */
+static bool Gc_MarkEphemerons(Gc* gc)
+{
+    for (Table* table = gc->firstWeak; table != NULL; table = table->nextWeak)
+    {
+        if (table->weakKeys && !table->weakValues)
+        {
+            for (int pass = 0; pass < 2; ++pass)
+            {
+                TableNode* node    = (pass == 0) ? table->nodes : table->oldNodes;
+                TableNode* endNode = node + ((pass == 0) ? table->numNodes : table->numOldNodes);
+                for (; node < endNode; ++node)
+                {
+                    if (!node->dead && !Gc_GetIsClearable(&node->key))
+                    {
+                        Gc_MarkValue(gc, &node->value);
+                    }
+                }
+            }
+        }
+    }
+    return gc->firstGrey != NULL;
+}
+
+/**
+ * Reads the __mode field from the metatable to determine which references
+ * in the table are weak. This is called while marking, so it must not
+ * allocate (which rules out getting null terminated data for a slice).
+ */
+static void Gc_UpdateWeakMode(lua_State* L, Table* table)
+{
+    table->weakKeys   = false;
+    table->weakValues = false;
+    if (table->metatable != NULL)
+    {
+        const Value* mode = Table_GetTable(L, table->metatable, L->tagMethodName[TagMethod_Mode]);
+        if (Value_GetIsString(mode))
+        {
+            const String* string = mode->string;
+            const char* data = String_GetData(string);
+            table->weakKeys   = memchr(data, 'k', string->length) != NULL;
+            table->weakValues = memchr(data, 'v', string->length) != NULL;
+        }
+    }
+}
+
 static void Gc_MarkRoots(lua_State* L, Gc* gc)
 {
 
@@ -277,7 +435,7 @@ static void Gc_MarkRoots(lua_State* L, Gc* gc)
 
 }
 
-static bool Gc_Propagate(Gc* gc)
+static bool Gc_Propagate(lua_State* L, Gc* gc)
 {
 
     // When there are no more grey nodes, we're finished sweeping over all of
@@ -296,28 +454,41 @@ static bool Gc_Propagate(Gc* gc)
 
         Table* table = static_cast<Table*>(object);
 
-        Value* element = table->element;
-        for (int i = 0; i < table->numElements; ++i)
+        Gc_UpdateWeakMode(L, table);
+        if (table->weakKeys || table->weakValues)
         {
-            Gc_MarkValue(gc, element);
-            ++element;
+            Gc_MarkWeakTable(gc, table);
         }
-
-        // Mark the key and values in the table.
-        TableNode* node = table->nodes;
-        TableNode* end  = node + table->numNodes;
-        while (node < end)
+        // Arrays of numbers don't reference any objects.
+        else if (!table->numericArray)
         {
-            if (!node->dead)
+            Value* element = table->element;
+            for (int i = 0; i < table->size; ++i)
             {
-                Gc_MarkValue(gc, &node->key);
-                Gc_MarkValue(gc, &node->value);
+                Gc_MarkValue(gc, element);
+                ++element;
             }
-            else
+        }
+
+        if (!table->weakKeys && !table->weakValues)
+        {
+
+            // Mark the key and values in the table, including the nodes which
+            // haven't been moved yet if the table is being resized.
+            Gc_MarkNodes(gc, table->nodes, table->numNodes);
+            Gc_MarkNodes(gc, table->oldNodes, table->numOldNodes);
+
+            // Mark the keys in the shape and the values in the slots.
+            const Shape* shape = table->shape;
+            if (shape != NULL)
             {
-                Gc_MarkValue(gc, &node->key);
+                for (int i = 0; i < shape->numKeys; ++i)
+                {
+                    Gc_MarkObject(gc, shape->key[i]);
+                    Gc_MarkValue(gc, &table->slot[i]);
+                }
             }
-            ++node;
+
         }
 
         if (table->metatable != NULL)
@@ -400,6 +571,15 @@ static bool Gc_Propagate(Gc* gc)
             ++upValue;
         }
 
+        // Mark the table templates.
+        Table** table = prototype->tableTemplate;
+        Table** endTable = table + prototype->numTableTemplates;
+        while (table < endTable)
+        {
+            Gc_MarkObject(gc, *table);
+            ++table;
+        }
+
         // Mark the debug information.
         Gc_MarkObject(gc, prototype->source);
 
@@ -500,6 +680,84 @@ static void Gc_Sweep(lua_State* L, Gc* gc)
 
 }
 
+/**
+ * Handles slices which are reachable when their parent string isn't. If the
+ * slices only cover a small part of the parent, they're materialized so that
+ * the parent can be collected. Otherwise the parent is kept.
+ */
+static void Gc_ReleaseSlices(lua_State* L, Gc* gc)
+{
+
+    // Total up the length of the reachable slices of each unreachable string.
+    bool found = false;
+    for (Gc_Object* object = gc->first; object != NULL; object = object->next)
+    {
+        if (object->type == LUA_TSTRING && object->color != Color_White)
+        {
+            String* string = static_cast<String*>(object);
+            if (String_GetIsSlice(string) && string->parent->color == Color_White)
+            {
+                string->parent->sliceLength += string->length;
+                found = true;
+            }
+        }
+    }
+
+    if (!found)
+    {
+        return;
+    }
+
+    for (Gc_Object* object = gc->first; object != NULL; object = object->next)
+    {
+        if (object->type == LUA_TSTRING && object->color != Color_White)
+        {
+            String* string = static_cast<String*>(object);
+            if (String_GetIsSlice(string) && string->parent->color == Color_White)
+            {
+                String* parent = string->parent;
+                if (parent->sliceLength < parent->length / 2)
+                {
+                    String_Materialize(L, string);
+                }
+                else
+                {
+                    // Strings don't reference anything, so they can be
+                    // made black directly.
+                    parent->color       = Color_Black;
+                    parent->sliceLength = 0;
+                }
+            }
+        }
+    }
+
+}
+
+static void Gc_ScanMarkRootObjects(lua_State* L, Gc* gc);
+
+/**
+ * Shrinks the tables which survived the collection and have grown much larger
+ * than they need to be, for example because most of their keys were removed,
+ * and moves the buffers of the others to new allocations.
+ */
+static void Gc_ShrinkTables(lua_State* L, Gc* gc)
+{
+
+    // Tables referenced from the stack are skipped, since they may be in the
+    // middle of being iterated over and shrinking changes the order of the keys.
+    Gc_ScanMarkRootObjects(L, gc);
+    int scanMark = gc->scanMark;
+
+    for (Gc_Object* object = gc->first; object != NULL; object = object->next)
+    {
+        if (object->type == LUA_TTABLE && object->color != Color_White && object->scanMark != scanMark)
+        {
+            Table_Shrink(L, static_cast<Table*>(object));
+        }
+    }
+
+}
+
 static void Gc_Finish(lua_State* L, Gc* gc)
 {
 
@@ -517,8 +775,34 @@ static void Gc_Finish(lua_State* L, Gc* gc)
     Gc_MarkRoots(L, gc);
 
     // If any of the roots were marked as grey, we need to continue propagating.
-    while (Gc_Propagate(gc))
+    // Marking can make more keys in weak tables reachable, which in turn makes
+    // their values reachable, so we repeat until nothing new is marked.
+    do
+    {
+        while (Gc_Propagate(L, gc))
+        {
+        }
+    }
+    while (Gc_MarkEphemerons(gc));
+
+    // Remove the unreachable objects from the weak tables before they are
+    // destroyed.
+    for (Table* table = gc->firstWeak; table != NULL; table = table->nextWeak)
+    {
+        Table_ClearWeak(L, table);
+    }
+    gc->firstWeak = NULL;
+
+    Gc_ReleaseSlices(L, gc);
+
+    // Shrinking rebuilds the hash parts, which invalidates pointers into the
+    // tables and the keys a traversal with next is stopped at, so it's only
+    // done when explicitly requested. This is done before the sweep so that
+    // objects which are no longer referenced by the shrunk tables are put in
+    // the young list.
+    if (gc->compact)
     {
+        Gc_ShrinkTables(L, gc);
     }
 
     Gc_Sweep(L, gc);
@@ -675,11 +959,12 @@ bool Gc_Step(lua_State* L, Gc* gc)
         // Clear the young list so that we don't have to worry about deleting
         // something that is in it. We'll rebuild it when we do the sweep phase.
         gc->numYoungObjects = 0;
+        gc->firstWeak = NULL;
         Gc_MarkRoots(L, gc);
         gc->state = Gc_State_Propagate;
         break;
     case Gc_State_Propagate:
-        if (!Gc_Propagate(gc))
+        if (!Gc_Propagate(L, gc))
         {
             gc->state = Gc_State_Finish;
         }
@@ -735,6 +1020,13 @@ void Gc_Collect(lua_State* L, Gc* gc)
 
 }
 
+void Gc_Compact(lua_State* L, Gc* gc)
+{
+    gc->compact = true;
+    Gc_Collect(L, gc);
+    gc->compact = false;
+}
+
 void Gc_AddYoungObject(lua_State* L, Gc* gc, Gc_Object* object)
 {
     ASSERT( !object->young );
@@ -58,8 +58,10 @@ struct Gc
 
     Gc_Object*  first;      // First object in the global list.
     Gc_Object*  firstGrey;  // First grey object during gc.
+    Table*      firstWeak;  // First weak table found during gc.
     size_t      threshold;
     int         scanMark;
+    bool        compact;    // Shrink and move table buffers when finishing.
 
 #ifdef DEBUG
     int         _numObjects;
@@ -78,6 +80,15 @@ void Gc_Shutdown(lua_State* L, Gc* gc);
  */
 void Gc_Collect(lua_State* L, Gc* gc);
 
+/**
+ * Runs a full garbage collection cycle which also shrinks the tables that are
+ * much larger than they need to be and moves the buffers of the others to new
+ * allocations, to reduce fragmentation. Tables referenced from the stack are
+ * left alone, but any other table must not be in the middle of being iterated
+ * over with next, and pointers into the tables are invalidated.
+ */
+void Gc_Compact(lua_State* L, Gc* gc);
+
 /**
  * Runs a single step of the incremental garbage collector. Returns true
  * if the garbage collector finished a cycle.
@@ -92,11 +103,26 @@ void* Gc_AllocateObject(lua_State* L, int type, size_t size);
 void Gc_IncrementReference(Gc* gc, Gc_Object* parent, Gc_Object* child);
 void Gc_IncrementReference(Gc* gc, Gc_Object* parent, const Value* child);
 
+/**
+ * Applies the write barrier for a reference from parent to child without
+ * counting it. This is used when parent reaches child through something which
+ * isn't a garbage collected object and holds its own reference, such as a
+ * shape.
+ */
+void Gc_WriteBarrier(Gc* gc, Gc_Object* parent, Gc_Object* child);
+
 void Gc_DecrementReference(lua_State* L, Gc* gc, Gc_Object* child);
 void Gc_DecrementReference(lua_State* L, Gc* gc, const Value* child);
 
 void Gc_MarkObject(Gc* gc, Gc_Object* object);
 
+/**
+ * Returns true if the value is an object which hasn't been marked by the
+ * garbage collector and should be removed from weak tables. Strings are
+ * treated as values rather than objects, so they are never removed.
+ */
+bool Gc_GetIsClearable(const Value* value);
+
 void Gc_AddYoungObject(lua_State* L, Gc* gc, Gc_Object* object);
 
 #include "Gc.inl"
@@ -5,16 +5,21 @@
  * See copyright notice in README
  */
 
-FORCE_INLINE void Gc_IncrementReference(Gc* gc, Gc_Object* parent, Gc_Object* child)
+FORCE_INLINE void Gc_WriteBarrier(Gc* gc, Gc_Object* parent, Gc_Object* child)
 {
-    ASSERT(child != NULL);
-    ++child->refCount;
     if (parent->color == Color_Black && child->color == Color_White)
     {
         Gc_MarkObject(gc, child);
     }
 }
 
+FORCE_INLINE void Gc_IncrementReference(Gc* gc, Gc_Object* parent, Gc_Object* child)
+{
+    ASSERT(child != NULL);
+    ++child->refCount;
+    Gc_WriteBarrier(gc, parent, child);
+}
+
 FORCE_INLINE void Gc_IncrementReference(Gc* gc, Gc_Object* parent, const Value* child)
 {
     if (Value_GetIsObject(child))
@@ -23,6 +28,12 @@ FORCE_INLINE void Gc_IncrementReference(Gc* gc, Gc_Object* parent, const Value*
     }
 }
 
+FORCE_INLINE bool Gc_GetIsClearable(const Value* value)
+{
+    return Value_GetIsObject(value) && !Value_GetIsString(value) &&
+           value->object->color == Color_White && !value->object->fixed;
+}
+
 FORCE_INLINE void Gc_DecrementReference(lua_State* L, Gc* gc, Gc_Object* child)
 {
     ASSERT(child != NULL);
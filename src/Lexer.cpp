@@ -305,7 +305,7 @@ static bool Lexer_ReadLongBlock(Lexer* lexer, int c, bool store)
         // Store the token in the token table so it won't be garbage collected.
         Value token;
         SetValue(&token, lexer->token.string);
-        Table_Insert(lexer->L, lexer->tokenTable, &token, &token);
+        Table_SetTable(lexer->L, lexer->tokenTable, &token, &token);
     }
 
     return true;
@@ -580,12 +580,12 @@ const char* lua_tolstring(lua_State *L, int index, size_t* length )
     Value* value = GetValueForIndex(L, index);
     if (ToString(L, value))
     {
-        const String* string = value->string;
+        String* string = value->string;
         if (length != NULL)
         {
             *length = string->length;
         }
-        return String_GetData(string);
+        return String_GetTerminatedData(L, string);
     }
     return NULL;
 }
@@ -702,6 +702,223 @@ void lua_rawseti(lua_State* L, int index, int n)
 
 }
 
+int lua_arrayinsert(lua_State* L, int index, int pos)
+{
+
+    Value* table = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(table) );
+
+    Value* value = GetValueRelativeToStackTop(L, -1);
+    if (!Table_InsertArray(L, table->table, pos, value))
+    {
+        return 0;
+    }
+    Pop(L, 1);
+    return 1;
+
+}
+
+int lua_arrayremove(lua_State* L, int index, int pos)
+{
+
+    Value* table = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(table) );
+
+    if (!Table_RemoveArray(L, table->table, pos, L->stackTop))
+    {
+        return 0;
+    }
+    ++L->stackTop;
+    return 1;
+
+}
+
+int lua_arrayconcat(lua_State* L, int index, const char* sep, size_t sepLength, int i, int j)
+{
+
+    Value* value = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(value) );
+
+    Table* table = value->table;
+    if (i > j)
+    {
+        PushString( L, String_Create(L, "", 0) );
+        return 1;
+    }
+    if (i < 1 || j > table->numElements)
+    {
+        return 0;
+    }
+
+    const Value* first = table->element + i - 1;
+    const Value* last  = table->element + j - 1;
+
+    // Compute the size of the result so that it can be built in one piece.
+    char temp[LUAI_MAXNUMBER2STR];
+    size_t length = sepLength * (j - i);
+    for (const Value* element = first; element <= last; ++element)
+    {
+        if (Value_GetIsString(element))
+        {
+            length += element->string->length;
+        }
+        else if (Value_GetIsNumber(element))
+        {
+            length += lua_number2str(temp, element->number);
+        }
+        else
+        {
+            return 0;
+        }
+    }
+
+    // Short results are built on the stack since they're interned, long
+    // results are built in place in the string which becomes the result.
+    char shortBuffer[String_maxShortLength + 1];
+    String* buffer = NULL;
+    char* dst = shortBuffer;
+    if (length > String_maxShortLength)
+    {
+        buffer = String_CreateBuffer(L, length);
+        dst    = const_cast<char*>(buffer->data);
+    }
+    const char* start = dst;
+
+    for (const Value* element = first; element <= last; ++element)
+    {
+        if (Value_GetIsString(element))
+        {
+            memcpy(dst, String_GetData(element->string), element->string->length);
+            dst += element->string->length;
+        }
+        else
+        {
+            dst += lua_number2str(dst, element->number);
+        }
+        if (element < last)
+        {
+            memcpy(dst, sep, sepLength);
+            dst += sepLength;
+        }
+    }
+    ASSERT( dst == start + length );
+
+    if (buffer != NULL)
+    {
+        PushString( L, String_FinishBuffer(L, buffer, length) );
+    }
+    else
+    {
+        PushString( L, String_Create(L, shortBuffer, length) );
+    }
+    return 1;
+
+}
+
+int lua_arrayunpack(lua_State* L, int index, int i, int j)
+{
+
+    Value* table = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(table) );
+
+    if (i < 1 || j > table->table->numElements)
+    {
+        return 0;
+    }
+
+    int n = j - i + 1;
+    if (n > 0)
+    {
+        memcpy(L->stackTop, table->table->element + i - 1, n * sizeof(Value));
+        L->stackTop += n;
+    }
+    return 1;
+
+}
+
+int lua_arraysort(lua_State* L, int index, int n)
+{
+    Value* table = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(table) );
+    return Table_SortArray(L, table->table, n) ? 1 : 0;
+}
+
+int lua_arraymove(lua_State* L, int src, int f, int e, int t, int dst)
+{
+    Value* srcTable = GetValueForIndex(L, src);
+    Value* dstTable = GetValueForIndex(L, dst);
+    luai_apicheck(L, Value_GetIsTable(srcTable) && Value_GetIsTable(dstTable) );
+    return Table_MoveArray(L, srcTable->table, f, e, t, dstTable->table) ? 1 : 0;
+}
+
+void lua_clonetable(lua_State* L, int index, int deep)
+{
+    Value* table = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(table) );
+    Value value;
+    SetValue( &value, Table_Clone(L, table->table, deep != 0) );
+    PushValue( L, &value );
+}
+
+void lua_freezetable(lua_State* L, int index)
+{
+    Value* table = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(table) );
+    Table_Freeze(L, table->table);
+}
+
+int lua_isfrozen(lua_State* L, int index)
+{
+    const Value* table = GetValueForIndex(L, index);
+    return Value_GetIsTable(table) && table->table->frozen;
+}
+
+void lua_pushsubstring(lua_State* L, int index, size_t start, size_t length)
+{
+    Value* value = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsString(value) && start + length <= value->string->length );
+    PushString( L, String_CreateSlice(L, value->string, start, length) );
+}
+
+void lua_pushexternalstring(lua_State* L, const char* data, size_t length, lua_FreeString freefn, void* ud)
+{
+    luai_apicheck(L, data[length] == 0 );
+    PushString( L, String_CreateExternal(L, data, length, freefn, ud) );
+}
+
+char* lua_newbuffer(lua_State* L, size_t size)
+{
+    String* buffer = String_CreateBuffer(L, size);
+    PushString(L, buffer);
+    return const_cast<char*>(buffer->data);
+}
+
+char* lua_resizebuffer(lua_State* L, int index, size_t size)
+{
+    Value* value = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsString(value) );
+    return String_ResizeBuffer(L, value->string, size);
+}
+
+void lua_finishbuffer(lua_State* L, int index, size_t length)
+{
+    Value* value = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsString(value) );
+    SetValue( value, String_FinishBuffer(L, value->string, length) );
+}
+
+void lua_gettablehashstats(lua_State* L, int index, lua_HashStats* stats)
+{
+    Value* table = GetValueForIndex(L, index);
+    luai_apicheck(L, Value_GetIsTable(table) );
+    Table_GetHashStats(L, table->table, stats);
+}
+
+void lua_getstringhashstats(lua_State* L, lua_HashStats* stats)
+{
+    StringPool_GetHashStats(&L->stringPool, stats);
+}
+
 void lua_settable(lua_State* L, int index)
 {
     Value* key   = GetValueRelativeToStackTop(L, -2);
@@ -1007,6 +1224,11 @@ int lua_setmetatable(lua_State* L, int index)
         table = metatable->table;
     }
 
+    if (Value_GetIsTable(object) && object->table->frozen)
+    {
+        State_Error(L, "attempt to modify a frozen table");
+    }
+
     Value_SetMetatable( L, object, table );
 
     Pop(L, 1);
@@ -1065,6 +1287,11 @@ int lua_gc(lua_State* L, int what, int data)
         Gc_Collect(L, &L->gc);
         return 1;
     }
+    else if (what == LUA_GCCOMPACT)
+    {
+        Gc_Compact(L, &L->gc);
+        return 1;
+    }
     else if (what == LUA_GCSTEP)
     {
         if (Gc_Step(L, &L->gc))
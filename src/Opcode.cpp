@@ -50,6 +50,7 @@ const char* Opcode_GetAsText(Opcode opcode)
     case Opcode_Closure:        return "closure";
     case Opcode_VarArg:         return "vararg";
     case Opcode_GetTableRef:    return "gettableref";
+    case Opcode_NewTableT:      return "newtablet";
     default:                    return "<unknown>";
     }
 }
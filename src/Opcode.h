@@ -123,6 +123,8 @@ enum Opcode
     Opcode_SetGlobal2   = 73,   // Constant index > 65536.
     Opcode_GetGlobal2   = 74,   // Constant index > 65536.
 
+    Opcode_NewTableT    = 75,   // Table is a copy of a template.
+
 };
 
 const char* Opcode_GetAsText(Opcode opcode);
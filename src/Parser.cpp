@@ -173,7 +173,7 @@ static int Parser_FindName(String* names[], int numNames, String* name)
 {
     for (int i = numNames - 1; i >= 0; --i)
     {
-        if (names[i] == name)
+        if (String_GetIsEqual(names[i], name))
         {
             return i;
         }
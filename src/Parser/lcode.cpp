@@ -237,7 +237,7 @@ static int addk (FuncState *fs, Value *k, Value *v) {
   else {  /* constant not found; create a new entry */
     Value idx;
     SetValue(&idx, fs->nk);
-    Table_Insert(L, fs->h, k, &idx);
+    Table_SetTable(L, fs->h, k, &idx);
     luaM_growvector(L, f->constant, fs->nk, f->numConstants, Value,
                     MAXARG_Bx, "constant table overflow");
     while (oldsize < f->numConstants)
@@ -201,7 +201,7 @@ static int indexupvalue (FuncState *fs, String *name, expdesc *v) {
 static int searchvar (FuncState *fs, String *n) {
   int i;
   for (i=fs->nactvar-1; i >= 0; i--) {
-    if (n == getlocvar(fs, i).varname)
+    if (String_GetIsEqual(n, getlocvar(fs, i).varname))
       return i;
   }
   return -1;  /* not found */
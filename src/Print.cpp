@@ -101,6 +101,7 @@ void PrintFunction(Prototype* prototype)
         Format_AsBx,
         Format_AC,
         Format_sBx,
+        Format_AD,      // Converted instruction with A and 16-bit D.
     };
 
     static const Format format[] = 
@@ -179,8 +180,21 @@ void PrintFunction(Prototype* prototype)
             length += printf("%*s", argsColumn - length, "");
         }
 
-        switch (format[opcode])
+        Format opcodeFormat = Format_None;
+        if (opcode == Opcode_NewTableT)
         {
+            // Only appears in converted code, which uses the VM encoding.
+            opcodeFormat = Format_AD;
+        }
+        else if (opcode < static_cast<int>(sizeof(format) / sizeof(format[0])))
+        {
+            opcodeFormat = format[opcode];
+        }
+
+        switch (opcodeFormat)
+        {
+        case Format_None:
+            break;
         case Format_A:
             length += printf("%d", LUA_GET_A(inst));
             break;
@@ -202,6 +216,9 @@ void PrintFunction(Prototype* prototype)
         case Format_sBx:
             length += printf("%d", LUA_GET_sBx(inst));
             break;
+        case Format_AD:
+            length += printf("%d %d", VM_GET_A(inst), VM_GET_D(inst));
+            break;
         }
 
         // Indent before printing the comment.
@@ -287,6 +304,9 @@ void PrintFunction(Prototype* prototype)
                     lineNumberDigits, line + 2);
             }
             break;
+        case Opcode_NewTableT:
+            printf("; r%d = copy of template %d", VM_GET_A(inst), VM_GET_D(inst));
+            break;
         case Opcode_LoadK:
             arg1 = FormatK( prototype, buffer1, LUA_GET_Bx(inst) );
             printf("; r%d = %s", LUA_GET_A(inst), arg1);
@@ -0,0 +1,192 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#include "Shape.h"
+#include "State.h"
+#include "String.h"
+
+#include <memory.h>
+
+static unsigned int Shape_Hash(const Shape* parent, const String* key)
+{
+    // Shapes are aligned, so the low bits of the pointer carry no information.
+    size_t p = reinterpret_cast<size_t>(parent) >> 3;
+    return key->hash ^ (static_cast<unsigned int>(p) * 2654435761u);
+}
+
+/** Returns the number of bytes required to store a shape with the specified
+ * number of keys. */
+static size_t Shape_GetObjectSize(int numKeys)
+{
+    return sizeof(Shape) + (numKeys - 1) * sizeof(String*);
+}
+
+static Shape** CreateNodeArray(lua_State* L, int numNodes)
+{
+    size_t memSize = numNodes * sizeof(Shape*);
+    Shape** node = static_cast<Shape**>(Allocate(L, memSize));
+    memset(node, 0, memSize);
+    return node;
+}
+
+static void FreeNodeArray(lua_State* L, Shape** node, int numNodes)
+{
+    Free(L, node, numNodes * sizeof(Shape*));
+}
+
+void ShapePool_Initialize(lua_State* L, ShapePool* shapePool)
+{
+    const int initializeSize = 64;
+    shapePool->numNodes     = initializeSize;
+    shapePool->node         = CreateNodeArray(L, shapePool->numNodes);
+    shapePool->numShapes    = 0;
+}
+
+void ShapePool_Shutdown(lua_State* L, ShapePool* shapePool)
+{
+    // The shapes should have been released when the tables were destroyed.
+    ASSERT( shapePool->numShapes == 0 );
+    FreeNodeArray(L, shapePool->node, shapePool->numNodes);
+}
+
+static void ShapePool_Grow(lua_State* L, ShapePool* shapePool, int numNodes)
+{
+
+    Shape** node = CreateNodeArray(L, numNodes);
+
+    for (int i = 0; i < shapePool->numNodes; ++i)
+    {
+        Shape* shape = shapePool->node[i];
+        while (shape != NULL)
+        {
+            Shape* next = shape->nextShape;
+
+            int index = shape->hash & (numNodes - 1);
+            shape->nextShape = node[index];
+            shape->prevShape = NULL;
+            if (node[index] != NULL)
+            {
+                node[index]->prevShape = shape;
+            }
+            node[index] = shape;
+
+            shape = next;
+        }
+    }
+
+    FreeNodeArray(L, shapePool->node, shapePool->numNodes);
+
+    shapePool->numNodes = numNodes;
+    shapePool->node     = node;
+
+}
+
+static void ShapePool_Remove(ShapePool* shapePool, Shape* shape)
+{
+    if (shape->nextShape != NULL)
+    {
+        shape->nextShape->prevShape = shape->prevShape;
+    }
+    if (shape->prevShape != NULL)
+    {
+        shape->prevShape->nextShape = shape->nextShape;
+    }
+    else
+    {
+        int index = shape->hash & (shapePool->numNodes - 1);
+        shapePool->node[index] = shape->nextShape;
+    }
+    --shapePool->numShapes;
+}
+
+Shape* Shape_GetChild(lua_State* L, Gc_Object* owner, Shape* parent, String* key)
+{
+
+    ShapePool* shapePool = &L->shapePool;
+
+    unsigned int hash = Shape_Hash(parent, key);
+    int index = hash & (shapePool->numNodes - 1);
+
+    // Check if this transition has already been made by another table.
+    int numKeys = (parent != NULL) ? parent->numKeys + 1 : 1;
+
+    Shape* shape = shapePool->node[index];
+    while (shape != NULL)
+    {
+        if (shape->parent == parent && shape->key[numKeys - 1] == key)
+        {
+            // The shape already holds a reference to the key, but the owner
+            // can now reach it through the shape.
+            Gc_WriteBarrier(&L->gc, owner, key);
+            return shape;
+        }
+        shape = shape->nextShape;
+    }
+
+    shape = static_cast<Shape*>( Allocate(L, Shape_GetObjectSize(numKeys)) );
+    if (shape == NULL)
+    {
+        State_Error(L);
+    }
+
+    shape->refCount = 0;
+    shape->parent   = parent;
+    shape->hash     = hash;
+    shape->numKeys  = numKeys;
+
+    if (parent != NULL)
+    {
+        memcpy(shape->key, parent->key, parent->numKeys * sizeof(String*));
+        Shape_AddReference(parent);
+    }
+    shape->key[numKeys - 1] = key;
+    Gc_IncrementReference(&L->gc, owner, key);
+
+    // Add to the pool.
+    Shape* nextShape = shapePool->node[index];
+    if (nextShape != NULL)
+    {
+        nextShape->prevShape = shape;
+    }
+    shape->nextShape = nextShape;
+    shape->prevShape = NULL;
+    shapePool->node[index] = shape;
+    ++shapePool->numShapes;
+
+    if (shapePool->numShapes >= shapePool->numNodes)
+    {
+        ShapePool_Grow(L, shapePool, shapePool->numNodes * 2);
+    }
+
+    return shape;
+
+}
+
+void Shape_Release(lua_State* L, Shape* shape, bool releaseRefs)
+{
+    while (shape != NULL)
+    {
+
+        ASSERT(shape->refCount > 0);
+        if (--shape->refCount > 0)
+        {
+            break;
+        }
+
+        Shape* parent = shape->parent;
+        if (releaseRefs)
+        {
+            Gc_DecrementReference(L, &L->gc, shape->key[shape->numKeys - 1]);
+        }
+
+        ShapePool_Remove(&L->shapePool, shape);
+        Free(L, shape, Shape_GetObjectSize(shape->numKeys));
+
+        shape = parent;
+
+    }
+}
@@ -0,0 +1,86 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+#ifndef ROCKETVM_SHAPE_H
+#define ROCKETVM_SHAPE_H
+
+#include "Global.h"
+
+#include <stdlib.h>
+
+struct lua_State;
+struct String;
+struct Gc_Object;
+
+/**
+ * A shape describes the set of string keys stored in a record-like table and
+ * the slot each key occupies. Tables which are built by assigning the same
+ * keys in the same order share the same immutable shape, so the table only
+ * needs to store a compact array of values. Adding a key to a table moves it
+ * to a child shape which is found through the shape pool.
+ *
+ * Shapes are not garbage collected objects. They are reference counted by the
+ * tables and child shapes which use them, and are destroyed as soon as the
+ * count drops to zero. A shape holds a reference to its parent and to the last
+ * key in its key list (the other keys are held by the parent).
+ */
+struct Shape
+{
+    int             refCount;
+    Shape*          parent;         // Shape without the last key, or NULL.
+    unsigned int    hash;           // Hash of the parent and last key.
+    Shape*          nextShape;      // Next chained shape in the shape pool.
+    Shape*          prevShape;      // Previous chained shape in the shape pool.
+    int             numKeys;
+    String*         key[1];         // Keys in slot order (numKeys entries).
+};
+
+struct ShapePool
+{
+    Shape**         node;
+    int             numShapes;
+    int             numNodes;
+};
+
+void ShapePool_Initialize(lua_State* L, ShapePool* shapePool);
+void ShapePool_Shutdown(lua_State* L, ShapePool* shapePool);
+
+/**
+ * Returns the shape which has the keys of parent followed by key. If the
+ * parent is NULL, the shape will contain only key. The returned shape does
+ * not have a reference added for the caller. The owner is the object which
+ * will use the shape, and the write barrier is applied to the key for it.
+ */
+Shape* Shape_GetChild(lua_State* L, Gc_Object* owner, Shape* parent, String* key);
+
+/**
+ * Releases a reference to the shape. When the last reference is released the
+ * shape is destroyed. If releaseRefs is false, the reference to the key will
+ * not be decremented (used when the key may have already been collected by
+ * the mark and sweep collector).
+ */
+void Shape_Release(lua_State* L, Shape* shape, bool releaseRefs);
+
+inline void Shape_AddReference(Shape* shape)
+    { ++shape->refCount; }
+
+/**
+ * Returns the slot for the key in the shape, or -1 if the key is not part of
+ * the shape.
+ */
+FORCE_INLINE int Shape_GetSlot(const Shape* shape, const String* key)
+{
+    for (int i = 0; i < shape->numKeys; ++i)
+    {
+        if (shape->key[i] == key)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+#endif
@@ -0,0 +1,127 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#include "Sort.h"
+
+#ifdef ROCKET_PARALLEL_SORT
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+namespace
+{
+    struct Sort_Thread
+    {
+        Sort_TaskFunction   function;
+        void*               userData;
+    };
+}
+
+#ifdef _WIN32
+
+static DWORD WINAPI Sort_ThreadMain(LPVOID param)
+{
+    Sort_Thread* thread = static_cast<Sort_Thread*>(param);
+    thread->function(thread->userData);
+    return 0;
+}
+
+void Sort_RunTasks(Sort_TaskFunction function, void* userData[], int numTasks)
+{
+
+    ASSERT( numTasks <= Sort_maxThreads );
+
+    Sort_Thread thread[Sort_maxThreads];
+    HANDLE handle[Sort_maxThreads];
+    int numThreads = 0;
+
+    // The first task runs on the calling thread. If we can't create a thread
+    // for a task, we just run it on the calling thread too.
+    for (int i = 1; i < numTasks; ++i)
+    {
+        thread[i].function = function;
+        thread[i].userData = userData[i];
+        HANDLE h = CreateThread(NULL, 0, Sort_ThreadMain, &thread[i], 0, NULL);
+        if (h != NULL)
+        {
+            handle[numThreads++] = h;
+        }
+        else
+        {
+            function(userData[i]);
+        }
+    }
+
+    if (numTasks > 0)
+    {
+        function(userData[0]);
+    }
+
+    if (numThreads > 0)
+    {
+        WaitForMultipleObjects(numThreads, handle, TRUE, INFINITE);
+        for (int i = 0; i < numThreads; ++i)
+        {
+            CloseHandle(handle[i]);
+        }
+    }
+
+}
+
+#else
+
+static void* Sort_ThreadMain(void* param)
+{
+    Sort_Thread* thread = static_cast<Sort_Thread*>(param);
+    thread->function(thread->userData);
+    return NULL;
+}
+
+void Sort_RunTasks(Sort_TaskFunction function, void* userData[], int numTasks)
+{
+
+    ASSERT( numTasks <= Sort_maxThreads );
+
+    Sort_Thread thread[Sort_maxThreads];
+    pthread_t handle[Sort_maxThreads];
+    int numThreads = 0;
+
+    // The first task runs on the calling thread. If we can't create a thread
+    // for a task, we just run it on the calling thread too.
+    for (int i = 1; i < numTasks; ++i)
+    {
+        thread[i].function = function;
+        thread[i].userData = userData[i];
+        if (pthread_create(&handle[numThreads], NULL, Sort_ThreadMain, &thread[i]) == 0)
+        {
+            ++numThreads;
+        }
+        else
+        {
+            function(userData[i]);
+        }
+    }
+
+    if (numTasks > 0)
+    {
+        function(userData[0]);
+    }
+
+    for (int i = 0; i < numThreads; ++i)
+    {
+        pthread_join(handle[i], NULL);
+    }
+
+}
+
+#endif
+
+#endif
@@ -0,0 +1,498 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+#ifndef ROCKETVM_SORT_H
+#define ROCKETVM_SORT_H
+
+#include "State.h"
+
+#include <memory.h>
+
+/** Ranges smaller than this are sorted with insertion sort. */
+const int Sort_insertionSortThreshold = 24;
+
+/** Ranges larger than this use the median of 3 medians as the pivot. */
+const int Sort_nintherThreshold = 128;
+
+/**
+ * Maximum number of elements moved by a partial insertion sort before we give
+ * up on the range being nearly sorted.
+ */
+const int Sort_partialInsertionSortLimit = 8;
+
+/** Maximum number of threads used by Sort_Parallel. */
+const int Sort_maxThreads = 8;
+
+template <class T>
+FORCE_INLINE static void Sort_Swap(T* a, T* b)
+{
+    T temp = *a;
+    *a = *b;
+    *b = temp;
+}
+
+template <class T, class Less>
+FORCE_INLINE static void Sort_Sort2(T* a, T* b, Less& less)
+{
+    if (less(*b, *a))
+    {
+        Sort_Swap(a, b);
+    }
+}
+
+template <class T, class Less>
+FORCE_INLINE static void Sort_Sort3(T* a, T* b, T* c, Less& less)
+{
+    Sort_Sort2(a, b, less);
+    Sort_Sort2(b, c, less);
+    Sort_Sort2(a, b, less);
+}
+
+/**
+ * Sorts the range with insertion sort. If guarded is false, the element
+ * before begin must be less than or equal to every element in the range.
+ */
+template <class T, class Less>
+static void Sort_InsertionSort(T* begin, T* end, Less& less, bool guarded)
+{
+    if (begin == end)
+    {
+        return;
+    }
+    for (T* current = begin + 1; current != end; ++current)
+    {
+        T* sift  = current;
+        T* sift1 = current - 1;
+        if (less(*sift, *sift1))
+        {
+            T temp = *sift;
+            do
+            {
+                *sift-- = *sift1;
+            }
+            while ((!guarded || sift != begin) && less(temp, *--sift1));
+            *sift = temp;
+        }
+    }
+}
+
+/**
+ * Attempts to sort the range with insertion sort, but gives up and returns
+ * false if too many elements have to be moved.
+ */
+template <class T, class Less>
+static bool Sort_PartialInsertionSort(T* begin, T* end, Less& less)
+{
+    if (begin == end)
+    {
+        return true;
+    }
+    int limit = 0;
+    for (T* current = begin + 1; current != end; ++current)
+    {
+        if (limit > Sort_partialInsertionSortLimit)
+        {
+            return false;
+        }
+        T* sift  = current;
+        T* sift1 = current - 1;
+        if (less(*sift, *sift1))
+        {
+            T temp = *sift;
+            do
+            {
+                *sift-- = *sift1;
+            }
+            while (sift != begin && less(temp, *--sift1));
+            *sift = temp;
+            limit += static_cast<int>(current - sift);
+        }
+    }
+    return true;
+}
+
+template <class T, class Less>
+static void Sort_SiftDown(T* begin, int root, int size, Less& less)
+{
+    while (true)
+    {
+        int child = root * 2 + 1;
+        if (child >= size)
+        {
+            break;
+        }
+        if (child + 1 < size && less(begin[child], begin[child + 1]))
+        {
+            ++child;
+        }
+        if (!less(begin[root], begin[child]))
+        {
+            break;
+        }
+        Sort_Swap(begin + root, begin + child);
+        root = child;
+    }
+}
+
+/** Used as a fallback when the quicksort is consistently picking bad pivots. */
+template <class T, class Less>
+static void Sort_HeapSort(T* begin, T* end, Less& less)
+{
+    int size = static_cast<int>(end - begin);
+    for (int i = size / 2 - 1; i >= 0; --i)
+    {
+        Sort_SiftDown(begin, i, size, less);
+    }
+    for (int i = size - 1; i > 0; --i)
+    {
+        Sort_Swap(begin, begin + i);
+        Sort_SiftDown(begin, 0, i, less);
+    }
+}
+
+/**
+ * Partitions the range around the pivot stored in *begin. Elements equal to
+ * the pivot go to the right. Returns the final position of the pivot and sets
+ * alreadyPartitioned if no elements had to be swapped.
+ */
+template <class T, class Less>
+static T* Sort_PartitionRight(T* begin, T* end, Less& less, bool& alreadyPartitioned)
+{
+
+    T pivot = *begin;
+    T* first = begin;
+    T* last  = end;
+
+    // Find the first element greater than or equal to the pivot (the median
+    // of 3 guarantees this exists).
+    while (less(*++first, pivot))
+    {
+    }
+
+    // Find the first element strictly smaller than the pivot. We have to
+    // guard this search if there was no element before *first.
+    if (first - 1 == begin)
+    {
+        while (first < last && !less(*--last, pivot))
+        {
+        }
+    }
+    else
+    {
+        while (!less(*--last, pivot))
+        {
+        }
+    }
+
+    alreadyPartitioned = first >= last;
+
+    while (first < last)
+    {
+        Sort_Swap(first, last);
+        while (less(*++first, pivot))
+        {
+        }
+        while (!less(*--last, pivot))
+        {
+        }
+    }
+
+    T* pivotPos = first - 1;
+    *begin = *pivotPos;
+    *pivotPos = pivot;
+    return pivotPos;
+
+}
+
+/**
+ * Partitions the range around the pivot stored in *begin, putting elements
+ * equal to the pivot on the left. This is used when the pivot is equal to the
+ * element before the range, in which case the whole left side is done.
+ */
+template <class T, class Less>
+static T* Sort_PartitionLeft(T* begin, T* end, Less& less)
+{
+
+    T pivot = *begin;
+    T* first = begin;
+    T* last  = end;
+
+    while (less(pivot, *--last))
+    {
+    }
+
+    if (last + 1 == end)
+    {
+        while (first < last && !less(pivot, *++first))
+        {
+        }
+    }
+    else
+    {
+        while (!less(pivot, *++first))
+        {
+        }
+    }
+
+    while (first < last)
+    {
+        Sort_Swap(first, last);
+        while (less(pivot, *--last))
+        {
+        }
+        while (!less(pivot, *++first))
+        {
+        }
+    }
+
+    T* pivotPos = last;
+    *begin = *pivotPos;
+    *pivotPos = pivot;
+    return pivotPos;
+
+}
+
+template <class T, class Less>
+static void Sort_Loop(T* begin, T* end, Less& less, int badAllowed, bool leftmost)
+{
+
+    while (true)
+    {
+
+        int size = static_cast<int>(end - begin);
+
+        if (size < Sort_insertionSortThreshold)
+        {
+            Sort_InsertionSort(begin, end, less, leftmost);
+            return;
+        }
+
+        // Choose the pivot as the median of 3 (or the median of 3 medians for
+        // large ranges) and move it to the beginning of the range.
+        int s2 = size / 2;
+        if (size > Sort_nintherThreshold)
+        {
+            Sort_Sort3(begin, begin + s2, end - 1, less);
+            Sort_Sort3(begin + 1, begin + (s2 - 1), end - 2, less);
+            Sort_Sort3(begin + 2, begin + (s2 + 1), end - 3, less);
+            Sort_Sort3(begin + (s2 - 1), begin + s2, begin + (s2 + 1), less);
+            Sort_Swap(begin, begin + s2);
+        }
+        else
+        {
+            Sort_Sort3(begin + s2, begin, end - 1, less);
+        }
+
+        // If the pivot is equal to the element before the range, everything
+        // equal to the pivot is already in place, so only the elements
+        // greater than it need to be sorted. This handles many duplicates.
+        if (!leftmost && !less(*(begin - 1), *begin))
+        {
+            begin = Sort_PartitionLeft(begin, end, less) + 1;
+            continue;
+        }
+
+        bool alreadyPartitioned;
+        T* pivotPos = Sort_PartitionRight(begin, end, less, alreadyPartitioned);
+
+        int leftSize  = static_cast<int>(pivotPos - begin);
+        int rightSize = static_cast<int>(end - (pivotPos + 1));
+
+        if (leftSize < size / 8 || rightSize < size / 8)
+        {
+
+            // The partition was highly unbalanced. If this happens too often
+            // switch to heap sort to guarantee n log n.
+            if (--badAllowed == 0)
+            {
+                Sort_HeapSort(begin, end, less);
+                return;
+            }
+
+            // Shuffle some elements around to break up patterns that cause
+            // bad pivot choices.
+            if (leftSize >= Sort_insertionSortThreshold)
+            {
+                Sort_Swap(begin, begin + leftSize / 4);
+                Sort_Swap(pivotPos - 1, pivotPos - leftSize / 4);
+                if (leftSize > Sort_nintherThreshold)
+                {
+                    Sort_Swap(begin + 1, begin + (leftSize / 4 + 1));
+                    Sort_Swap(begin + 2, begin + (leftSize / 4 + 2));
+                    Sort_Swap(pivotPos - 2, pivotPos - (leftSize / 4 + 1));
+                    Sort_Swap(pivotPos - 3, pivotPos - (leftSize / 4 + 2));
+                }
+            }
+            if (rightSize >= Sort_insertionSortThreshold)
+            {
+                Sort_Swap(pivotPos + 1, pivotPos + (1 + rightSize / 4));
+                Sort_Swap(end - 1, end - rightSize / 4);
+                if (rightSize > Sort_nintherThreshold)
+                {
+                    Sort_Swap(pivotPos + 2, pivotPos + (2 + rightSize / 4));
+                    Sort_Swap(pivotPos + 3, pivotPos + (3 + rightSize / 4));
+                    Sort_Swap(end - 2, end - (1 + rightSize / 4));
+                    Sort_Swap(end - 3, end - (2 + rightSize / 4));
+                }
+            }
+
+        }
+        else if (alreadyPartitioned &&
+                 Sort_PartialInsertionSort(begin, pivotPos, less) &&
+                 Sort_PartialInsertionSort(pivotPos + 1, end, less))
+        {
+            // The range was (nearly) sorted already.
+            return;
+        }
+
+        // Recurse on the left side and loop on the right side.
+        Sort_Loop(begin, pivotPos, less, badAllowed, leftmost);
+        begin = pivotPos + 1;
+        leftmost = false;
+
+    }
+
+}
+
+/**
+ * Sorts the range [begin, end) using pattern-defeating quicksort. The less
+ * function must define a strict weak ordering on the elements.
+ */
+template <class T, class Less>
+void Sort(T* begin, T* end, Less less)
+{
+    if (end - begin > 1)
+    {
+        int badAllowed = 1;
+        for (size_t size = end - begin; size > 1; size >>= 1)
+        {
+            ++badAllowed;
+        }
+        Sort_Loop(begin, end, less, badAllowed, true);
+    }
+}
+
+#ifdef ROCKET_PARALLEL_SORT
+
+typedef void (*Sort_TaskFunction)(void* userData);
+
+/**
+ * Runs the function once for each of the user data values, with each call on a
+ * separate thread, and waits for them all to finish.
+ */
+void Sort_RunTasks(Sort_TaskFunction function, void* userData[], int numTasks);
+
+template <class T, class Less>
+struct Sort_Task
+{
+    T*      begin;
+    T*      middle;
+    T*      end;
+    T*      buffer;
+    Less    less;
+};
+
+template <class T, class Less>
+static void Sort_SortTask(void* userData)
+{
+    Sort_Task<T, Less>* task = static_cast<Sort_Task<T, Less>*>(userData);
+    Sort(task->begin, task->end, task->less);
+}
+
+/** Merges the sorted ranges [begin, middle) and [middle, end). */
+template <class T, class Less>
+static void Sort_MergeTask(void* userData)
+{
+
+    Sort_Task<T, Less>* task = static_cast<Sort_Task<T, Less>*>(userData);
+
+    T* left     = task->buffer;
+    T* leftEnd  = left + (task->middle - task->begin);
+    T* right    = task->middle;
+    T* dst      = task->begin;
+
+    memcpy(left, task->begin, (leftEnd - left) * sizeof(T));
+
+    while (left < leftEnd && right < task->end)
+    {
+        if (task->less(*right, *left))
+        {
+            *dst++ = *right++;
+        }
+        else
+        {
+            *dst++ = *left++;
+        }
+    }
+
+    // Anything remaining on the right is already in place.
+    while (left < leftEnd)
+    {
+        *dst++ = *left++;
+    }
+
+}
+
+/**
+ * Sorts the range by splitting it into pieces which are sorted on separate
+ * threads and then merged together. The comparison function must be safe to
+ * call from multiple threads.
+ */
+template <class T, class Less>
+void Sort_Parallel(lua_State* L, T* begin, T* end, Less less)
+{
+
+    size_t size = end - begin;
+    T* buffer = static_cast<T*>( Allocate(L, size * sizeof(T)) );
+    if (buffer == NULL)
+    {
+        Sort(begin, end, less);
+        return;
+    }
+
+    Sort_Task<T, Less> run[Sort_maxThreads];
+    Sort_Task<T, Less> task[Sort_maxThreads];
+    void* userData[Sort_maxThreads];
+
+    for (int i = 0; i < Sort_maxThreads; ++i)
+    {
+        run[i].begin    = begin + (size * i) / Sort_maxThreads;
+        run[i].end      = begin + (size * (i + 1)) / Sort_maxThreads;
+        run[i].less     = less;
+        userData[i]     = &run[i];
+    }
+    Sort_RunTasks(Sort_SortTask<T, Less>, userData, Sort_maxThreads);
+
+    // Merge pairs of adjacent runs until there's only one.
+    for (int width = 1; width < Sort_maxThreads; width *= 2)
+    {
+        int numTasks = 0;
+        for (int i = 0; i + width < Sort_maxThreads; i += 2 * width)
+        {
+            int last = i + 2 * width - 1;
+            if (last >= Sort_maxThreads)
+            {
+                last = Sort_maxThreads - 1;
+            }
+            Sort_Task<T, Less>& merge = task[numTasks];
+            merge.begin     = run[i].begin;
+            merge.middle    = run[i + width].begin;
+            merge.end       = run[last].end;
+            merge.buffer    = buffer + (merge.begin - begin);
+            merge.less      = less;
+            userData[numTasks] = &merge;
+            ++numTasks;
+        }
+        Sort_RunTasks(Sort_MergeTask<T, Less>, userData, numTasks);
+    }
+
+    Free(L, buffer, size * sizeof(T));
+
+}
+
+#endif
+
+#endif
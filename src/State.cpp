@@ -116,6 +116,7 @@ lua_State* State_Create(lua_Alloc alloc, void* userdata)
     memset(L->reservedWord, 0, sizeof(L->reservedWord));
 
     StringPool_Initialize(L, &L->stringPool);
+    ShapePool_Initialize(L, &L->shapePool);
 
     // Always include one call frame which will represent calling into the Lua
     // API from C.
@@ -148,6 +149,7 @@ lua_State* State_Create(lua_Alloc alloc, void* userdata)
             "__le",
             "__eq",
             "__concat",
+            "__mode",
         };
 
     String_CreateUnmanagedArray(L, L->tagMethodName, tagMethodName, TagMethod_NumMethods);
@@ -205,6 +207,7 @@ void State_Destroy(lua_State* L)
     String_DestroyUnmanagedArray(L, L->tagMethodName, TagMethod_NumMethods);
     String_DestroyUnmanagedArray(L, L->reservedWord, 31);
     Gc_Shutdown(L, &L->gc);
+    ShapePool_Shutdown(L, &L->shapePool);
     StringPool_Shutdown(L, &L->stringPool);
     L->alloc( L->userdata, L, 0, 0 );
 }
@@ -297,18 +300,7 @@ void Concat(lua_State* L, int n)
 
 void Concat(lua_State* L, Value* dst, Value* start, Value* end)
 {
-
-    Value_Copy(dst, start);
-
-    Value* arg1 = dst;
-    Value* arg2 = start + 1;
-
-    while (arg2 <= end)
-    {
-        Vm_Concat(L, dst, arg1, arg2);
-        ++arg2;
-    }
-
+    Vm_Concat(L, dst, start, end);
 }
 
 bool ToString(lua_State* L, Value* value)
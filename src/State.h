@@ -14,6 +14,7 @@ extern "C"
 }
 
 #include "String.h"
+#include "Shape.h"
 #include "Value.h"
 #include "Opcode.h"
 #include "Gc.h"
@@ -72,6 +73,7 @@ struct lua_State
     String*         tagMethodName[TagMethod_NumMethods];
     CallFrame       callStackBase[LUAI_MAXCCALLS];
     StringPool      stringPool;
+    ShapePool       shapePool;
 };
 
 void* Allocate(lua_State* L, size_t size);
@@ -210,7 +212,8 @@ void Concat(lua_State* L, int n);
 
 /**
  * Concatenates a range of values on the stack between start and end and stores
- * the result in dst. dst and start can point to the same location.
+ * the result in dst. dst and start can point to the same location. The values
+ * in the range are overwritten.
  */
 void Concat(lua_State* L, Value* dst, Value* start, Value* end);
 
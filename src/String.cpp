@@ -11,21 +11,72 @@
 #include <memory.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-static unsigned int HashString(const char* data, size_t length)
+FORCE_INLINE static UInt32 Read32(const char* data)
 {
-	// FNV-1a hash: http://isthe.com/chongo/tech/comp/fnv/
-    unsigned long hash = 2166136261;
+    // memcpy handles unaligned reads and compiles to a single load.
+    UInt32 value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
 
-    // For long strings, don't hash all of the characters.
-    size_t step = (length >> 5) + 1;
-    for (size_t i = 0; i < length; i += step)
-	{
-    	hash ^= data[i];
-    	hash *= 16777619;
+FORCE_INLINE static void Mix(UInt32& a, UInt32& b)
+{
+    UInt64 c = static_cast<UInt64>(a ^ 0x53c5ca59u) * (b ^ 0x74743c1bu);
+    a = static_cast<UInt32>(c);
+    b = static_cast<UInt32>(c >> 32);
+}
+
+/**
+ * Hashes all of the bytes of the string. This is based on wyhash32 by Wang Yi
+ * (public domain), which only needs a 32x32->64 bit multiply so it's fast on
+ * both 32 and 64-bit processors.
+ */
+static unsigned int HashString(const char* data, size_t length, unsigned int seed)
+{
+
+    UInt32 a = seed;
+    UInt32 b = static_cast<UInt32>(length);
+    Mix(a, b);
+
+    size_t i = length;
+    for (; i > 8; i -= 8, data += 8)
+    {
+        a ^= Read32(data);
+        b ^= Read32(data + 4);
+        Mix(a, b);
+    }
+
+    if (i >= 4)
+    {
+        a ^= Read32(data);
+        b ^= Read32(data + i - 4);
+    }
+    else if (i > 0)
+    {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        a ^= (static_cast<UInt32>(p[0]) << 16) | (static_cast<UInt32>(p[i >> 1]) << 8) | p[i - 1];
     }
 
-    return hash;
+    Mix(a, b);
+    Mix(a, b);
+    return a ^ b;
+
+}
+
+/**
+ * Generates a seed for the string hash function. The seed is different for
+ * each state, so keys can't be chosen ahead of time to all collide.
+ */
+static unsigned int StringPool_MakeSeed(lua_State* L)
+{
+    size_t buffer[4];
+    buffer[0] = reinterpret_cast<size_t>(L);
+    buffer[1] = reinterpret_cast<size_t>(&buffer);
+    buffer[2] = static_cast<size_t>(time(NULL));
+    buffer[3] = static_cast<size_t>(clock());
+    return HashString(reinterpret_cast<const char*>(buffer), sizeof(buffer), 0x9e3779b9u);
 }
 
 static String** CreateNodeArray(lua_State* L, int numNodes)
@@ -41,6 +92,14 @@ static void FreeNodeArray(lua_State* L, String** node, int numNodes)
     Free(L, node, numNodes * sizeof(String*));
 }
 
+namespace
+{
+    // Number of chains moved from the old nodes each time a string is looked
+    // up while the pool is being resized. This must be at least one so that
+    // the resize finishes before the pool needs to grow again.
+    const int _migrateChains = 2;
+}
+
 void StringPool_Initialize(lua_State* L, StringPool* stringPool)
 {
     // This was chosen for the intial string pool size because it's
@@ -49,7 +108,11 @@ void StringPool_Initialize(lua_State* L, StringPool* stringPool)
     const int initializeSize = 256;
     stringPool->numNodes    = initializeSize;    
     stringPool->node        = CreateNodeArray(L, stringPool->numNodes);
+    stringPool->oldNode     = NULL;
+    stringPool->numOldNodes = 0;
+    stringPool->migrateIndex = 0;
     stringPool->numStrings  = 0;
+    stringPool->seed        = StringPool_MakeSeed(L);
 }
 
 void StringPool_Shutdown(lua_State* L, StringPool* stringPool)
@@ -60,38 +123,94 @@ void StringPool_Shutdown(lua_State* L, StringPool* stringPool)
         ASSERT( stringPool->node[i] == NULL || stringPool->node[i]->fixed );
     }
     FreeNodeArray(L, stringPool->node, stringPool->numNodes);
+    if (stringPool->oldNode != NULL)
+    {
+        for (int i = stringPool->migrateIndex; i < stringPool->numOldNodes; ++i)
+        {
+            ASSERT( stringPool->oldNode[i] == NULL || stringPool->oldNode[i]->fixed );
+        }
+        FreeNodeArray(L, stringPool->oldNode, stringPool->numOldNodes);
+    }
 }
 
-static void StringPool_Grow(lua_State* L, StringPool* stringPool, int numNodes)
+FORCE_INLINE static int StringPool_GetIndex(unsigned int hash, int numNodes)
 {
+    ASSERT( (numNodes & (numNodes - 1)) == 0 );
+    return static_cast<int>(hash & (numNodes - 1));
+}
 
-    String** node = CreateNodeArray(L, numNodes);
+/** Adds a string to the head of its chain in the current nodes. */
+static void StringPool_Link(StringPool* stringPool, String* string)
+{
+    int index = StringPool_GetIndex(string->hash, stringPool->numNodes);
+    String* nextString = stringPool->node[index];
+    if (nextString != NULL)
+    {
+        nextString->prevString = string;
+    }
+    string->nextString = nextString;
+    string->prevString = NULL;
+    stringPool->node[index] = string;
+}
 
-    // Reinsert all of the strings into the new array.
-    for (int i = 0; i < stringPool->numNodes; ++i)
+/**
+ * Moves up to numChains chains from the old nodes into the current ones for a
+ * pool which is being resized incrementally. When all of the chains have been
+ * moved, the old nodes are freed.
+ */
+static void StringPool_MigrateChains(lua_State* L, StringPool* stringPool, int numChains)
+{
+
+    int index = stringPool->migrateIndex;
+    int end   = index + numChains;
+    if (end > stringPool->numOldNodes)
+    {
+        end = stringPool->numOldNodes;
+    }
+
+    for (; index < end; ++index)
     {
-        String* string = stringPool->node[i];
+        String* string = stringPool->oldNode[index];
         while (string != NULL)
         {
             String* next = string->nextString;
-
-            int index = string->hash % numNodes;
-            string->nextString = node[index];
-            string->prevString = NULL;
-            if (node[index] != NULL)
-            {
-                node[index]->prevString = string;
-            }
-            node[index] = string;
-
+            StringPool_Link(stringPool, string);
             string = next;
         }
+        stringPool->oldNode[index] = NULL;
     }
 
-    FreeNodeArray(L, stringPool->node, stringPool->numNodes);
+    stringPool->migrateIndex = index;
 
-    stringPool->numNodes = numNodes;
-    stringPool->node     = node;
+    if (index == stringPool->numOldNodes)
+    {
+        FreeNodeArray(L, stringPool->oldNode, stringPool->numOldNodes);
+        stringPool->oldNode      = NULL;
+        stringPool->numOldNodes  = 0;
+        stringPool->migrateIndex = 0;
+    }
+
+}
+
+/**
+ * Doubles the number of nodes in the pool. The strings are not moved here;
+ * that's done a few chains at a time by StringPool_MigrateChains.
+ */
+static void StringPool_Grow(lua_State* L, StringPool* stringPool)
+{
+
+    if (stringPool->oldNode != NULL)
+    {
+        StringPool_MigrateChains(L, stringPool, stringPool->numOldNodes - stringPool->migrateIndex);
+    }
+
+    int numNodes = stringPool->numNodes * 2;
+
+    stringPool->oldNode      = stringPool->node;
+    stringPool->numOldNodes  = stringPool->numNodes;
+    stringPool->migrateIndex = 0;
+    stringPool->node         = CreateNodeArray(L, numNodes);
+    stringPool->numNodes     = numNodes;
 
 }
 
@@ -102,12 +221,9 @@ static size_t String_GetStringObjectSize(size_t length)
     return sizeof(String) + length + 1;
 }
 
-static String* StringPool_FindInChain(StringPool* stringPool, int index, const char* data, size_t length)
+static String* StringPool_FindInChain(String* string, const char* data, size_t length)
 {
-	String* firstString = stringPool->node[index];	
-	
 	// Search for the exact string in the string pool.
-	String* string = firstString;
 	while (string != NULL)
 	{
 		if (string->length == length && memcmp(String_GetData(string), data, length) == 0)
@@ -116,17 +232,32 @@ static String* StringPool_FindInChain(StringPool* stringPool, int index, const c
 		}
 		string = string->nextString;
 	}
+    return string;
+}
 
+static String* StringPool_Find(StringPool* stringPool, unsigned int hash, const char* data, size_t length)
+{
+    int index = StringPool_GetIndex(hash, stringPool->numNodes);
+    String* string = StringPool_FindInChain(stringPool->node[index], data, length);
+    if (string == NULL && stringPool->oldNode != NULL)
+    {
+        // Chains which haven't been moved yet are still in the old nodes.
+        index  = StringPool_GetIndex(hash, stringPool->numOldNodes);
+        string = StringPool_FindInChain(stringPool->oldNode[index], data, length);
+    }
     return string;
 }
 
 String* StringPool_Insert(lua_State* L, StringPool* stringPool, const char* data, size_t length)
 {
 
-	unsigned int hash = HashString(data, length);
-	
-	int index = hash % stringPool->numNodes;
-    String* string = StringPool_FindInChain(stringPool, index, data, length);
+    if (stringPool->oldNode != NULL)
+    {
+        StringPool_MigrateChains(L, stringPool, _migrateChains);
+    }
+
+	unsigned int hash = HashString(data, length, stringPool->seed);
+    String* string = StringPool_Find(stringPool, hash, data, length);
 
     if (string == NULL)
 	{
@@ -136,33 +267,26 @@ String* StringPool_Insert(lua_State* L, StringPool* stringPool, const char* data
         size_t size = String_GetStringObjectSize(length);
 		string = static_cast<String*>( Gc_AllocateObject(L, LUA_TSTRING, size) );
 
-        String* nextString = stringPool->node[index];
-        if (nextString != NULL)
-        {
-            nextString->prevString = string;
-        }
-
 		string->hash 		= hash;
+        string->hashed      = true;
+        string->external    = false;
+        string->appendable  = false;
 		string->length		= length;
-		string->nextString  = nextString;
-        string->prevString  = NULL;
 
         char* stringData = reinterpret_cast<char*>(string + 1);
 
 		memcpy( stringData, data, length );
 		stringData[length] = 0;
 
-#ifdef DEBUG
-        string->_data = stringData;
-#endif
+        string->data = stringData;
 
-        // Add to the pool.
-		stringPool->node[index] = string;
+        // Add to the pool. New strings always go into the current nodes.
+        StringPool_Link(stringPool, string);
         ++stringPool->numStrings;
 
         if (stringPool->numStrings >= stringPool->numNodes)
         {
-            StringPool_Grow(L, stringPool, stringPool->numNodes * 2);
+            StringPool_Grow(L, stringPool);
         }
 
 	}
@@ -183,8 +307,21 @@ void StringPool_Remove(lua_State* L, StringPool* stringPool, String* string)
     }
     else
     {
-        int index = string->hash % stringPool->numNodes;
-        stringPool->node[index] = string->nextString;
+        // The string is at the head of a chain, which may not have been moved
+        // out of the old nodes yet.
+        String** node = stringPool->node;
+        int index = StringPool_GetIndex(string->hash, stringPool->numNodes);
+        if (stringPool->oldNode != NULL)
+        {
+            int oldIndex = StringPool_GetIndex(string->hash, stringPool->numOldNodes);
+            if (stringPool->oldNode[oldIndex] == string)
+            {
+                node  = stringPool->oldNode;
+                index = oldIndex;
+            }
+        }
+        ASSERT( node[index] == string );
+        node[index] = string->nextString;
     }
     string->nextString = NULL;
     string->prevString = NULL;
@@ -196,16 +333,380 @@ String* String_Create(lua_State* L, const char* data)
     return String_Create(L, data, strlen(data));
 }
 
+/** Creates a long string, which is not added to the string pool. */
+static String* String_CreateLong(lua_State* L, const char* data, size_t length)
+{
+
+    size_t size = String_GetStringObjectSize(length);
+    String* string = static_cast<String*>( Gc_AllocateObject(L, LUA_TSTRING, size) );
+
+    string->hash        = L->stringPool.seed;
+    string->hashed      = false;
+    string->external    = false;
+    string->appendable  = false;
+    string->length      = length;
+    string->parent      = NULL;
+    string->sliceLength = 0;
+
+    char* stringData = reinterpret_cast<char*>(string + 1);
+
+    memcpy( stringData, data, length );
+    stringData[length] = 0;
+
+    string->data = stringData;
+    return string;
+
+}
+
 String* String_Create(lua_State* L, const char* data, size_t length)
 {
+    if (length > String_maxShortLength)
+    {
+        return String_CreateLong(L, data, length);
+    }
     return StringPool_Insert(L, &L->stringPool, data, length);
 }
 
-void String_Destroy(lua_State* L, String* string)
+String* String_CreateSlice(lua_State* L, String* string, size_t start, size_t length)
+{
+
+    ASSERT( start + length <= string->length );
+
+    if (length <= String_maxShortLength)
+    {
+        return String_Create(L, String_GetData(string) + start, length);
+    }
+    if (length == string->length)
+    {
+        return string;
+    }
+
+    String* slice = static_cast<String*>( Gc_AllocateObject(L, LUA_TSTRING, sizeof(String)) );
+
+    // This is done after allocating, since the garbage collector may have
+    // materialized the string if it's a slice. Slices always reference a
+    // string which holds its own data, so that data can't move.
+    String* parent = string;
+    if (String_GetIsSlice(string))
+    {
+        parent = string->parent;
+    }
+
+    slice->hash         = L->stringPool.seed;
+    slice->hashed       = false;
+    slice->external     = false;
+    slice->appendable   = false;
+    slice->length       = length;
+    slice->data         = String_GetData(string) + start;
+    slice->parent       = parent;
+    slice->sliceLength  = 0;
+
+    Gc_IncrementReference(&L->gc, slice, parent);
+    return slice;
+
+}
+
+String* String_CreateExternal(lua_State* L, const char* data, size_t length, lua_FreeString freefn, void* ud)
+{
+
+    ASSERT( data[length] == 0 );
+
+    if (length <= String_maxShortLength)
+    {
+        // Short strings have to be interned, so there's nothing to gain from
+        // referencing the host's copy.
+        String* string = String_Create(L, data, length);
+        if (freefn != NULL)
+        {
+            freefn(ud, data, length);
+        }
+        return string;
+    }
+
+    ExternalString* string = static_cast<ExternalString*>( Gc_AllocateObject(L, LUA_TSTRING, sizeof(ExternalString)) );
+
+    string->hash        = L->stringPool.seed;
+    string->hashed      = false;
+    string->external    = true;
+    string->appendable  = false;
+    string->length      = length;
+    string->data        = data;
+    string->parent      = NULL;
+    string->sliceLength = 0;
+    string->freefn      = freefn;
+    string->ud          = ud;
+
+    return string;
+
+}
+
+void String_Materialize(lua_State* L, String* string)
+{
+
+    ASSERT( String_GetIsSlice(string) );
+
+    size_t length = string->length;
+    char* data = static_cast<char*>( Allocate(L, length + 1) );
+    if (data == NULL)
+    {
+        State_Error(L);
+    }
+
+    memcpy(data, string->data, length);
+    data[length] = 0;
+
+    Gc_DecrementReference(L, &L->gc, string->parent);
+
+    string->data   = data;
+    string->parent = NULL;
+
+}
+
+/**
+ * Returns the append buffer which string ends at the end of, if there's room to
+ * append to it in place, otherwise returns NULL.
+ */
+static AppendBuffer* String_GetAppendBuffer(String* string, size_t length)
 {
-    ASSERT( string->prevString == NULL );
-    ASSERT( string->nextString == NULL );
-    size_t size = String_GetStringObjectSize(string->length);
+    if (!String_GetIsSlice(string) || !string->parent->appendable)
+    {
+        return NULL;
+    }
+    AppendBuffer* buffer = static_cast<AppendBuffer*>(string->parent);
+    if (string->data != buffer->data || string->length != buffer->used || length > buffer->length)
+    {
+        return NULL;
+    }
+    return buffer;
+}
+
+/** Creates an append buffer with room for length characters holding a copy of string. */
+static AppendBuffer* String_CreateAppendBuffer(lua_State* L, String* string, size_t length)
+{
+
+    // Growing geometrically means each character is only copied a constant
+    // number of times on average as a string is repeatedly appended to.
+    size_t size = length;
+    if (size < ~size_t(0) / 2)
+    {
+        size *= 2;
+    }
+
+    AppendBuffer* buffer = static_cast<AppendBuffer*>( Gc_AllocateObject(L, LUA_TSTRING, sizeof(AppendBuffer)) );
+
+    buffer->hash        = L->stringPool.seed;
+    buffer->hashed      = false;
+    buffer->external    = false;
+    buffer->appendable  = true;
+    buffer->length      = size;
+    buffer->data        = NULL;
+    buffer->parent      = NULL;
+    buffer->sliceLength = 0;
+    buffer->used        = 0;
+
+    char* data = static_cast<char*>( Allocate(L, size + 1) );
+    if (data == NULL)
+    {
+        State_Error(L);
+    }
+
+    memcpy(data, String_GetData(string), string->length);
+    buffer->data = data;
+    buffer->used = string->length;
+    return buffer;
+
+}
+
+String* String_Append(lua_State* L, String* string, size_t length, char** append)
+{
+
+    ASSERT( String_GetIsLong(string) );
+
+    size_t oldLength = string->length;
+    size_t newLength = oldLength + length;
+
+    AppendBuffer* buffer = String_GetAppendBuffer(string, newLength);
+    if (buffer == NULL)
+    {
+        buffer = String_CreateAppendBuffer(L, string, newLength);
+    }
+
+    // The buffer may not be referenced by anything yet, so it has to be kept
+    // from being collected while we allocate the result. If the garbage
+    // collector materializes the string, the buffer still holds a copy of it.
+    buffer->fixed = true;
+    String* result = static_cast<String*>( Gc_AllocateObject(L, LUA_TSTRING, sizeof(String)) );
+    buffer->fixed = false;
+
+    char* data = const_cast<char*>(buffer->data);
+    data[newLength] = 0;
+    buffer->used = newLength;
+
+    result->hash        = L->stringPool.seed;
+    result->hashed      = false;
+    result->external    = false;
+    result->appendable  = false;
+    result->length      = newLength;
+    result->data        = data;
+    result->parent      = buffer;
+    result->sliceLength = 0;
+
+    Gc_IncrementReference(&L->gc, result, buffer);
+
+    *append = data + oldLength;
+    return result;
+
+}
+
+String* String_CreateBuffer(lua_State* L, size_t size)
+{
+
+    if (size <= String_maxShortLength)
+    {
+        size = String_maxShortLength + 1;
+    }
+
+    String* string = static_cast<String*>( Gc_AllocateObject(L, LUA_TSTRING, sizeof(String)) );
+
+    string->hash        = L->stringPool.seed;
+    string->hashed      = false;
+    string->external    = false;
+    string->appendable  = false;
+    string->length      = size;
+    string->data        = NULL;
+    string->parent      = NULL;
+    string->sliceLength = 0;
+
+    char* data = static_cast<char*>( Allocate(L, size + 1) );
+    if (data == NULL)
+    {
+        State_Error(L);
+    }
+    data[size] = 0;
+
+    string->data = data;
+    return string;
+
+}
+
+char* String_ResizeBuffer(lua_State* L, String* string, size_t size)
+{
+
+    ASSERT( String_GetIsLong(string) && !String_GetIsSlice(string) );
+
+    if (size <= String_maxShortLength)
+    {
+        size = String_maxShortLength + 1;
+    }
+
+    char* data = static_cast<char*>( Reallocate(L, const_cast<char*>(string->data), string->length + 1, size + 1) );
+    if (data == NULL)
+    {
+        State_Error(L);
+    }
+    data[size] = 0;
+
+    string->data   = data;
+    string->length = size;
+    return data;
+
+}
+
+String* String_FinishBuffer(lua_State* L, String* string, size_t length)
+{
+
+    ASSERT( length <= string->length );
+
+    if (length <= String_maxShortLength)
+    {
+        // Short strings have to be interned. The buffer will be collected,
+        // but we can give back most of its memory now.
+        String* result = String_Create(L, string->data, length);
+        String_ResizeBuffer(L, string, 0);
+        return result;
+    }
+
+    // Give back the unused part of the buffer. This doesn't move the data
+    // when shrinking with most allocators.
+    String_ResizeBuffer(L, string, length);
+    ASSERT( !string->hashed );
+    return string;
+
+}
+
+void String_ComputeHash(String* string)
+{
+    ASSERT( !string->hashed );
+    // The seed was stored in place of the hash when the string was created.
+    string->hash   = HashString(String_GetData(string), string->length, string->hash);
+    string->hashed = true;
+}
+
+bool String_GetIsEqualLong(String* string1, String* string2)
+{
+    size_t length = string1->length;
+    if (length != string2->length || length <= String_maxShortLength)
+    {
+        return false;
+    }
+    if (string1->hashed && string2->hashed && string1->hash != string2->hash)
+    {
+        return false;
+    }
+    return memcmp(String_GetData(string1), String_GetData(string2), length) == 0;
+}
+
+void String_Destroy(lua_State* L, String* string, bool releaseRefs)
+{
+    size_t size;
+    if (String_GetIsLong(string))
+    {
+        if (string->parent != NULL)
+        {
+            if (releaseRefs)
+            {
+                Gc_DecrementReference(L, &L->gc, string->parent);
+            }
+            size = sizeof(String);
+        }
+        else if (string->appendable)
+        {
+            if (string->data != NULL)
+            {
+                Free(L, const_cast<char*>(string->data), string->length + 1);
+            }
+            size = sizeof(AppendBuffer);
+        }
+        else if (string->external)
+        {
+            ExternalString* external = static_cast<ExternalString*>(string);
+            if (external->freefn != NULL)
+            {
+                external->freefn(external->ud, external->data, external->length);
+            }
+            size = sizeof(ExternalString);
+        }
+        else if (string->data != reinterpret_cast<const char*>(string + 1))
+        {
+            // Materialized slice or buffer. The data can be NULL if we ran
+            // out of memory creating a buffer.
+            if (string->data != NULL)
+            {
+                Free(L, const_cast<char*>(string->data), string->length + 1);
+            }
+            size = sizeof(String);
+        }
+        else
+        {
+            size = String_GetStringObjectSize(string->length);
+        }
+    }
+    else
+    {
+        ASSERT( string->prevString == NULL );
+        ASSERT( string->nextString == NULL );
+        size = String_GetStringObjectSize(string->length);
+    }
     Free(L, string, size);
 }
 
@@ -230,10 +731,14 @@ void String_CreateUnmanagedArray(lua_State* L, String* string[], const char* dat
         string[i] = result;
 
         size_t length       = strlen(data[i]);
+        ASSERT( length <= String_maxShortLength );
 
         result->fixed       = true;
         result->type        = LUA_TSTRING;
-		result->hash 		= HashString(data[i], length);
+		result->hash 		= HashString(data[i], length, stringPool->seed);
+        result->hashed      = true;
+        result->external    = false;
+        result->appendable  = false;
 		result->length		= length;
 
         char* stringData = reinterpret_cast<char*>(result + 1);
@@ -241,31 +746,18 @@ void String_CreateUnmanagedArray(lua_State* L, String* string[], const char* dat
 		memcpy( stringData, data[i], length );
 		stringData[length] = 0;
 
-#ifdef DEBUG
-        result->_data = stringData;
-#endif        
+        result->data = stringData;
 
         // Add to the pool so that we don't end up with duplicated strings. Note
         // this must be done before the string is inserted into the table otherwise.
 
-        int index = result->hash % stringPool->numNodes;
-        ASSERT( StringPool_FindInChain(stringPool, index, data[i], length) == NULL );
-
-        String* nextString = stringPool->node[index];
-        if (nextString != NULL)
-        {
-            nextString->prevString = result;
-        }
-    
-        result->nextString  = nextString;
-        result->prevString  = NULL;
-
-        stringPool->node[index] = result;
+        ASSERT( StringPool_Find(stringPool, result->hash, data[i], length) == NULL );
+        StringPool_Link(stringPool, result);
         ++stringPool->numStrings;
 
         if (stringPool->numStrings >= stringPool->numNodes)
         {
-            StringPool_Grow(L, stringPool, stringPool->numNodes * 2);
+            StringPool_Grow(L, stringPool);
         }
 
         // Advance to the next string in memory.
@@ -292,6 +784,41 @@ void String_DestroyUnmanagedArray(lua_State* L, String* string[], int numStrings
     }
 }
 
+static void StringPool_GetChainStats(String** node, int numNodes, lua_HashStats* stats)
+{
+    for (int i = 0; i < numNodes; ++i)
+    {
+        int length = 0;
+        for (const String* string = node[i]; string != NULL; string = string->nextString)
+        {
+            ++length;
+        }
+        if (length > 0)
+        {
+            ++stats->numChains;
+        }
+        if (length > stats->maxChainLength)
+        {
+            stats->maxChainLength = length;
+        }
+    }
+}
+
+void StringPool_GetHashStats(StringPool* stringPool, lua_HashStats* stats)
+{
+    stats->numKeys          = stringPool->numStrings;
+    stats->numNodes         = stringPool->numNodes;
+    stats->numChains        = 0;
+    stats->maxChainLength   = 0;
+    StringPool_GetChainStats(stringPool->node, stringPool->numNodes, stats);
+    if (stringPool->oldNode != NULL)
+    {
+        stats->numNodes += stringPool->numOldNodes - stringPool->migrateIndex;
+        StringPool_GetChainStats(stringPool->oldNode + stringPool->migrateIndex,
+            stringPool->numOldNodes - stringPool->migrateIndex, stats);
+    }
+}
+
 int String_Compare(String* string1, String* string2)
 {
     const char *l = String_GetData(string1);
@@ -11,29 +11,135 @@
 
 struct Table;
 union  Value;
+struct lua_HashStats;
 
+/**
+ * Strings longer than this are not interned in the string pool, and their
+ * hash is only computed when they're used as a table key. Large strings like
+ * file contents are rarely used as keys, so this avoids hashing them and
+ * keeps them out of the pool. Since a long string may exist as more than one
+ * object, they must be compared with String_GetIsEqualLong.
+ */
+const size_t String_maxShortLength = 40;
+
+/**
+ * A slice is a long string which references part of the data of another long
+ * string (its parent) rather than storing a copy. The parent is kept alive by
+ * the slice, unless the garbage collector finds that the parent is otherwise
+ * unreachable and its slices only cover a small part of it, in which case the
+ * slices are materialized into their own buffers. Since the data for a slice
+ * isn't null terminated and can move, String_GetTerminatedData must be used
+ * when the data is needed for anything more than a copy or a comparison.
+ */
 struct String : public Gc_Object
 {
-	unsigned int    hash;
+	unsigned int    hash;       // Holds the hash seed for a long string until hashed.
+    bool            hashed;     // Always true for short strings.
+    bool            external;   // Data is owned by the host (see ExternalString).
+    bool            appendable; // Data can be extended in place (see AppendBuffer).
 	size_t 			length;
-	String*			nextString;	// Next chained string in the string pool.
-    String*         prevString; // Pevious chained string in the string pool.
-#ifdef DEBUG
-    // Useful for viewing in the watch window, but not necessary since the
-    // string data is immediately after the structure in memory.
-    const char*     _data;
-#endif
+    const char*     data;       // Follows the structure unless a slice or materialized.
+    // Long strings aren't in the string pool, so they reuse the chain fields.
+    union
+    {
+	    String*		nextString;	// Next chained string in the string pool.
+        String*     parent;     // String holding the data for a slice, or NULL.
+    };
+    union
+    {
+        String*     prevString; // Pevious chained string in the string pool.
+        size_t      sliceLength;// Total length of the reachable slices, used by the gc.
+    };
+};
+
+/**
+ * An external string is a long string whose data is owned by the host rather
+ * than by the string. The release function is called with the data when the
+ * string is collected. The data must remain valid and unchanged until then.
+ */
+struct ExternalString : public String
+{
+    lua_FreeString  freefn;
+    void*           ud;
 };
 
+/**
+ * Concatenating onto a string at least this long produces a slice of an
+ * AppendBuffer rather than a new copy of the data.
+ */
+const size_t String_minAppendLength = 256;
+
+/**
+ * An append buffer holds the data for strings built by concatenating onto a
+ * large string. The strings are slices of the buffer, and since the buffer has
+ * spare room, concatenating onto the slice which ends at the end of the used
+ * part writes the new characters in place rather than copying the whole
+ * string. This makes building a string with s = s .. x in a loop linear rather
+ * than quadratic. The length of the buffer is its capacity, and the buffer
+ * itself is never given out as a value.
+ */
+struct AppendBuffer : public String
+{
+    size_t          used;
+};
+
+/**
+ * The number of nodes in the string pool is always a power of two. When the
+ * pool grows, the old nodes are kept alongside the new ones and the chains are
+ * moved over a few at a time as strings are looked up, so that a single insert
+ * doesn't pay for rehashing every string in the pool.
+ */
 struct StringPool
 {
     String**        node;
     int             numStrings;
     int             numNodes;
+    String**        oldNode;        // Chains not yet moved by an incremental resize.
+    int             numOldNodes;
+    int             migrateIndex;   // Next chain in oldNode to move.
+    unsigned int    seed;           // Random seed for the hash function.
 };
 
 inline const char* String_GetData(const String* string)
-    { return reinterpret_cast<const char*>(string + 1); }
+    { return string->data; }
+
+inline bool String_GetIsLong(const String* string)
+    { return string->length > String_maxShortLength; }
+
+inline bool String_GetIsSlice(const String* string)
+    { return String_GetIsLong(string) && string->parent != NULL; }
+
+/**
+ * Copies the data for a slice into its own buffer and releases the parent.
+ */
+void String_Materialize(lua_State* L, String* string);
+
+/**
+ * Returns the data for the string with a null terminator. Slices are
+ * materialized first, which also means the data won't move if the garbage
+ * collector later finds that the parent is unreachable, so this must be used
+ * when the data is given out through the API.
+ */
+FORCE_INLINE const char* String_GetTerminatedData(lua_State* L, String* string)
+{
+    if (String_GetIsSlice(string))
+    {
+        String_Materialize(L, string);
+    }
+    return string->data;
+}
+
+/** Computes the hash for a long string which hasn't been hashed yet. */
+void String_ComputeHash(String* string);
+
+FORCE_INLINE unsigned int String_GetHash(String* string)
+{
+    if (!string->hashed)
+    {
+        String_ComputeHash(string);
+    }
+    return string->hash;
+}
 
 /**
  * Allocates a new string. If a string with identical data already exists,
@@ -42,6 +148,44 @@ inline const char* String_GetData(const String* string)
 String* String_Create(lua_State* L, const char* data);
 String* String_Create(lua_State* L, const char* data, size_t length);
 
+/**
+ * Returns a string holding length characters of the string starting at start.
+ * Long strings are returned as a slice referencing the data of the original.
+ */
+String* String_CreateSlice(lua_State* L, String* string, size_t start, size_t length);
+
+/**
+ * Returns a string which references data owned by the host. The data must be
+ * null terminated. Short strings are copied into the string pool, in which
+ * case freefn is called immediately.
+ */
+String* String_CreateExternal(lua_State* L, const char* data, size_t length, lua_FreeString freefn, void* ud);
+
+/**
+ * Returns a string holding the data of string followed by length more
+ * characters, which the caller must write to the location returned in append
+ * before anything else is allocated. This is used for concatenating onto long
+ * strings (see AppendBuffer).
+ */
+String* String_Append(lua_State* L, String* string, size_t length, char** append);
+
+/**
+ * Creates a buffer for building a long string in place. The buffer is a
+ * string with room for size characters whose contents are undefined until
+ * String_FinishBuffer is called. Since it's an ordinary garbage collected
+ * object, the storage is reclaimed if an error occurs while building.
+ */
+String* String_CreateBuffer(lua_State* L, size_t size);
+
+/** Changes the size of a buffer, keeping the existing contents. */
+char* String_ResizeBuffer(lua_State* L, String* string, size_t size);
+
+/**
+ * Turns the first length characters of a buffer into a finished string. For
+ * a long string, the buffer is returned without copying the data.
+ */
+String* String_FinishBuffer(lua_State* L, String* string, size_t length);
+
 /**
  * Allocates an array of strings which exist outside of the garbage collector.
  * The strings must be explicitly released with DestroyUnmanagedArray. The
@@ -57,9 +201,20 @@ void String_DestroyUnmanagedArray(lua_State* L, String* string[], int numStrings
  * there are no remaining references to the string (i.e. it should only be
  * called by the garbage collector).
  */
-void String_Destroy(lua_State* L, String* string); 
+void String_Destroy(lua_State* L, String* string, bool releaseRefs);
+
+/**
+ * Returns true if two different string objects hold the same data. This can
+ * only be the case if both strings are long strings.
+ */
+bool String_GetIsEqualLong(String* string1, String* string2);
+
+/** Returns true if the two strings hold the same data. */
+inline bool String_GetIsEqual(String* string1, String* string2)
+    { return string1 == string2 || String_GetIsEqualLong(string1, string2); }
 
-// Return value is the same as strcmp.
+// Return value is the same as strcmp. The data for both strings must be null
+// terminated.
 int String_Compare(String* string1, String* string2);
 
 void StringPool_Initialize(lua_State* L, StringPool* stringPool);
@@ -73,4 +228,7 @@ void StringPool_Shutdown(lua_State* L, StringPool* stringPool);
  */
 void StringPool_Remove(lua_State* L, StringPool* stringPool, String* string);
 
+/** Computes the length of the chains in the string pool. */
+void StringPool_GetHashStats(StringPool* stringPool, lua_HashStats* stats);
+
 #endif
\ No newline at end of file
@@ -7,15 +7,42 @@
 
 #include "Table.h"
 #include "String.h"
+#include "Sort.h"
 
 #include <stdio.h>
 #include <malloc.h>
+#include <memory.h>
 
 namespace
 {
     // A 4 element array takes as much room as a single has table node, so
     // don't create an array of smaller size.
     const int _minArraySize = 4;
+    // Tables with more keys than this outside of the array part are not
+    // considered records, and their keys are stored in the hash part.
+    const int _maxShapeKeys = 16;
+    const int _minShapeSlots = 4;
+    // Hash parts with at least this many nodes are grown incrementally.
+    const int _incrementalResizeNodes = 1 << 15;
+    // Number of nodes moved from the old hash part on each insert during an
+    // incremental resize.
+    const int _numMigrateNodes = 16;
+    // Arrays with at least this many elements are sorted on multiple threads
+    // when ROCKET_PARALLEL_SORT is defined.
+    const int _parallelSortThreshold = 100000;
+    // Number of seeds tried when building the perfect hash for a frozen table
+    // before falling back to the ordinary hash. The number of buckets is
+    // doubled after each _perfectHashSeedsPerSize seeds, up to
+    // _maxPerfectHashBuckets buckets per key.
+    const int _maxPerfectHashSeeds = 64;
+    const int _perfectHashSeedsPerSize = 4;
+    const int _maxPerfectHashBuckets = 4;
+    // Number of entries in the index cache for a metatable (power of 2).
+    const int _numIndexCacheEntries = 4;
+    // The array or hash part is shrunk when it has at least this many times
+    // as much space as it needs, and it has at least _minShrinkSize entries.
+    const int _shrinkFactor = 4;
+    const int _minShrinkSize = 16;
 }
 
 // This define will check that the table is in a correct state after each
@@ -29,8 +56,19 @@ namespace
 // Enables tag method caching optimization for tables.
 #define TABLE_TAG_METHOD_CACHE
 
+// Enables caching look ups through chains of __index tables. Relies on the
+// tag method cache to detect changes to the __index tag method.
+#ifdef TABLE_TAG_METHOD_CACHE
+    #define TABLE_INDEX_CACHE
+#endif
+
+// Enables storing record-like tables using shapes instead of a hash.
+#define TABLE_SHAPE
+
 static void Table_InsertHash(lua_State* L, Table* table, Value* key, Value* value);
+static bool Table_InsertNode(lua_State* L, Table* table, const Value* key, const Value* value);
 static bool Table_WriteDot(const Table* table, const char* fileName);
+static void Table_FreeValues(lua_State* L, Table* table, Value* values, int num);
 
 template <class T>
 static inline void Swap(T& a, T& b)
@@ -50,6 +88,15 @@ Table* Table_Create(lua_State* L, int numArray, int numHash)
     Table* table = static_cast<Table*>( Gc_AllocateObject(L, LUA_TTABLE, sizeof(Table)) );
     table->numNodes         = 0;
     table->nodes            = NULL;
+    table->oldNodes         = NULL;
+    table->numOldNodes      = 0;
+    table->migrateIndex     = 0;
+    table->displacement     = NULL;
+    table->numBuckets       = 0;
+    table->perfectSeed      = 0;
+    table->shape            = NULL;
+    table->slot             = NULL;
+    table->maxSlots         = 0;
     table->numElementsSet   = 0;
     table->maxElements      = 0;
     table->numElements      = 0;
@@ -57,8 +104,16 @@ Table* Table_Create(lua_State* L, int numArray, int numHash)
     table->minHashKey       = INT_MAX;
     table->metatable        = NULL;
     table->size             = 0;
+    table->numericArray     = true;
     table->lastFreeNode     = NULL;
     table->tagMethod        = NULL;
+    table->noTagMethod      = 0;
+    table->version          = 0;
+    table->indexCache       = NULL;
+    table->weakKeys         = false;
+    table->weakValues       = false;
+    table->nextWeak         = NULL;
+    table->frozen           = false;
     // TODO: Initialize the array and hash parts based on the parameters.
     return table;
 }
@@ -83,12 +138,38 @@ void Table_Destroy(lua_State* L, Table* table, bool releaseRefs)
             ++node;
         }
 
-        // Release the array elements.
-        Value* element = table->element;
-        for (int i = 0; i < table->numElementsSet; ++i)
+        // Release the elements which haven't been migrated out of the old
+        // hash nodes yet.
+        node = table->oldNodes;
+        for (int i = 0; i < table->numOldNodes; ++i)
+        {
+            if (!Table_NodeIsEmpty(node))
+            {
+                Gc_DecrementReference(L, gc, &node->value);
+            }
+            Gc_DecrementReference(L, gc, &node->key);
+            ++node;
+        }
+
+        // Release the array elements. There may be holes in the array, so we
+        // can't stop after numElementsSet elements.
+        if (!table->numericArray)
+        {
+            Value* element = table->element;
+            for (int i = 0; i < table->size; ++i)
+            {
+                Gc_DecrementReference(L, gc, element);
+                ++element;
+            }
+        }
+
+        // Release the values stored using the shape.
+        if (table->shape != NULL)
         {
-            Gc_DecrementReference(L, gc, element);
-            ++element;
+            for (int i = 0; i < table->shape->numKeys; ++i)
+            {
+                Gc_DecrementReference(L, gc, &table->slot[i]);
+            }
         }
 
         // We don't need to release the tag methods since we don't increment
@@ -103,13 +184,30 @@ void Table_Destroy(lua_State* L, Table* table, bool releaseRefs)
     }
 
     Free(L, table->nodes, table->numNodes * sizeof(TableNode));
-    Free(L, table->element, table->maxElements * sizeof(Value));
+    Free(L, table->oldNodes, table->numOldNodes * sizeof(TableNode));
+    Table_FreeValues(L, table, table->element, table->maxElements);
+    Table_FreeValues(L, table, table->slot, table->maxSlots);
+    Free(L, table->displacement, table->numBuckets * sizeof(unsigned int));
+
+    // The shape is not a garbage collected object, so we always need to
+    // release it, even when the keys have been collected.
+    if (table->shape != NULL)
+    {
+        Shape_Release(L, table->shape, releaseRefs);
+    }
 
     if (table->tagMethod != NULL)
     {
         Free(L, table->tagMethod, sizeof(Value) * TagMethod_NumMethods);
     }
 
+    // The index cache doesn't hold references since it's validated before
+    // any of the tables in it are used.
+    if (table->indexCache != NULL)
+    {
+        FreeArray(L, table->indexCache, _numIndexCacheEntries);
+    }
+
     Free(L, table, sizeof(Table));
 
 }
@@ -149,12 +247,15 @@ static inline unsigned int Hash(double v)
 
 static inline unsigned int Hash(void* v)
 {
-    // Disable 64-bit portability warning. This function should be
-    // completely changed for 64-bit keys.
-#pragma warning( push )
-#pragma warning( disable : 4311 )
-    return Hash(reinterpret_cast<UInt32>(v));
-#pragma warning( pop ) 
+    // Objects are aligned, so the low bits don't carry any information. On
+    // 64-bit platforms the high bits are mixed in as well.
+    UInt64 p = reinterpret_cast<size_t>(v) >> 3;
+    unsigned int h = Hash(static_cast<UInt32>(p));
+    if (sizeof(void*) > sizeof(UInt32))
+    {
+        HashCombine(h, Hash(static_cast<UInt32>(p >> 32)));
+    }
+    return h;
 }
 
 FORCE_INLINE static unsigned int Hash(const Value* key)
@@ -165,7 +266,7 @@ FORCE_INLINE static unsigned int Hash(const Value* key)
     }
     else if (Value_GetIsString(key))
     {
-        return key->string->hash;
+        return String_GetHash(key->string);
     }
     else if (Value_GetIsBoolean(key))
     {
@@ -180,12 +281,67 @@ FORCE_INLINE static bool KeysEqual(const Value* key1, const Value* key2)
     {
         return false;
     }
-    return key1->object == key2->object;
+    if (key1->object == key2->object)
+    {
+        return true;
+    }
+    return Value_GetIsString(key1) && String_GetIsLong(key1->string) &&
+           String_GetIsEqualLong(key1->string, key2->string);
+}
+
+/**
+ * Maps a hash value onto the range [0, n) using the high bits of the hash,
+ * which avoids a division.
+ */
+FORCE_INLINE static unsigned int ReduceRange(unsigned int hash, unsigned int n)
+{
+    return static_cast<unsigned int>( (static_cast<UInt64>(hash) * n) >> 32 );
+}
+
+/**
+ * Returns the position of a key in a perfect hash with numNodes nodes before
+ * the displacement for its bucket is added.
+ */
+FORCE_INLINE static unsigned int Table_GetPerfectPosition(unsigned int hash, unsigned int seed, int numNodes)
+{
+    return ReduceRange( Hash(static_cast<UInt32>(hash ^ seed)), numNodes );
+}
+
+/**
+ * Returns the bucket for a key in a perfect hash. Multiplying by an odd number
+ * derived from the seed groups the keys differently for each seed.
+ */
+FORCE_INLINE static unsigned int Table_GetPerfectBucket(unsigned int hash, unsigned int seed, int numBuckets)
+{
+    return ReduceRange(hash * (seed * 2 + 1), numBuckets);
 }
 
 FORCE_INLINE static size_t Table_GetMainIndex(const Table* table, const Value* key)
 {
-    return Hash(key) & (table->numNodes - 1);
+    unsigned int hash = Hash(key);
+    if (table->displacement != NULL)
+    {
+        // A key in a perfect hash is always in its main node, so the chain
+        // for the key has at most one node.
+        unsigned int seed  = table->perfectSeed;
+        unsigned int index = Table_GetPerfectPosition(hash, seed, table->numNodes) +
+            table->displacement[ Table_GetPerfectBucket(hash, seed, table->numBuckets) ];
+        if (index >= static_cast<unsigned int>(table->numNodes))
+        {
+            index -= table->numNodes;
+        }
+        return index;
+    }
+    return hash & (table->numNodes - 1);
+}
+
+/**
+ * Returns the node at the start of the chain for the key in the old hash nodes
+ * of a table which is being resized incrementally.
+ */
+FORCE_INLINE static TableNode* Table_GetOldMainNode(const Table* table, const Value* key)
+{
+    return &table->oldNodes[ Hash(key) & (table->numOldNodes - 1) ];
 }
 
 /**
@@ -313,6 +469,11 @@ static bool Table_CheckConsistency(lua_State* L, Table* table)
         if (!Value_GetIsNil(&table->element[i]))
         {
             ++numElementsSet;
+            if (table->numericArray && !Value_GetIsNumber(&table->element[i]))
+            {
+                ASSERT(0);
+                return false;
+            }
         }
     }
     if (numElementsSet != table->numElementsSet)
@@ -321,6 +482,16 @@ static bool Table_CheckConsistency(lua_State* L, Table* table)
         return false;
     }
 
+    // Check the shape.
+    if (table->shape != NULL)
+    {
+        if (table->numNodes != 0 || table->shape->numKeys > table->maxSlots)
+        {
+            ASSERT(0);
+            return false;
+        }
+    }
+
     // Check the size
     if (table->size < 0 || table->size > table->numElements)
     {
@@ -348,7 +519,8 @@ static bool Table_CheckConsistency(lua_State* L, Table* table)
         for (int i = 0; i < TagMethod_NumMethods; ++i)
         {
             Value* value = Table_GetTable(L, table, L->tagMethodName[i]);
-            if (!Value_Equal(value, &table->tagMethod[i]))
+            if (!Value_Equal(value, &table->tagMethod[i]) ||
+                Value_GetIsNil(value) != Table_GetIsTagMethodAbsent(table, static_cast<TagMethod>(i)))
             {
                 ASSERT(0);
                 return false;
@@ -394,15 +566,81 @@ static int Log2(unsigned int v)
     return multiplyDeBruijnBitPosition[(unsigned int)(v * 0x07C4ACDDU) >> 27];
 }
 
-static void Table_AllocateArray(lua_State* L, Table* table, int maxElements)
+/**
+ * Resizes a buffer of values owned by the table (the array elements or the
+ * shape slots) and returns the new buffer. A small buffer is stored in the
+ * inline values of the table if they aren't being used for the other one.
+ */
+static Value* Table_ResizeValues(lua_State* L, Table* table, Value* values, int oldNum, int newNum)
+{
+
+    Value* inlineValue = table->inlineValue;
+    int numCopy = oldNum < newNum ? oldNum : newNum;
+
+    if (newNum > 0 && newNum <= Table_maxInlineValues)
+    {
+        if (values == inlineValue)
+        {
+            return values;
+        }
+        if (table->element != inlineValue && table->slot != inlineValue)
+        {
+            if (values != NULL)
+            {
+                memcpy(inlineValue, values, numCopy * sizeof(Value));
+                Free(L, values, oldNum * sizeof(Value));
+            }
+            return inlineValue;
+        }
+    }
+
+    if (values == inlineValue)
+    {
+        Value* result = NULL;
+        if (newNum > 0)
+        {
+            result = static_cast<Value*>( Allocate(L, newNum * sizeof(Value)) );
+            memcpy(result, inlineValue, numCopy * sizeof(Value));
+        }
+        return result;
+    }
+
+    return static_cast<Value*>( Reallocate(L, values, oldNum * sizeof(Value), newNum * sizeof(Value)) );
+
+}
+
+static void Table_FreeValues(lua_State* L, Table* table, Value* values, int num)
 {
-    size_t oldSize = table->maxElements * sizeof(Value);
-    size_t newSize = maxElements * sizeof(Value);
+    if (values != table->inlineValue)
+    {
+        Free(L, values, num * sizeof(Value));
+    }
+}
 
-    table->element = static_cast<Value*>(Reallocate(L, table->element, oldSize, newSize));
+static void Table_AllocateArray(lua_State* L, Table* table, int maxElements)
+{
+    table->element = Table_ResizeValues(L, table, table->element, table->maxElements, maxElements);
     table->maxElements = maxElements;
 }
 
+static TableNode* Table_AllocateNodes(lua_State* L, int numNodes)
+{
+    TableNode* nodes = static_cast<TableNode*>( Allocate(L, numNodes * sizeof(TableNode)) );
+    if (nodes != NULL)
+    {
+        for (int i = 0; i < numNodes; ++i)
+        {
+            SetNil(&nodes[i].key);
+            nodes[i].dead = true;
+            nodes[i].next = NULL;
+            nodes[i].prev = NULL;
+        }
+    }
+    return nodes;
+}
+
+static void Table_FinishResize(lua_State* L, Table* table);
+
 /**
  * If force is true, the hash will be rebuilt regardless of whether or not the
  * number of nodes has changed. This can be used to clear out dead nodes.
@@ -410,27 +648,32 @@ static void Table_AllocateArray(lua_State* L, Table* table, int maxElements)
 static bool Table_ResizeHash(lua_State* L, Table* table, int numNodes, bool force)
 {
 
-    if (table->numNodes == numNodes && !force)
+    // Any nodes left over from an incremental resize need to be moved first,
+    // since we only keep track of one old set of nodes.
+    Table_FinishResize(L, table);
+
+    if (table->numNodes == numNodes && !force && table->displacement == NULL)
     {
         return true;
     }
     
-    size_t size = numNodes * sizeof(TableNode);
-    TableNode* nodes = static_cast<TableNode*>( Allocate(L, size) );
+    TableNode* nodes = Table_AllocateNodes(L, numNodes);
 
     if (nodes == NULL && numNodes != 0)
     {
         return false;
     }
 
-    for (int i = 0; i < numNodes; ++i)
+    // The nodes are rehashed into an ordinary hash, so any perfect hash is
+    // discarded.
+    if (table->displacement != NULL)
     {
-        SetNil(&nodes[i].key);
-        nodes[i].dead = true;
-        nodes[i].next = NULL;
-        nodes[i].prev = NULL;
+        Free(L, table->displacement, table->numBuckets * sizeof(unsigned int));
+        table->displacement = NULL;
+        table->numBuckets   = 0;
+        table->perfectSeed  = 0;
     }
-        
+
     // Rehash all of the nodes.
 
     Swap(table->numNodes, numNodes);
@@ -445,10 +688,13 @@ static bool Table_ResizeHash(lua_State* L, Table* table, int numNodes, bool forc
         {
             if ( !Table_NodeIsEmpty(&nodes[i]) )
             {
-                Table_InsertHash(L, table, &nodes[i].key, &nodes[i].value);
-                Gc_DecrementReference(L, gc, &nodes[i].value);
+                // The references are transferred to the new node.
+                Table_InsertNode(L, table, &nodes[i].key, &nodes[i].value);
+            }
+            else
+            {
+                Gc_DecrementReference(L, gc, &nodes[i].key);
             }
-            Gc_DecrementReference(L, gc, &nodes[i].key);
         }
     }
     else
@@ -466,6 +712,111 @@ static bool Table_ResizeHash(lua_State* L, Table* table, int numNodes, bool forc
 
 }
 
+/**
+ * Moves up to numNodes nodes from the old hash nodes into the current ones
+ * for a table which is being resized incrementally. When all of the nodes
+ * have been moved, the old nodes are freed.
+ */
+static void Table_MigrateNodes(lua_State* L, Table* table, int numNodes)
+{
+
+    int index = table->migrateIndex;
+    int end   = index + numNodes;
+    if (end > table->numOldNodes)
+    {
+        end = table->numOldNodes;
+    }
+
+    Gc* gc = &L->gc;
+
+    // Nodes which have been moved are left behind as dead nodes with a nil key
+    // so that the chains through them are still valid for look ups.
+    TableNode* node = table->oldNodes + index;
+    for (; index < end; ++index, ++node)
+    {
+        if ( !Table_NodeIsEmpty(node) )
+        {
+            // The new nodes can't fill up during a resize, since they have
+            // room for twice as many keys as the old nodes.
+            bool inserted = Table_InsertNode(L, table, &node->key, &node->value);
+            ASSERT(inserted);
+            node->dead = true;
+            node->prev = NULL;
+        }
+        else
+        {
+            Gc_DecrementReference(L, gc, &node->key);
+        }
+        SetNil(&node->key);
+    }
+
+    table->migrateIndex = index;
+
+    if (index == table->numOldNodes)
+    {
+        Free(L, table->oldNodes, table->numOldNodes * sizeof(TableNode));
+        table->oldNodes     = NULL;
+        table->numOldNodes  = 0;
+        table->migrateIndex = 0;
+    }
+
+}
+
+/** Completes an incremental resize if one is in progress. */
+static void Table_FinishResize(lua_State* L, Table* table)
+{
+    if (table->oldNodes != NULL)
+    {
+        Table_MigrateNodes(L, table, table->numOldNodes - table->migrateIndex);
+    }
+}
+
+/**
+ * Doubles the size of the hash part. Small tables are rehashed immediately.
+ * Large tables keep the old nodes around alongside the new ones, and the keys
+ * are moved over a few at a time as new keys are inserted, so that a single
+ * insert doesn't pay for rehashing the entire table.
+ */
+static bool Table_GrowHash(lua_State* L, Table* table)
+{
+
+    int numNodes = table->numNodes * 2;
+    if (table->numNodes < _incrementalResizeNodes)
+    {
+        return Table_ResizeHash(L, table, numNodes, false);
+    }
+
+    Table_FinishResize(L, table);
+
+    TableNode* nodes = Table_AllocateNodes(L, numNodes);
+    if (nodes == NULL)
+    {
+        return false;
+    }
+
+    table->oldNodes     = table->nodes;
+    table->numOldNodes  = table->numNodes;
+    table->migrateIndex = 0;
+    table->nodes        = nodes;
+    table->numNodes     = numNodes;
+    table->lastFreeNode = nodes + numNodes - 1;
+
+    return true;
+
+}
+
+/**
+ * Updates whether or not the array part only contains numbers after the value
+ * is stored in it.
+ */
+FORCE_INLINE static void Table_UpdateArrayMode(Table* table, const Value* value)
+{
+    if (!Value_GetIsNumber(value))
+    {
+        table->numericArray = false;
+    }
+}
+
 static void Table_InitializeArrayElements(Table* table, int numElements)
 {
     Value* start = table->element + table->numElements;
@@ -481,16 +832,21 @@ static void Table_InitializeArrayElements(Table* table, int numElements)
 static void Table_RebuildArray(lua_State* L, Table* table, int maxElements)
 {
 
+    Table_FinishResize(L, table);
+
     // count[i] stores the number of integer keys between 2^i and 2^(i+1).
     int count[LUAI_BITSINT] = { 0 };
 
-    // Count the array elements.
+    // Count the array elements. Since we're visiting all of them, this is a
+    // good time to check if the array has gone back to only holding numbers.
+    table->numericArray = true;
     Value* element = table->element;
     for (int i = 0; i < table->numElements; ++i)
     {
         if (!Value_GetIsNil(element))
         {
             ++count[Log2(i + 1)];
+            Table_UpdateArrayMode(table, element);
         }
         ++element;
     }
@@ -573,6 +929,7 @@ static void Table_RebuildArray(lua_State* L, Table* table, int maxElements)
                 Value* dst = &table->element[key - 1];
                 ASSERT( Value_GetIsNil(dst) );
                 *dst = node->value;
+                Table_UpdateArrayMode(table, dst);
                 // We don't need to increment the reference to the value, since
                 // we would normally decrement it when we set the node to dead.
                 if (key > table->size)
@@ -654,6 +1011,15 @@ static TableNode* Table_GetNodeIncludeDead(Table* table, const Value* key)
         node = node->next;
     }
 
+    if (node == NULL && table->oldNodes != NULL)
+    {
+        node = Table_GetOldMainNode(table, key);
+        while ( node != NULL && !KeysEqual(&node->key, key) )
+        {
+            node = node->next;
+        }
+    }
+
     return node;
 
 }
@@ -678,6 +1044,16 @@ static TableNode* Table_GetNode(Table* table, const Value* key)
         node = node->next;
     }
 
+    // During an incremental resize the key may not have been moved yet.
+    if (node == NULL && table->oldNodes != NULL)
+    {
+        node = Table_GetOldMainNode(table, key);
+        while ( node != NULL && (node->dead || !KeysEqual(&node->key, key)) )
+        {
+            node = node->next;
+        }
+    }
+
     return node;
 
 }
@@ -705,6 +1081,17 @@ static TableNode* Table_GetNode(Table* table, const Value* key, TableNode*& prev
         node = node->next;
     }
 
+    if (node == NULL && table->oldNodes != NULL)
+    {
+        node = Table_GetOldMainNode(table, key);
+        prev = NULL;
+        while ( node != NULL && (node->dead || !KeysEqual(&node->key, key)) )
+        {
+            prev = node;
+            node = node->next;
+        }
+    }
+
     prevNode = prev;
     return node;
 
@@ -721,12 +1108,16 @@ static void Table_CreateTagMethodArray(lua_State* L, Table* table)
     for (int i = 0; i < TagMethod_NumMethods; ++i)
     {
         table->tagMethod[i] = *Table_GetTable(L, table, L->tagMethodName[i]);
+        if (Value_GetIsNil(&table->tagMethod[i]))
+        {
+            table->noTagMethod |= 1 << i;
+        }
     }
 }
 
 /**
  * If the key is a tag method name and we have cached tag methods, update the
- * cached value.
+ * cached value and whether or not the tag method is absent.
  */
 FORCE_INLINE static void Table_UpdateTagMethod(lua_State* L, Table* table, const Value* key, Value* value)
 {
@@ -734,6 +1125,15 @@ FORCE_INLINE static void Table_UpdateTagMethod(lua_State* L, Table* table, const
     {
         TagMethod tm = State_GetTagMethod(L, key->string);
         table->tagMethod[tm] = *value;
+        Table_UpdateVersion(table);
+        if (Value_GetIsNil(value))
+        {
+            table->noTagMethod |= 1 << tm;
+        }
+        else
+        {
+            table->noTagMethod &= ~(1 << tm);
+        }
     }
 }
 
@@ -749,70 +1149,337 @@ Value* Table_GetTagMethod(lua_State* L, Table* table, TagMethod method)
     return Table_GetTable(L, table, L->tagMethodName[method]);
 #endif
 }
- 
-static bool Table_RemoveHash(lua_State* L, Table* table, const Value* key)
+
+bool Table_GetIndexChain(lua_State* L, Table* metatable, const Value* key, Value* dst)
 {
 
-    TableNode* prev = NULL;
-    TableNode* node = Table_GetNode(table, key, prev);
+#ifdef TABLE_INDEX_CACHE
 
-    if (node == NULL)
+    ASSERT( Value_GetIsString(key) );
+    const String* string = key->string;
+
+    // Long strings aren't unique, so the key pointer can't identify an entry.
+    if (String_GetIsLong(string))
     {
         return false;
     }
 
-    ASSERT(!node->dead);
-    Gc_DecrementReference(L, &L->gc, &node->value);
-
-    node->dead = true;
-    node->prev = prev;
-
-#ifdef TABLE_TAG_METHOD_CACHE
-    Table_UpdateTagMethod(L, table, key, &L->dummyObject);
-#endif
+    if (metatable->indexCache == NULL)
+    {
+        metatable->indexCache = AllocateArray<TableIndexCache>(L, _numIndexCacheEntries);
+        memset(metatable->indexCache, 0, _numIndexCacheEntries * sizeof(TableIndexCache));
+    }
 
-#ifdef TABLE_CHECK_CONSISTENCY
-    ASSERT( Table_CheckConsistency(L, table) );
-#endif
+    TableIndexCache* entry = &metatable->indexCache[string->hash & (_numIndexCacheEntries - 1)];
 
-    return true;
+    if (entry->key == string)
+    {
+        // Each table is only examined once the table before it is known to
+        // be unchanged, since otherwise it may no longer exist. The first
+        // table is always the metatable itself. The key pointer is never
+        // dereferenced; a different string reusing the same memory would
+        // have to be added to one of the tables, changing its version.
+        int numTables = entry->numTables;
+        int i = 0;
+        while (i < numTables && entry->table[i]->version == entry->version[i])
+        {
+            ++i;
+        }
+        if (i == numTables)
+        {
+            if (!entry->found)
+            {
+                SetNil(dst);
+                return true;
+            }
+            const Value* value = Table_GetTable(L, entry->table[numTables - 1], key);
+            if (!Value_GetIsNil(value))
+            {
+                *dst = *value;
+                return true;
+            }
+        }
+    }
 
-}
+    // Follow the chain, recording the tables we visit.
+    TableIndexCache result;
+    result.key       = string;
+    result.numTables = 0;
+    result.found     = false;
 
-static bool Table_Remove(lua_State* L, Table* table, int key)
-{
+    Table* table = metatable;
+    while (table != NULL)
+    {
 
-    Gc* gc = &L->gc;
+        // Record the metatable.
+        if (result.numTables == Table_maxIndexTables)
+        {
+            return false;
+        }
+        result.table[result.numTables]   = table;
+        result.version[result.numTables] = table->version;
+        ++result.numTables;
 
-    if (key > 0 && key <= table->maxElements)
-    {
+        const Value* method = Table_GetTagMethod(L, table, TagMethod_Index);
+        if (Value_GetIsNil(method))
+        {
+            break;
+        }
+        if (!Value_GetIsTable(method))
+        {
+            return false;
+        }
 
-        Value* dst = table->element + key - 1;
-        if (key > table->numElements || Value_GetIsNil(dst))
+        // Record the __index table and look for the key in it.
+        table = method->table;
+        if (result.numTables == Table_maxIndexTables)
         {
             return false;
         }
-        Gc_DecrementReference(L, gc, dst);
-        SetNil(dst);
-        --table->numElementsSet;
-        
-        // If we removed the last non-nil element in the array, we need to
-        // update the size.
-        if (key == table->size)
+        result.table[result.numTables]   = table;
+        result.version[result.numTables] = table->version;
+        ++result.numTables;
+
+        const Value* value = Table_GetTable(L, table, key);
+        if (!Value_GetIsNil(value))
         {
-            int size = table->size;
-            while (size > 0 && Value_GetIsNil(&table->element[size - 1]))
-            {
-                --size;
-            }
-            table->size = size;
+            *dst = *value;
+            result.found = true;
+            break;
         }
 
-    #ifdef TABLE_CHECK_CONSISTENCY
-        ASSERT( Table_CheckConsistency(L, table) );
-    #endif
+        table = table->metatable;
 
-        return true;
+    }
+
+    if (!result.found)
+    {
+        SetNil(dst);
+    }
+
+    *entry = result;
+    return true;
+
+#else
+    return false;
+#endif
+
+}
+
+/**
+ * Returns the slot for the key in a table which is using a shape, or -1 if
+ * the key is not part of the shape.
+ */
+FORCE_INLINE static int Table_GetSlot(const Table* table, const Value* key)
+{
+    ASSERT(table->shape != NULL);
+    if (Value_GetIsString(key))
+    {
+        return Shape_GetSlot(table->shape, key->string);
+    }
+    return -1;
+}
+
+/**
+ * Moves the values stored using the shape into the hash part of the table.
+ * This is done when the table no longer looks like a record.
+ */
+static void Table_MaterializeHash(lua_State* L, Table* table)
+{
+
+    Shape* shape = table->shape;
+    Value* slot  = table->slot;
+    int maxSlots = table->maxSlots;
+
+    table->shape    = NULL;
+    table->slot     = NULL;
+    table->maxSlots = 0;
+
+    int numSlotsSet = 0;
+    for (int i = 0; i < shape->numKeys; ++i)
+    {
+        if (!Value_GetIsNil(&slot[i]))
+        {
+            ++numSlotsSet;
+        }
+    }
+
+    // Leave room for the key that caused us to give up on the shape.
+    Table_ResizeHash(L, table, RoundUp2(numSlotsSet + 1), false);
+
+    Gc* gc = &L->gc;
+    for (int i = 0; i < shape->numKeys; ++i)
+    {
+        if (!Value_GetIsNil(&slot[i]))
+        {
+            Value key;
+            SetValue(&key, shape->key[i]);
+            Table_InsertHash(L, table, &key, &slot[i]);
+            Gc_DecrementReference(L, gc, &slot[i]);
+        }
+    }
+
+    Table_FreeValues(L, table, slot, maxSlots);
+    Shape_Release(L, shape, true);
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, table) );
+#endif
+
+}
+
+/**
+ * Inserts a new key into a table which is using a shape (or which is empty
+ * and can start using one). Returns false if the key can't be stored using
+ * a shape, in which case the caller should fall back to the hash part.
+ */
+static bool Table_InsertShape(lua_State* L, Table* table, const Value* key, Value* value)
+{
+
+    // Shapes identify keys by pointer, so they can only hold interned strings.
+    if (!Value_GetIsString(key) || String_GetIsLong(key->string))
+    {
+        return false;
+    }
+
+    Shape* shape = table->shape;
+
+    if (shape != NULL)
+    {
+        // If the key was removed from the table, it still has a slot.
+        int index = Shape_GetSlot(shape, key->string);
+        if (index != -1)
+        {
+            ASSERT( Value_GetIsNil(&table->slot[index]) );
+            Gc_IncrementReference(&L->gc, table, value);
+            table->slot[index] = *value;
+        #ifdef TABLE_TAG_METHOD_CACHE
+            Table_UpdateTagMethod(L, table, key, value);
+        #endif
+            return true;
+        }
+        if (shape->numKeys == _maxShapeKeys)
+        {
+            return false;
+        }
+    }
+
+    Shape* child = Shape_GetChild(L, table, shape, key->string);
+    int numKeys = child->numKeys;
+
+    if (numKeys > table->maxSlots)
+    {
+        int maxSlots = table->maxSlots * 2;
+        if (maxSlots < _minShapeSlots)
+        {
+            maxSlots = _minShapeSlots;
+        }
+        table->slot = Table_ResizeValues(L, table, table->slot, table->maxSlots, maxSlots);
+        table->maxSlots = maxSlots;
+    }
+
+    Shape_AddReference(child);
+    if (shape != NULL)
+    {
+        Shape_Release(L, shape, true);
+    }
+    table->shape = child;
+
+    Gc_IncrementReference(&L->gc, table, value);
+    table->slot[numKeys - 1] = *value;
+
+#ifdef TABLE_TAG_METHOD_CACHE
+    Table_UpdateTagMethod(L, table, key, value);
+#endif
+
+    return true;
+
+}
+
+static bool Table_RemoveHash(lua_State* L, Table* table, const Value* key)
+{
+
+    Table_UpdateVersion(table);
+
+#ifdef TABLE_SHAPE
+    if (table->shape != NULL)
+    {
+        // The key keeps its slot so that we can continue iterating over the
+        // table and so the key can be added back without changing the shape.
+        int index = Table_GetSlot(table, key);
+        if (index == -1 || Value_GetIsNil(&table->slot[index]))
+        {
+            return false;
+        }
+        Gc_DecrementReference(L, &L->gc, &table->slot[index]);
+        SetNil(&table->slot[index]);
+    #ifdef TABLE_TAG_METHOD_CACHE
+        Table_UpdateTagMethod(L, table, key, &L->dummyObject);
+    #endif
+        return true;
+    }
+#endif
+
+    TableNode* prev = NULL;
+    TableNode* node = Table_GetNode(table, key, prev);
+
+    if (node == NULL)
+    {
+        return false;
+    }
+
+    ASSERT(!node->dead);
+    Gc_DecrementReference(L, &L->gc, &node->value);
+
+    node->dead = true;
+    node->prev = prev;
+
+#ifdef TABLE_TAG_METHOD_CACHE
+    Table_UpdateTagMethod(L, table, key, &L->dummyObject);
+#endif
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, table) );
+#endif
+
+    return true;
+
+}
+
+static bool Table_Remove(lua_State* L, Table* table, int key)
+{
+
+    Gc* gc = &L->gc;
+
+    if (key > 0 && key <= table->maxElements)
+    {
+
+        Value* dst = table->element + key - 1;
+        if (key > table->numElements || Value_GetIsNil(dst))
+        {
+            return false;
+        }
+        Gc_DecrementReference(L, gc, dst);
+        SetNil(dst);
+        --table->numElementsSet;
+        
+        // If we removed the last non-nil element in the array, we need to
+        // update the size.
+        if (key == table->size)
+        {
+            int size = table->size;
+            while (size > 0 && Value_GetIsNil(&table->element[size - 1]))
+            {
+                --size;
+            }
+            table->size = size;
+        }
+
+    #ifdef TABLE_CHECK_CONSISTENCY
+        ASSERT( Table_CheckConsistency(L, table) );
+    #endif
+
+        return true;
     }
 
     Value k;
@@ -849,6 +1516,25 @@ static TableNode* Table_GetFreeNode(Table* table)
  */
 bool Table_UpdateHash(lua_State* L, Table* table, Value* key, Value* value)
 {
+
+#ifdef TABLE_SHAPE
+    if (table->shape != NULL)
+    {
+        int index = Table_GetSlot(table, key);
+        if (index == -1 || Value_GetIsNil(&table->slot[index]))
+        {
+            return false;
+        }
+        Value* dst = &table->slot[index];
+        Gc_IncrementReference(&L->gc, table, value);
+        Gc_DecrementReference(L, &L->gc, dst);
+        *dst = *value;
+    #ifdef TABLE_TAG_METHOD_CACHE
+        Table_UpdateTagMethod(L, table, key, value);
+    #endif
+        return true;
+    }
+#endif
     
     TableNode* node = Table_GetNode(table, key);
     if (node == NULL)
@@ -903,6 +1589,7 @@ FORCE_INLINE bool Table_Update(lua_State* L, Table* table, int key, Value* value
             return false;
         }
 
+        Table_UpdateArrayMode(table, value);
         Gc_IncrementReference(&L->gc, table, value);
         Gc_DecrementReference(L, &L->gc, dst);
         *dst = *value;
@@ -940,6 +1627,10 @@ bool Table_Update(lua_State* L, Table* table, Value* key, Value* value)
 
 void Table_SetTable(lua_State* L, Table* table, int key, Value* value)
 {
+    if (table->frozen)
+    {
+        State_Error(L, "attempt to modify a frozen table");
+    }
     if (!Table_Update(L, table, key, value) && !Value_GetIsNil(value))
     {
         Table_Insert(L, table, key, value);
@@ -998,21 +1689,13 @@ static TableNode* Table_UnlinkDeadNode(Table* table, TableNode* node)
     return node;
 }
 
-static void Table_InsertHash(lua_State* L, Table* table, Value* key, Value* value)
+/**
+ * Stores the key and value in a node in the hash part. The table takes over
+ * the references held by the caller. Returns false if there are no free nodes.
+ */
+static bool Table_InsertNode(lua_State* L, Table* table, const Value* key, const Value* value)
 {
 
-    ASSERT( !Value_GetIsNil(value) );
-
-    if (table->numNodes == 0)
-    {
-        Table_ResizeHash(L, table, 2, false);
-    }
-
-Start:
-
-    Gc_IncrementReference(&L->gc, table, key);
-    Gc_IncrementReference(&L->gc, table, value);
-
     size_t index = Table_GetMainIndex(table, key);
     TableNode* node = &table->nodes[index];
 
@@ -1045,11 +1728,7 @@ Start:
         TableNode* freeNode = Table_GetFreeNode(table);
         if (freeNode == NULL)
         {
-            // Table is full, so resize.
-            if (Table_ResizeHash(L, table, table->numNodes * 2, false))
-            {
-                goto Start;
-            }
+            return false;
         }
 
         Gc_DecrementReference(L, &L->gc, &freeNode->key);
@@ -1114,6 +1793,52 @@ Start:
         }
 
     }
+
+    return true;
+
+}
+
+static void Table_InsertHash(lua_State* L, Table* table, Value* key, Value* value)
+{
+
+    ASSERT( !Value_GetIsNil(value) );
+
+    Table_UpdateVersion(table);
+
+#ifdef TABLE_SHAPE
+    if (table->shape != NULL || table->numNodes == 0)
+    {
+        if (Table_InsertShape(L, table, key, value))
+        {
+            return;
+        }
+        if (table->shape != NULL)
+        {
+            Table_MaterializeHash(L, table);
+        }
+    }
+#endif
+
+    if (table->numNodes == 0)
+    {
+        Table_ResizeHash(L, table, 2, false);
+    }
+    else if (table->oldNodes != NULL)
+    {
+        Table_MigrateNodes(L, table, _numMigrateNodes);
+    }
+
+    Gc_IncrementReference(&L->gc, table, key);
+    Gc_IncrementReference(&L->gc, table, value);
+
+    while (!Table_InsertNode(L, table, key, value))
+    {
+        // Table is full, so resize.
+        if (!Table_GrowHash(L, table))
+        {
+            State_Error(L);
+        }
+    }
     
 #ifdef TABLE_TAG_METHOD_CACHE
     Table_UpdateTagMethod(L, table, key, value);
@@ -1148,6 +1873,7 @@ FORCE_INLINE static void Table_AssignArray(lua_State* L, Table* table, int index
         table->size = index + 1;
     }
 
+    Table_UpdateArrayMode(table, value);
     Gc_IncrementReference(&L->gc, table, value);
     element[index] = *value;
 
@@ -1213,6 +1939,10 @@ void Table_Insert(lua_State* L, Table* table, Value* key, Value* value)
 
 void Table_SetTable(lua_State* L, Table* table, Value* key, Value* value)
 {
+    if (table->frozen)
+    {
+        State_Error(L, "attempt to modify a frozen table");
+    }
     if (!Table_Update(L, table, key, value) && !Value_GetIsNil(value))
     {
         Table_Insert(L, table, key, value);
@@ -1226,6 +1956,18 @@ void Table_SetTable(lua_State* L, Table* table, Value* key, Value* value)
 FORCE_INLINE static Value* Table_GetTableHash(lua_State* L, Table* table, const Value* key)
 {
 
+#ifdef TABLE_SHAPE
+    if (table->shape != NULL)
+    {
+        int index = Table_GetSlot(table, key);
+        if (index == -1)
+        {
+            return &L->dummyObject;
+        }
+        return &table->slot[index];
+    }
+#endif
+
     TableNode* node = Table_GetNode(table, key);
     if (node == NULL)
     {
@@ -1281,8 +2023,23 @@ Value* Table_GetTable(lua_State* L, Table* table, const Value* key, int hint)
     {
         return Table_GetTable(L, table, index);
     }
-    // If the hint is valid, check if it is the correct key.
-    if (hint < table->numNodes)
+#ifdef TABLE_SHAPE
+    // For a table with a shape the hint is the slot, so checking the key in
+    // the shape is enough to know where the value is.
+    const Shape* shape = table->shape;
+    if (shape != NULL)
+    {
+        if (static_cast<unsigned int>(hint) < static_cast<unsigned int>(shape->numKeys) &&
+            Value_GetIsString(key) && shape->key[hint] == key->string)
+        {
+            return &table->slot[hint];
+        }
+        return Table_GetTableHash(L, table, key);
+    }
+#endif
+    // If the hint is valid, check if it is the correct key. The hint may be
+    // from a node which was in an old set of nodes, so it can be out of range.
+    if (static_cast<unsigned int>(hint) < static_cast<unsigned int>(table->numNodes))
     {
         TableNode* node = table->nodes + hint;
         if (!node->dead & KeysEqual(&node->key, key))
@@ -1293,37 +2050,1118 @@ Value* Table_GetTable(lua_State* L, Table* table, const Value* key, int hint)
     return Table_GetTableHash(L, table, key);
 }
 
-int Table_GetSize(lua_State* L, Table* table)
+bool Table_InsertArray(lua_State* L, Table* table, int key, Value* value)
 {
 
-    if (table->numElements > 0)
+    int size = table->size;
+    if (table->numElements == 0 || key < 1 || key > size + 1 || Value_GetIsNil(value) ||
+        table->frozen)
     {
-        // If we have an array part, just use the size of that.
-        return table->size;
+        return false;
     }
 
-    // Find min, max such that min is non-nil and max is nil. These will
-    // bracket our length.
-    
-    int min = 0;
-    int max = 1;
-
-    while (1)
+    if (size + 1 > table->maxElements)
     {
-        // Check if max is non-nil. If it is, then move min up to max and
-        // advance max.
-        const Value* value = Table_GetTable(L, table, max);
-        if (Value_GetIsNil(value))
+        // If the next key is in the hash part, we can't simply grow the array.
+        if (size + 1 >= table->minHashKey)
         {
-            break;
-        }
-        else
-        {
-            min = max;
-            max *= 2;
+            return false;
         }
+        Table_ResizeArray(L, table, size + 1);
     }
-
+    if (size + 1 > table->numElements)
+    {
+        Table_InitializeArrayElements(table, size + 1);
+    }
+
+    // Elements past the size are nil, so there's always room to move up.
+    Value* element = table->element + key - 1;
+    memmove(element + 1, element, (size - key + 1) * sizeof(Value));
+
+    Table_UpdateArrayMode(table, value);
+    Gc_IncrementReference(&L->gc, table, value);
+    *element = *value;
+
+    ++table->numElementsSet;
+    if (table->size < size + 1)
+    {
+        table->size = size + 1;
+    }
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, table) );
+#endif
+
+    return true;
+
+}
+
+bool Table_RemoveArray(lua_State* L, Table* table, int key, Value* dst)
+{
+
+    int size = table->size;
+    if (table->numElements == 0 || key < 1 || key > size || table->frozen)
+    {
+        return false;
+    }
+
+    Value* element = table->element + key - 1;
+    *dst = *element;
+    memmove(element, element + 1, (size - key) * sizeof(Value));
+    SetNil(table->element + size - 1);
+
+    if (!Value_GetIsNil(dst))
+    {
+        --table->numElementsSet;
+        Gc_DecrementReference(L, &L->gc, dst);
+    }
+
+    // There may have been holes in the array, so find the new last element.
+    while (size > 0 && Value_GetIsNil(&table->element[size - 1]))
+    {
+        --size;
+    }
+    table->size = size;
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, table) );
+#endif
+
+    return true;
+
+}
+
+bool Table_MoveArray(lua_State* L, Table* src, int f, int e, int t, Table* dst)
+{
+
+    // Moving between tables with metatables would need to call the __index
+    // and __newindex tag methods.
+    if (src->metatable != NULL || dst->metatable != NULL || dst->frozen)
+    {
+        return false;
+    }
+
+    int n = e - f + 1;
+    if (n <= 0)
+    {
+        return true;
+    }
+    if (f < 1 || t < 1 || e > src->numElements)
+    {
+        return false;
+    }
+
+    int last = t + n - 1;
+    if (last > dst->maxElements)
+    {
+        // Only grow the array if the moved elements continue on from the
+        // existing ones, otherwise they belong in the hash part.
+        if (t > dst->size + 1)
+        {
+            return false;
+        }
+        Table_ResizeArray(L, dst, last);
+    }
+    // Resizing may have already initialized the elements when it moved
+    // elements from the hash part.
+    if (last > dst->numElements)
+    {
+        Table_InitializeArrayElements(dst, last);
+    }
+
+    Gc* gc = &L->gc;
+
+    // The elements are only located after resizing, since src may be dst.
+    Value* from = src->element + f - 1;
+    Value* to   = dst->element + t - 1;
+
+    // The references to the moved values are added before the references to
+    // the values they replace are released, since they may be the same.
+    if (!src->numericArray)
+    {
+        for (int i = 0; i < n; ++i)
+        {
+            Table_UpdateArrayMode(dst, &from[i]);
+            Gc_IncrementReference(gc, dst, &from[i]);
+        }
+    }
+
+    int numElementsSet = dst->numElementsSet;
+    for (int i = 0; i < n; ++i)
+    {
+        if (!Value_GetIsNil(&to[i]))
+        {
+            Gc_DecrementReference(L, gc, &to[i]);
+            --numElementsSet;
+        }
+    }
+
+    memmove(to, from, n * sizeof(Value));
+
+    for (int i = 0; i < n; ++i)
+    {
+        if (!Value_GetIsNil(&to[i]))
+        {
+            ++numElementsSet;
+        }
+    }
+    dst->numElementsSet = numElementsSet;
+
+    // Nil values may have been moved over the end of the array, so find the
+    // new last element.
+    int size = dst->size > last ? dst->size : last;
+    while (size > 0 && Value_GetIsNil(&dst->element[size - 1]))
+    {
+        --size;
+    }
+    dst->size = size;
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, dst) );
+#endif
+
+    return true;
+
+}
+
+bool Table_FillArray(lua_State* L, Table* table, int key, const Value* values, int n)
+{
+
+    if (table->frozen || key < 1 || key > table->size + 1)
+    {
+        return false;
+    }
+    if (n <= 0)
+    {
+        return true;
+    }
+
+    int last = key + n - 1;
+    if (last > table->maxElements)
+    {
+        Table_ResizeArray(L, table, last);
+    }
+    // Resizing may have already initialized the elements when it moved
+    // elements from the hash part.
+    if (last > table->numElements)
+    {
+        Table_InitializeArrayElements(table, last);
+    }
+
+    Gc* gc = &L->gc;
+    Value* element = table->element + key - 1;
+
+    // The reference to each new value is added before the reference to the
+    // value it replaces is released, since they may be the same.
+    int numElementsSet = table->numElementsSet;
+    for (int i = 0; i < n; ++i)
+    {
+        if (!Value_GetIsNil(&values[i]))
+        {
+            Table_UpdateArrayMode(table, &values[i]);
+            Gc_IncrementReference(gc, table, &values[i]);
+            ++numElementsSet;
+        }
+        if (!Value_GetIsNil(&element[i]))
+        {
+            Gc_DecrementReference(L, gc, &element[i]);
+            --numElementsSet;
+        }
+    }
+    table->numElementsSet = numElementsSet;
+
+    memcpy(element, values, n * sizeof(Value));
+
+    // Trailing nil values may have been stored, so find the new last element.
+    int size = table->size > last ? table->size : last;
+    while (size > 0 && Value_GetIsNil(&table->element[size - 1]))
+    {
+        --size;
+    }
+    table->size = size;
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, table) );
+#endif
+
+    return true;
+
+}
+
+struct Table_NumberLess
+{
+    FORCE_INLINE bool operator()(const Value& a, const Value& b) const
+        { return luai_numlt(a.number, b.number); }
+};
+
+struct Table_StringLess
+{
+    FORCE_INLINE bool operator()(const Value& a, const Value& b) const
+        { return a.string != b.string && String_Compare(a.string, b.string) < 0; }
+};
+
+template <class Less>
+static void Table_SortElements(lua_State* L, Value* first, Value* last, Less less)
+{
+#ifdef ROCKET_PARALLEL_SORT
+    if (last - first >= _parallelSortThreshold)
+    {
+        Sort_Parallel(L, first, last, less);
+        return;
+    }
+#else
+    (void)L;    // Only needed for the parallel sort.
+#endif
+    Sort(first, last, less);
+}
+
+bool Table_SortArray(lua_State* L, Table* table, int n)
+{
+
+    if (n < 2)
+    {
+        return true;
+    }
+    if (n > table->numElements || table->frozen)
+    {
+        return false;
+    }
+
+    Value* first = table->element;
+    Value* last  = table->element + n;
+
+    // Sorting only reorders the elements, so the reference counts and the
+    // color of the table don't need to be touched.
+    if (Value_GetIsNumber(first))
+    {
+        for (const Value* element = first; element < last; ++element)
+        {
+            // NaN doesn't have a consistent ordering.
+            if (!Value_GetIsNumber(element) || element->number != element->number)
+            {
+                return false;
+            }
+        }
+        Table_SortElements(L, first, last, Table_NumberLess());
+    }
+    else if (Value_GetIsString(first))
+    {
+        for (const Value* element = first; element < last; ++element)
+        {
+            if (!Value_GetIsString(element))
+            {
+                return false;
+            }
+        }
+        // The comparison needs null terminated strings, and may be done from
+        // more than one thread, so slices are materialized up front.
+        for (const Value* element = first; element < last; ++element)
+        {
+            String_GetTerminatedData(L, element->string);
+        }
+        Table_SortElements(L, first, last, Table_StringLess());
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+
+}
+
+/**
+ * Allocates a copy of a set of hash nodes. The chains are relinked to point
+ * into the copy, so the nodes have the same layout as the originals.
+ */
+static TableNode* Table_CopyNodes(lua_State* L, const TableNode* src, int numNodes)
+{
+
+    TableNode* nodes = static_cast<TableNode*>( Allocate(L, numNodes * sizeof(TableNode)) );
+    if (nodes == NULL)
+    {
+        State_Error(L);
+    }
+    memcpy(nodes, src, numNodes * sizeof(TableNode));
+
+    TableNode* node = nodes;
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if (node->next != NULL)
+        {
+            node->next = nodes + (node->next - src);
+        }
+        if (node->dead && node->prev != NULL)
+        {
+            node->prev = nodes + (node->prev - src);
+        }
+        ++node;
+    }
+
+    return nodes;
+
+}
+
+/** Adds references from the table to the keys and values in a set of nodes. */
+static void Table_IncrementNodeReferences(Gc* gc, Table* table, TableNode* node, int numNodes)
+{
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if (!Table_NodeIsEmpty(node))
+        {
+            Gc_IncrementReference(gc, table, &node->value);
+        }
+        Gc_IncrementReference(gc, table, &node->key);
+        ++node;
+    }
+}
+
+/**
+ * Creates a table with the same contents as another table. The parts of the
+ * table are copied as blocks rather than inserting the keys one at a time.
+ * The metatable is not copied.
+ */
+static Table* Table_Copy(lua_State* L, Table* table)
+{
+
+    Table* copy = Table_Create(L, 0, 0);
+
+    // Only the elements up to the size can be non-nil.
+    if (table->size > 0)
+    {
+        Table_AllocateArray(L, copy, table->size);
+        memcpy(copy->element, table->element, table->size * sizeof(Value));
+        copy->numElements = table->size;
+    }
+    copy->numElementsSet = table->numElementsSet;
+    copy->size           = table->size;
+    copy->numericArray   = table->numericArray;
+    copy->minHashKey     = table->minHashKey;
+
+    if (table->shape != NULL)
+    {
+        int numKeys = table->shape->numKeys;
+        copy->slot = Table_ResizeValues(L, copy, NULL, 0, table->maxSlots);
+        memcpy(copy->slot, table->slot, numKeys * sizeof(Value));
+        copy->maxSlots = table->maxSlots;
+        copy->shape    = table->shape;
+        Shape_AddReference(copy->shape);
+    }
+
+    if (table->displacement != NULL)
+    {
+        // The copy isn't frozen, so the keys from a perfect hash are inserted
+        // into an ordinary hash. The references are added below.
+        Table_ResizeHash(L, copy, RoundUp2(table->numNodes), false);
+        for (int i = 0; i < table->numNodes; ++i)
+        {
+            const TableNode* node = &table->nodes[i];
+            if (!Table_NodeIsEmpty(node))
+            {
+                Table_InsertNode(L, copy, &node->key, &node->value);
+            }
+        }
+    }
+    else if (table->numNodes > 0)
+    {
+        copy->nodes    = Table_CopyNodes(L, table->nodes, table->numNodes);
+        copy->numNodes = table->numNodes;
+        if (table->lastFreeNode != NULL)
+        {
+            copy->lastFreeNode = copy->nodes + (table->lastFreeNode - table->nodes);
+        }
+    }
+
+    // An incremental resize in progress is copied as-is rather than finished,
+    // since that would disturb a traversal of the original table.
+    if (table->oldNodes != NULL)
+    {
+        copy->oldNodes     = Table_CopyNodes(L, table->oldNodes, table->numOldNodes);
+        copy->numOldNodes  = table->numOldNodes;
+        copy->migrateIndex = table->migrateIndex;
+    }
+
+    // The copy now holds all of the same references as the original.
+    Gc* gc = &L->gc;
+    if (!copy->numericArray)
+    {
+        for (int i = 0; i < copy->size; ++i)
+        {
+            Gc_IncrementReference(gc, copy, &copy->element[i]);
+        }
+    }
+    if (copy->shape != NULL)
+    {
+        for (int i = 0; i < copy->shape->numKeys; ++i)
+        {
+            Gc_IncrementReference(gc, copy, &copy->slot[i]);
+        }
+    }
+    Table_IncrementNodeReferences(gc, copy, copy->nodes, copy->numNodes);
+    Table_IncrementNodeReferences(gc, copy, copy->oldNodes, copy->numOldNodes);
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, copy) );
+#endif
+
+    return copy;
+
+}
+
+/**
+ * Replaces a value stored in a deep copy of a table with the copy of the
+ * value. Tables which haven't been copied yet are copied and added to the
+ * work list.
+ */
+static void Table_CopyValue(lua_State* L, Table* copy, Value* value, Table* copies, Table* work)
+{
+
+    if (!Value_GetIsTable(value))
+    {
+        return;
+    }
+
+    Value result = *Table_GetTable(L, copies, value);
+    if (Value_GetIsNil(&result))
+    {
+        SetValue( &result, Table_Copy(L, value->table) );
+        Table_SetTable(L, copies, value, &result);
+        Table_SetTable(L, work, work->size + 1, value);
+    }
+
+    Gc* gc = &L->gc;
+    Gc_IncrementReference(gc, copy, &result);
+    Gc_DecrementReference(L, gc, value);
+    *value = result;
+
+}
+
+static void Table_CopyNodeValues(lua_State* L, Table* copy, TableNode* node, int numNodes, Table* copies, Table* work)
+{
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if (!Table_NodeIsEmpty(node))
+        {
+            Table_CopyValue(L, copy, &node->value, copies, work);
+        }
+        ++node;
+    }
+}
+
+Table* Table_Clone(lua_State* L, Table* table, bool deep)
+{
+
+    Gc* gc = &L->gc;
+
+    if (!deep)
+    {
+        Table* clone = Table_Copy(L, table);
+        if (table->metatable != NULL)
+        {
+            clone->metatable = table->metatable;
+            Gc_IncrementReference(gc, clone, table->metatable);
+        }
+        return clone;
+    }
+
+    // The copies are tracked in a table which maps each original table to its
+    // copy, so that tables which are referenced more than once (or are part of
+    // a cycle) are only copied once. A second table lists the originals in the
+    // order they were copied. Both are kept on the stack so that the copies
+    // are reachable while the garbage collector runs.
+
+    Value value;
+
+    Table* copies = Table_Create(L, 0, 0);
+    SetValue(&value, copies);
+    PushValue(L, &value);
+
+    Table* work = Table_Create(L, 0, 0);
+    SetValue(&value, work);
+    PushValue(L, &value);
+
+    Table* clone = Table_Copy(L, table);
+
+    Value original;
+    SetValue(&original, table);
+    SetValue(&value, clone);
+    Table_SetTable(L, copies, &original, &value);
+    Table_SetTable(L, work, 1, &original);
+
+    // The metatables are only set once all of the copies have been made, so
+    // that none of the copies are treated as weak tables in the meantime.
+    for (int i = 1; i <= work->size; ++i)
+    {
+        original = *Table_GetTable(L, work, i);
+        Table* copy = Table_GetTable(L, copies, &original)->table;
+        // The copy is kept on the stack while its values are copied, since
+        // the garbage collector doesn't shrink tables on the stack.
+        SetValue(&value, copy);
+        PushValue(L, &value);
+        if (!copy->numericArray)
+        {
+            for (int j = 0; j < copy->size; ++j)
+            {
+                Table_CopyValue(L, copy, &copy->element[j], copies, work);
+            }
+        }
+        if (copy->shape != NULL)
+        {
+            for (int j = 0; j < copy->shape->numKeys; ++j)
+            {
+                Table_CopyValue(L, copy, &copy->slot[j], copies, work);
+            }
+        }
+        Table_CopyNodeValues(L, copy, copy->nodes, copy->numNodes, copies, work);
+        Table_CopyNodeValues(L, copy, copy->oldNodes, copy->numOldNodes, copies, work);
+        Pop(L, 1);
+    }
+
+    for (int i = 1; i <= work->size; ++i)
+    {
+        original = *Table_GetTable(L, work, i);
+        Table* metatable = original.table->metatable;
+        if (metatable != NULL)
+        {
+            Table* copy = Table_GetTable(L, copies, &original)->table;
+            copy->metatable = metatable;
+            Gc_IncrementReference(gc, copy, metatable);
+        }
+    }
+
+    Pop(L, 2);
+    return clone;
+
+}
+
+struct Table_BucketLarger
+{
+    const int* bucketStart;
+    FORCE_INLINE bool operator()(int a, int b) const
+    {
+        return bucketStart[a + 1] - bucketStart[a] > bucketStart[b + 1] - bucketStart[b];
+    }
+};
+
+/**
+ * Rebuilds the hash part of the table as a minimal perfect hash, so that there
+ * is one node for each key. The keys are grouped into buckets and each bucket
+ * is given a displacement which moves all of its keys into unused nodes. The
+ * largest buckets are placed first while most of the nodes are unused. If a
+ * seed doesn't work, the next one groups the keys differently, and the number
+ * of buckets is increased every few seeds so the buckets get smaller. Returns
+ * false without modifying the table if two keys have the same hash value,
+ * since they can never be given different nodes.
+ */
+static bool Table_BuildPerfectHash(lua_State* L, Table* table, int numKeys)
+{
+
+    TableNode* nodes = Table_AllocateNodes(L, numKeys);
+
+    // Scratch space for the keys sorted by bucket.
+    size_t scratchSize = numKeys * (sizeof(TableNode*) + sizeof(unsigned int) * 2);
+    void* scratch = Allocate(L, scratchSize);
+
+    if (nodes == NULL || scratch == NULL)
+    {
+        if (nodes != NULL) Free(L, nodes, numKeys * sizeof(TableNode));
+        if (scratch != NULL) Free(L, scratch, scratchSize);
+        return false;
+    }
+
+    TableNode**   key      = static_cast<TableNode**>(scratch);
+    unsigned int* hash     = reinterpret_cast<unsigned int*>(key + numKeys);
+    unsigned int* position = hash + numKeys;
+
+    int           numBuckets   = 0;
+    unsigned int* displacement = NULL;
+    int*          bucketStart  = NULL;
+    int*          bucket       = NULL;
+
+    bool found    = false;
+    bool possible = true;
+    unsigned int seed = 0;
+
+    for (int attempt = 0; attempt < _maxPerfectHashSeeds && !found && possible; ++attempt)
+    {
+
+        if (attempt % _perfectHashSeedsPerSize == 0 && numBuckets < numKeys * _maxPerfectHashBuckets)
+        {
+            if (numBuckets != 0)
+            {
+                Free(L, displacement, numBuckets * sizeof(unsigned int));
+                Free(L, bucketStart, (numBuckets * 2 + 1) * sizeof(int));
+            }
+            if (numBuckets == 0)
+            {
+                numBuckets = (numKeys + 1) / 2;
+            }
+            else
+            {
+                numBuckets = numBuckets * 2 < numKeys * _maxPerfectHashBuckets ?
+                    numBuckets * 2 : numKeys * _maxPerfectHashBuckets;
+            }
+            displacement = static_cast<unsigned int*>( Allocate(L, numBuckets * sizeof(unsigned int)) );
+            bucketStart  = static_cast<int*>( Allocate(L, (numBuckets * 2 + 1) * sizeof(int)) );
+            if (displacement == NULL || bucketStart == NULL)
+            {
+                if (displacement != NULL) Free(L, displacement, numBuckets * sizeof(unsigned int));
+                if (bucketStart != NULL) Free(L, bucketStart, (numBuckets * 2 + 1) * sizeof(int));
+                displacement = NULL;
+                bucketStart  = NULL;
+                numBuckets   = 0;
+                break;
+            }
+            bucket = bucketStart + numBuckets + 1;
+        }
+
+        seed = attempt * 0x9E3779B9;
+
+        // Sort the keys by bucket.
+
+        memset(bucketStart, 0, (numBuckets + 1) * sizeof(int));
+        for (int i = 0; i < table->numNodes; ++i)
+        {
+            if (!Table_NodeIsEmpty(&table->nodes[i]))
+            {
+                unsigned int h = Hash(&table->nodes[i].key);
+                ++bucketStart[ Table_GetPerfectBucket(h, seed, numBuckets) + 1 ];
+            }
+        }
+        for (int i = 0; i < numBuckets; ++i)
+        {
+            bucketStart[i + 1] += bucketStart[i];
+            bucket[i] = bucketStart[i];
+        }
+        for (int i = 0; i < table->numNodes; ++i)
+        {
+            TableNode* node = &table->nodes[i];
+            if (!Table_NodeIsEmpty(node))
+            {
+                unsigned int h = Hash(&node->key);
+                int index = bucket[ Table_GetPerfectBucket(h, seed, numBuckets) ]++;
+                key[index]      = node;
+                hash[index]     = h;
+                position[index] = Table_GetPerfectPosition(h, seed, numKeys);
+            }
+        }
+
+        Table_BucketLarger larger = { bucketStart };
+        for (int i = 0; i < numBuckets; ++i)
+        {
+            bucket[i] = i;
+        }
+        Sort(bucket, bucket + numBuckets, larger);
+
+        for (int i = 0; i < numKeys; ++i)
+        {
+            nodes[i].dead = true;
+        }
+
+        found = true;
+        int freeNode = 0;
+
+        for (int i = 0; i < numBuckets && found; ++i)
+        {
+
+            int b     = bucket[i];
+            int start = bucketStart[b];
+            int end   = bucketStart[b + 1];
+
+            unsigned int d = 0;
+
+            if (end - start == 1)
+            {
+                // A single key can go in any unused node.
+                while (!nodes[freeNode].dead)
+                {
+                    ++freeNode;
+                }
+                unsigned int node = static_cast<unsigned int>(freeNode);
+                d = node - position[start] + (node < position[start] ? numKeys : 0);
+            }
+            else if (end - start > 1)
+            {
+
+                // Keys in the same position will always collide, so another
+                // seed is needed. Keys with the same hash are in the same
+                // position for every seed.
+                for (int j = start; j < end && found; ++j)
+                {
+                    for (int k = j + 1; k < end; ++k)
+                    {
+                        if (position[j] == position[k])
+                        {
+                            possible = hash[j] != hash[k];
+                            found = false;
+                            break;
+                        }
+                    }
+                }
+
+                for (d = 0; d < static_cast<unsigned int>(numKeys) && found; ++d)
+                {
+                    int j = start;
+                    for (; j < end; ++j)
+                    {
+                        unsigned int index = position[j] + d;
+                        if (index >= static_cast<unsigned int>(numKeys))
+                        {
+                            index -= numKeys;
+                        }
+                        if (!nodes[index].dead)
+                        {
+                            break;
+                        }
+                    }
+                    if (j == end)
+                    {
+                        break;
+                    }
+                }
+                if (d == static_cast<unsigned int>(numKeys))
+                {
+                    found = false;
+                }
+
+            }
+
+            if (found)
+            {
+                displacement[b] = d;
+                for (int j = start; j < end; ++j)
+                {
+                    unsigned int index = position[j] + d;
+                    if (index >= static_cast<unsigned int>(numKeys))
+                    {
+                        index -= numKeys;
+                    }
+                    nodes[index] = *key[j];
+                    nodes[index].next = NULL;
+                }
+            }
+
+        }
+
+    }
+
+    Free(L, scratch, scratchSize);
+    if (bucketStart != NULL)
+    {
+        Free(L, bucketStart, (numBuckets * 2 + 1) * sizeof(int));
+    }
+
+    if (!found)
+    {
+        Free(L, nodes, numKeys * sizeof(TableNode));
+        if (displacement != NULL)
+        {
+            Free(L, displacement, numBuckets * sizeof(unsigned int));
+        }
+        return false;
+    }
+
+    // The references held by the live nodes were transferred to the new
+    // nodes, but the keys of the dead nodes need to be released.
+    Gc* gc = &L->gc;
+    for (int i = 0; i < table->numNodes; ++i)
+    {
+        if (Table_NodeIsEmpty(&table->nodes[i]))
+        {
+            Gc_DecrementReference(L, gc, &table->nodes[i].key);
+        }
+    }
+    Free(L, table->nodes, table->numNodes * sizeof(TableNode));
+
+    table->nodes        = nodes;
+    table->numNodes     = numKeys;
+    table->lastFreeNode = NULL;
+    table->displacement = displacement;
+    table->numBuckets   = numBuckets;
+    table->perfectSeed  = seed;
+
+    return true;
+
+}
+
+void Table_Freeze(lua_State* L, Table* table)
+{
+
+    if (table->frozen)
+    {
+        return;
+    }
+
+    Table_FinishResize(L, table);
+
+    // The table can't grow, so the extra space can be released.
+    if (table->maxElements > table->size)
+    {
+        Table_AllocateArray(L, table, table->size);
+        table->numElements = table->size;
+    }
+    if (table->shape != NULL && table->maxSlots > table->shape->numKeys)
+    {
+        int numKeys = table->shape->numKeys;
+        table->slot = Table_ResizeValues(L, table, table->slot, table->maxSlots, numKeys);
+        table->maxSlots = numKeys;
+    }
+
+    int numKeys = 0;
+    for (int i = 0; i < table->numNodes; ++i)
+    {
+        if (!Table_NodeIsEmpty(&table->nodes[i]))
+        {
+            ++numKeys;
+        }
+    }
+
+    if (numKeys == 0)
+    {
+        if (table->numNodes > 0)
+        {
+            Table_ResizeHash(L, table, 0, true);
+        }
+    }
+    else if (!Table_BuildPerfectHash(L, table, numKeys))
+    {
+        // Fall back to an ordinary hash without any unused nodes.
+        Table_ResizeHash(L, table, RoundUp2(numKeys), true);
+    }
+
+    table->frozen = true;
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, table) );
+#endif
+
+}
+
+void Table_ClearWeak(lua_State* L, Table* table)
+{
+
+    Gc* gc = &L->gc;
+
+    if (table->weakValues)
+    {
+        // Clear the array part.
+        if (!table->numericArray)
+        {
+            for (int i = table->size - 1; i >= 0; --i)
+            {
+                if (Gc_GetIsClearable(&table->element[i]))
+                {
+                    Table_Remove(L, table, i + 1);
+                }
+            }
+        }
+        // Clear the values stored using the shape. Shape keys are strings, so
+        // they are never cleared.
+        const Shape* shape = table->shape;
+        if (shape != NULL)
+        {
+            for (int i = 0; i < shape->numKeys; ++i)
+            {
+                if (Gc_GetIsClearable(&table->slot[i]))
+                {
+                    Value key;
+                    SetValue(&key, shape->key[i]);
+                    Table_RemoveHash(L, table, &key);
+                }
+            }
+        }
+    }
+
+    // Clear the hash part, including any nodes from an incremental resize.
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        TableNode* node    = (pass == 0) ? table->nodes : table->oldNodes;
+        TableNode* endNode = node + ((pass == 0) ? table->numNodes : table->numOldNodes);
+        for (; node < endNode; ++node)
+        {
+            if (!node->dead)
+            {
+                if ((table->weakKeys && Gc_GetIsClearable(&node->key)) ||
+                    (table->weakValues && Gc_GetIsClearable(&node->value)))
+                {
+                    Value key = node->key;
+                    Table_RemoveHash(L, table, &key);
+                }
+            }
+            // Dead nodes keep their keys for iteration, but if the key is
+            // about to be collected we can't keep a pointer to it.
+            if (node->dead && Gc_GetIsClearable(&node->key))
+            {
+                Gc_DecrementReference(L, gc, &node->key);
+                SetNil(&node->key);
+            }
+        }
+    }
+
+}
+
+void Table_Shrink(lua_State* L, Table* table)
+{
+
+    // Frozen tables are already as small as possible, and tables which are
+    // being resized incrementally are growing.
+    if (table->frozen || table->oldNodes != NULL)
+    {
+        return;
+    }
+
+    // Elements past the size are nil, so the array only needs to cover the size.
+    if (table->maxElements >= _minShrinkSize)
+    {
+        int maxElements = 0;
+        if (table->size > 0)
+        {
+            maxElements = RoundUp2(table->size);
+            if (maxElements < _minArraySize)
+            {
+                maxElements = _minArraySize;
+            }
+        }
+        if (maxElements * _shrinkFactor <= table->maxElements)
+        {
+            if (table->numElements > maxElements)
+            {
+                table->numElements = maxElements;
+            }
+            Table_AllocateArray(L, table, maxElements);
+        }
+        else
+        {
+            // Moving the array is optional, so it's kept where it is if there
+            // isn't enough memory.
+            Value* element = static_cast<Value*>( Allocate(L, table->maxElements * sizeof(Value)) );
+            if (element != NULL)
+            {
+                memcpy(element, table->element, table->numElements * sizeof(Value));
+                Free(L, table->element, table->maxElements * sizeof(Value));
+                table->element = element;
+            }
+        }
+    }
+
+    if (table->numNodes >= _minShrinkSize)
+    {
+        int numKeys = 0;
+        for (int i = 0; i < table->numNodes; ++i)
+        {
+            if (!Table_NodeIsEmpty(&table->nodes[i]))
+            {
+                ++numKeys;
+            }
+        }
+        int numNodes = (numKeys > 0) ? RoundUp2(numKeys) : 0;
+        if (numNodes * _shrinkFactor <= table->numNodes)
+        {
+            Table_ResizeHash(L, table, numNodes, true);
+        }
+        else
+        {
+            // Rebuilding the hash also releases the keys of the dead nodes.
+            Table_ResizeHash(L, table, table->numNodes, true);
+        }
+    }
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(L, table) );
+#endif
+
+}
+
+static void Table_CountChains(lua_State* L, const Table* table, const TableNode* nodes, int numNodes, lua_HashStats* stats)
+{
+
+    if (numNodes == 0)
+    {
+        return;
+    }
+
+    int* length = static_cast<int*>( Allocate(L, numNodes * sizeof(int)) );
+    if (length == NULL)
+    {
+        State_Error(L);
+    }
+    memset(length, 0, numNodes * sizeof(int));
+
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if (!Table_NodeIsEmpty(&nodes[i]))
+        {
+            const Value* key = &nodes[i].key;
+            if (nodes == table->nodes)
+            {
+                ++length[ Table_GetMainIndex(table, key) ];
+            }
+            else
+            {
+                ++length[ Hash(key) & (numNodes - 1) ];
+            }
+            ++stats->numKeys;
+        }
+    }
+
+    stats->numNodes += numNodes;
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if (length[i] > 0)
+        {
+            ++stats->numChains;
+        }
+        if (length[i] > stats->maxChainLength)
+        {
+            stats->maxChainLength = length[i];
+        }
+    }
+
+    Free(L, length, numNodes * sizeof(int));
+
+}
+
+void Table_GetHashStats(lua_State* L, Table* table, lua_HashStats* stats)
+{
+    stats->numKeys          = 0;
+    stats->numNodes         = 0;
+    stats->numChains        = 0;
+    stats->maxChainLength   = 0;
+    Table_CountChains(L, table, table->nodes, table->numNodes, stats);
+    Table_CountChains(L, table, table->oldNodes, table->numOldNodes, stats);
+}
+
+int Table_GetSize(lua_State* L, Table* table)
+{
+
+    if (table->numElements > 0)
+    {
+        // If we have an array part, just use the size of that.
+        return table->size;
+    }
+
+    // Find min, max such that min is non-nil and max is nil. These will
+    // bracket our length.
+    
+    int min = 0;
+    int max = 1;
+
+    while (1)
+    {
+        // Check if max is non-nil. If it is, then move min up to max and
+        // advance max.
+        const Value* value = Table_GetTable(L, table, max);
+        if (Value_GetIsNil(value))
+        {
+            break;
+        }
+        else
+        {
+            min = max;
+            max *= 2;
+        }
+    }
+
     // Binary search between min and max to find the actual length.
     while (max > min + 1)
     {
@@ -1359,6 +3197,17 @@ static int Table_GetIterationIndex(lua_State* L, Table* table, const Value* key)
         return index - 1;
     }
 
+    // Check if we're in the shape.
+    if (table->shape != NULL)
+    {
+        int slot = Table_GetSlot(table, key);
+        if (slot == -1)
+        {
+            State_Error(L, "invalid key to next");
+        }
+        return slot + table->numElements;
+    }
+
     // Check if we're in the hash part.
     TableNode* node = Table_GetNodeIncludeDead(table, key);
     if (node == NULL)
@@ -1367,6 +3216,13 @@ static int Table_GetIterationIndex(lua_State* L, Table* table, const Value* key)
         // earlier call to Table_Next.
         State_Error(L, "invalid key to next");
     }
+
+    // Nodes that haven't been migrated in an incremental resize are iterated
+    // after the current nodes.
+    if (!Table_GetIsValidNode(table, node))
+    {
+        return static_cast<int>(node - table->oldNodes) + table->numNodes + table->numElements;
+    }
     return static_cast<int>(node - table->nodes) + table->numElements;
 
 }
@@ -1390,9 +3246,27 @@ const Value* Table_Next(lua_State* L, Table* table, Value* key)
         ++index;
     }
     
+    index -= table->numElements;
+
+    // Try iterating over the keys in the shape.
+    const Shape* shape = table->shape;
+    if (shape != NULL)
+    {
+        while (index < shape->numKeys)
+        {
+            Value* value = table->slot + index;
+            if (!Value_GetIsNil(value))
+            {
+                SetValue(key, shape->key[index]);
+                return value;
+            }
+            ++index;
+        }
+        return NULL;
+    }
+
     // Try iterating in the hash part.
     int numNodes = table->numNodes;
-    index -= table->numElements;
     while (index < numNodes && table->nodes[index].dead)
     {
         ++index;
@@ -1404,6 +3278,20 @@ const Value* Table_Next(lua_State* L, Table* table, Value* key)
         return &node->value;
     }
 
+    // Try iterating over the nodes left over from an incremental resize.
+    index -= numNodes;
+    int numOldNodes = table->numOldNodes;
+    while (index < numOldNodes && table->oldNodes[index].dead)
+    {
+        ++index;
+    }
+    if (index < numOldNodes)
+    {
+        TableNode* node = &table->oldNodes[index];
+        *key = node->key;
+        return &node->value;
+    }
+
     // Finished iterating.
     return NULL;
 
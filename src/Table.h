@@ -29,21 +29,91 @@ struct TableNode
 };
 
 /**
- * A table is implemented as a union of an array and a hash table.
+ * Number of values which can be stored inside the table structure itself,
+ * rather than in a separate allocation.
+ */
+const int Table_maxInlineValues = 4;
+
+/**
+ * Maximum number of tables recorded in an index cache entry. Each level of
+ * inheritance uses two tables: the metatable and its __index table.
+ */
+const int Table_maxIndexTables = 8;
+
+/**
+ * Records the result of looking up a string key through the chain of __index
+ * tables starting from a metatable, along with the versions of the tables
+ * that were visited. The result remains valid as long as none of the visited
+ * tables have changed.
+ */
+struct TableIndexCache
+{
+    const String*   key;
+    int             numTables;
+    bool            found;          // The key was found in the last table.
+    Table*          table[Table_maxIndexTables];
+    unsigned int    version[Table_maxIndexTables];
+};
+
+/**
+ * A table is implemented as a union of an array and a hash table. Tables which
+ * only have string keys outside of the array part start out with a shape
+ * instead of a hash table; the values are stored in the slot array in the
+ * order given by the shape. The hash part is materialized when the table
+ * stops looking like a record. While the array part only holds numbers it
+ * contains no references, so the garbage collector can skip over it.
+ *
+ * Small tables keep either their array elements or their shape slots in the
+ * inline values, so that they only need a single allocation. They move to a
+ * separate buffer when they grow beyond that.
+ *
+ * A frozen table can't be modified. Its hash part is rebuilt with a minimal
+ * perfect hash: each key is found in the node given by adding the
+ * displacement for the key's bucket to its hashed position, so a look up
+ * touches exactly one node.
+ *
+ * A table whose metatable has a __mode field holds weak keys and/or values.
+ * Only the mark and sweep collector treats these references as weak. They're
+ * still counted like any other reference, so an object which is only weakly
+ * referenced is never freed by the reference counting collector. It's freed
+ * (and removed from the weak tables) by the next mark and sweep instead.
+ *
+ * Metatables with an __index table keep a small cache of where keys were
+ * found by following the chain of __index tables. The cache is validated
+ * using the version of each table, which changes whenever a key is added or
+ * removed, a tag method is changed or the metatable is changed.
  */
 struct Table : public Gc_Object
 {
     int             numNodes;
     TableNode*      nodes;          // Hash nodes.
+    TableNode*      oldNodes;       // Nodes not yet moved by an incremental resize.
+    int             numOldNodes;
+    int             migrateIndex;   // Next node in oldNodes to move.
+    unsigned int*   displacement;   // Bucket displacements for a perfect hash, or NULL.
+    int             numBuckets;
+    unsigned int    perfectSeed;    // Seed used to position keys in the perfect hash.
+    Shape*          shape;          // Shape of the keys, or NULL if using the hash.
+    Value*          slot;           // Values for the keys in the shape.
+    int             maxSlots;       // Number of slots allocated.
     Value*          element;        // Array elements.
     int             minHashKey;     // Mimumum integer key that appears in the hash.
     int             maxElements;    // Number of array slots allocated.
     int             numElements;    // Number of array slots initialized to valid values.
     int             numElementsSet; // Number of non-nil slots in the array.
     int             size;           // Size of the array (using Lua definition).
+    bool            numericArray;   // The array part only contains numbers (or nil).
     TableNode*      lastFreeNode;
     Table*          metatable;
     Value*          tagMethod;      // Provides quick access to tag methods.
+    unsigned int    noTagMethod;    // Bit for each tag method known to be absent.
+    unsigned int    version;        // Changed when the keys or metatable change.
+    TableIndexCache* indexCache;    // Lookups through the __index chain, or NULL.
+    bool            weakKeys;       // Weak mode when last traversed by the garbage collector.
+    bool            weakValues;
+    Table*          nextWeak;       // Next table in the garbage collector's weak list.
+    bool            frozen;         // The table can no longer be modified.
+    Value           inlineValue[Table_maxInlineValues]; // Storage for a small array or slots.
 };
 
 extern "C" Table* Table_Create(lua_State* L, int numArray, int numHash);
@@ -83,7 +153,85 @@ Value* Table_GetTable(lua_State* L, Table* table, const Value* key, int hint);
  * look ups.
  */
 inline int Table_GetLookupHint(Table* table, const Value* value)
-    { return (int)((TableNode*)((char*)value - offsetof(TableNode, value)) - table->nodes); }
+{
+    if (table->shape != NULL)
+    {
+        return (int)(value - table->slot);
+    }
+    return (int)((TableNode*)((char*)value - offsetof(TableNode, value)) - table->nodes);
+}
+
+/**
+ * Inserts the value at position key of the array part, moving up the elements
+ * from key to the end of the array. Returns false without modifying the table
+ * if the range isn't covered by the array part.
+ */
+bool Table_InsertArray(lua_State* L, Table* table, int key, Value* value);
+
+/**
+ * Removes the element at position key of the array part and stores it in dst,
+ * moving down the elements after it. Returns false without modifying the
+ * table if the range isn't covered by the array part.
+ */
+bool Table_RemoveArray(lua_State* L, Table* table, int key, Value* dst);
+
+/**
+ * Copies the elements f through e of the array part of src to positions t
+ * onward in dst, which may be the same table. Returns false without modifying
+ * either table if the elements aren't covered by the array parts, or if
+ * either table has a metatable.
+ */
+bool Table_MoveArray(lua_State* L, Table* src, int f, int e, int t, Table* dst);
+
+/**
+ * Stores the n values at positions key onward in the array part, growing it
+ * once to hold all of them. This is equivalent to storing the values one at
+ * a time without invoking tag methods. Returns false without modifying the
+ * table if the values don't continue on from the existing elements.
+ */
+bool Table_FillArray(lua_State* L, Table* table, int key, const Value* values, int n);
+
+/**
+ * Sorts elements 1 through n of the array part in ascending order using the
+ * default comparison. Returns false without modifying the table if the range
+ * isn't covered by the array part or the elements aren't all numbers or all
+ * strings.
+ */
+bool Table_SortArray(lua_State* L, Table* table, int n);
+
+/**
+ * Creates a copy of the table with the same metatable. If deep is true, tables
+ * stored as values are copied as well; a table which is referenced more than
+ * once is only copied once, so cycles are preserved in the copy. Keys and
+ * metatables are never copied.
+ */
+Table* Table_Clone(lua_State* L, Table* table, bool deep);
+
+/**
+ * Makes the table immutable. Any later attempt to modify the table raises an
+ * error. Since the keys won't change, the hash part is rebuilt so that every
+ * key can be found with a single probe, and any unused space is released.
+ */
+void Table_Freeze(lua_State* L, Table* table);
+
+/**
+ * Computes the length of the chains in the hash part of the table.
+ */
+void Table_GetHashStats(lua_State* L, Table* table, lua_HashStats* stats);
+
+/**
+ * Removes the entries from a weak table which refer to objects that weren't
+ * marked by the garbage collector.
+ */
+void Table_ClearWeak(lua_State* L, Table* table);
+
+/**
+ * Reduces the size of the array and hash parts if they are much larger than
+ * needed for the elements they hold, otherwise moves them to new allocations.
+ * Since the hash part is rebuilt, this must not be used on a table which is
+ * being iterated over.
+ */
+void Table_Shrink(lua_State* L, Table* table);
 
 /**
  * For a hash table the size is t[n] is non-nil and t[n+1] is nil.
@@ -102,4 +250,31 @@ const Value* Table_Next(lua_State* L, Table* table, Value* key);
  */
 Value* Table_GetTagMethod(lua_State* L, Table* table, TagMethod method);
 
+/**
+ * Looks up a string key through the chain of __index tables starting from
+ * the metatable, using the metatable's index cache. Returns false without
+ * looking up the key if the chain includes something other than tables.
+ */
+bool Table_GetIndexChain(lua_State* L, Table* metatable, const Value* key, Value* dst);
+
+/**
+ * Should be called when the keys or metatable of the table are changed
+ * outside of the table functions.
+ */
+inline void Table_UpdateVersion(Table* table)
+{
+    ++table->version;
+}
+
+/**
+ * Returns true if the table is known to not have a value for the tag method.
+ * This is cheaper than checking the result of Table_GetTagMethod, so it can
+ * be used to skip looking for the tag method entirely. A return value of
+ * false doesn't mean the tag method is present.
+ */
+inline bool Table_GetIsTagMethodAbsent(const Table* table, TagMethod method)
+{
+    return (table->noTagMethod & (1 << method)) != 0;
+}
+
 #endif
\ No newline at end of file
@@ -9,6 +9,9 @@
 #include "LuaTest.h"
 
 #include <memory.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
 
 TEST(StringUpper)
 {
@@ -76,4 +79,275 @@ TEST(StringLower)
     
     lua_close(L);
 
-}
\ No newline at end of file
+}
+TEST(StringSubSlice)
+{
+
+    // Long substrings reference the data of the original string, so check
+    // that they behave like any other string.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    const char* code =
+        "local s = string.rep('abcdefghij', 100) .. '12345'\n"
+        "a = s:sub(11, 60)\n"
+        "b = s:sub(21, 70)\n"
+        "c = s:sub(1, 50) .. 'x'\n"
+        "n = tonumber(s:sub(951, 1005)) == nil and tonumber(('  ' .. string.rep('0', 48) .. '42  '):sub(2, 53))\n"
+        "t = { [a] = 1 }\n"
+        "found = t[b]\n"
+        "less = s:sub(1, 50) < s:sub(2, 51)\n"
+        "words = { }\n"
+        "for w in s:gmatch('(' .. string.rep('%a', 45) .. ')') do words[#words + 1] = w end\n"
+        "s = nil\n"
+        "collectgarbage()\n"
+        "collectgarbage()";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "a");
+    CHECK_EQ( lua_tostring(L, -1), "abcdefghijabcdefghijabcdefghijabcdefghijabcdefghij" );
+    lua_getglobal(L, "c");
+    CHECK_EQ( lua_tostring(L, -1), "abcdefghijabcdefghijabcdefghijabcdefghijabcdefghijx" );
+    lua_getglobal(L, "b");
+    CHECK( lua_rawequal(L, -1, -3) );
+
+    lua_getglobal(L, "n");
+    CHECK_EQ( lua_tonumber(L, -1), 42 );
+
+    lua_getglobal(L, "found");
+    CHECK_EQ( lua_tonumber(L, -1), 1 );
+
+    lua_getglobal(L, "less");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "words");
+    CHECK_EQ( lua_objlen(L, -1), 22 );
+    lua_rawgeti(L, -1, 22);
+    CHECK_EQ( lua_tostring(L, -1), "fghijabcdefghijabcdefghijabcdefghijabcdefghij" );
+
+    lua_close(L);
+
+}
+
+TEST(StringPatternCache)
+{
+
+    // Compiled patterns are cached and skip ahead to where a match could
+    // start, so check that reusing patterns gives the same results.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    const char* code =
+        "local log = string.rep('time=12 id=7 ok\\n', 50) .. 'time=13 id=42 ok'\n"
+        "sum = 0\n"
+        "for i = 1, 3 do\n"
+        "  for id in log:gmatch('id=(%d+)') do sum = sum + tonumber(id) end\n"
+        "end\n"
+        "last = log:match('id=(%d+) ok$')\n"
+        "first = log:find('%d+')\n"
+        "replaced = ('a.b.c'):gsub('%.', '/')\n"
+        "anchored = ('abc'):find('^b')\n"
+        "for w in ('a^b'):gmatch('^b') do caret = w end\n"
+        "quantified = ('*abc'):find('^*abc') .. ('+x'):match('^+x') .. ('-a-a'):gsub('^-a', '')\n"
+        "for i = 1, 100 do\n"
+        "  if ('<' .. i .. '>'):match('<(' .. i .. ')>') ~= tostring(i) then cache = false end\n"
+        "end";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "sum");
+    CHECK_EQ( lua_tonumber(L, -1), 3 * (50 * 7 + 42) );
+    lua_getglobal(L, "last");
+    CHECK_EQ( lua_tostring(L, -1), "42" );
+    lua_getglobal(L, "first");
+    CHECK_EQ( lua_tonumber(L, -1), 6 );
+    lua_getglobal(L, "replaced");
+    CHECK_EQ( lua_tostring(L, -1), "a/b/c" );
+    lua_getglobal(L, "anchored");
+    CHECK( lua_isnil(L, -1) );
+    lua_getglobal(L, "caret");
+    CHECK_EQ( lua_tostring(L, -1), "^b" );
+    lua_getglobal(L, "quantified");
+    CHECK_EQ( lua_tostring(L, -1), "1+x-a" );
+    lua_getglobal(L, "cache");
+    CHECK( lua_isnil(L, -1) );
+
+    lua_close(L);
+
+}
+
+TEST(StringFormatCache)
+{
+
+    // Simple conversions are written without going through sprintf, so
+    // check that they give the same results it would.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    const char* code =
+        "mixed = string.format('%s=%d %x %X %.2f%%', 'k', -42, 255, 255, 0.3125)\n"
+        "padded = string.format('%5d|%-3s|%08.3f', 7, 'a', -1.5)\n"
+        "zero = string.format('%s|%.1f', 'a\\0b', -0.01)\n"
+        "for i = 1, 100 do\n"
+        "  if string.format('%d:' .. i, i) ~= i .. ':' .. i then cache = false end\n"
+        "end\n"
+        "invalid = pcall(string.format, '%d %y', 1)";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "mixed");
+    CHECK_EQ( lua_tostring(L, -1), "k=-42 ff FF 0.31%" );
+    lua_getglobal(L, "padded");
+    CHECK_EQ( lua_tostring(L, -1), "    7|a  |-001.500" );
+    lua_getglobal(L, "zero");
+    CHECK_EQ( lua_tostring(L, -1), "a|-0.0" );
+    lua_getglobal(L, "cache");
+    CHECK( lua_isnil(L, -1) );
+    lua_getglobal(L, "invalid");
+    CHECK( lua_isboolean(L, -1) && !lua_toboolean(L, -1) );
+    lua_settop(L, 0);
+
+    const double values[] = { 0.0, 0.5, 1.005, 2.675, -3.14159, 1234.5678, 1e-7, 123456789.987654, 1e20 };
+    char format[8];
+    char expected[64];
+
+    lua_getglobal(L, "string");
+    lua_getfield(L, -1, "format");
+    for (int precision = 0; precision < 10; ++precision)
+    {
+        sprintf(format, "%%.%df", precision);
+        for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i)
+        {
+            sprintf(expected, format, values[i]);
+            lua_pushvalue(L, -1);
+            lua_pushstring(L, format);
+            lua_pushnumber(L, values[i]);
+            lua_call(L, 2, 1);
+            CHECK_EQ( lua_tostring(L, -1), expected );
+            lua_pop(L, 1);
+        }
+    }
+
+    lua_close(L);
+
+}
+
+TEST(StringLibLargeInput)
+{
+
+    // Compares the string library functions against the simple byte at a
+    // time loops they used to be implemented with on a large input, which
+    // exercises the vectorized paths and their handling of the tail.
+
+    lua_State* L = luaL_newstate();
+    luaopen_string(L);
+
+    const size_t length = 1024 * 1024 + 7;
+
+    char* data   = new char[length];
+    char* result = new char[length * 4];
+
+    unsigned int seed = 1;
+    for (size_t i = 0; i < length; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        data[i] = static_cast<char>(' ' + (seed >> 16) % 95);
+        if (i % 5000 == 0)
+        {
+            data[i] = static_cast<char>(0xE9);
+        }
+    }
+    const char* needle = "~needle~";
+    memcpy(data + length - 20, needle, strlen(needle));
+
+    lua_getglobal(L, "string");
+    int string = lua_gettop(L);
+
+    size_t resultLength;
+
+    // string.lower
+    for (size_t j = 0; j < length; ++j)
+    {
+        result[j] = static_cast<char>(tolower(static_cast<unsigned char>(data[j])));
+    }
+    lua_getfield(L, string, "lower");
+    lua_pushlstring(L, data, length);
+    lua_call(L, 1, 1);
+    const char* s = lua_tolstring(L, -1, &resultLength);
+    CHECK( resultLength == length && memcmp(s, result, length) == 0 );
+    lua_pop(L, 1);
+
+    // string.upper
+    for (size_t j = 0; j < length; ++j)
+    {
+        result[j] = static_cast<char>(toupper(static_cast<unsigned char>(data[j])));
+    }
+    lua_getfield(L, string, "upper");
+    lua_pushlstring(L, data, length);
+    lua_call(L, 1, 1);
+    s = lua_tolstring(L, -1, &resultLength);
+    CHECK( resultLength == length && memcmp(s, result, length) == 0 );
+    lua_pop(L, 1);
+
+    // string.reverse
+    for (size_t j = 0; j < length; ++j)
+    {
+        result[j] = data[length - j - 1];
+    }
+    lua_getfield(L, string, "reverse");
+    lua_pushlstring(L, data, length);
+    lua_call(L, 1, 1);
+    s = lua_tolstring(L, -1, &resultLength);
+    CHECK( resultLength == length && memcmp(s, result, length) == 0 );
+    lua_pop(L, 1);
+
+    // string.rep
+    const size_t repLength = 13;
+    const int repCount = static_cast<int>(length * 4 / repLength);
+    for (int j = 0; j < repCount; ++j)
+    {
+        memcpy(result + j * repLength, data, repLength);
+    }
+    lua_getfield(L, string, "rep");
+    lua_pushlstring(L, data, repLength);
+    lua_pushinteger(L, repCount);
+    lua_call(L, 2, 1);
+    s = lua_tolstring(L, -1, &resultLength);
+    CHECK( resultLength == repLength * repCount && memcmp(s, result, resultLength) == 0 );
+    lua_pop(L, 1);
+
+    // string.find with a plain search
+    size_t needleLength = strlen(needle);
+    const char* found = NULL;
+    for (size_t j = 0; j + needleLength <= length && found == NULL; ++j)
+    {
+        if (data[j] == needle[0] && memcmp(data + j + 1, needle + 1, needleLength - 1) == 0)
+        {
+            found = data + j;
+        }
+    }
+    lua_getfield(L, string, "find");
+    lua_pushlstring(L, data, length);
+    lua_pushstring(L, needle);
+    lua_pushinteger(L, 1);
+    lua_pushboolean(L, 1);
+    lua_call(L, 4, 1);
+    CHECK( found != NULL && lua_tointeger(L, -1) == found - data + 1 );
+    lua_pop(L, 1);
+
+    delete [] data;
+    delete [] result;
+
+    lua_close(L);
+
+}
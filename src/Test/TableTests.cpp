@@ -217,6 +217,45 @@ TEST_FIXTURE(ArrayLarge, LuaFixture)
 
 }
 
+TEST_FIXTURE(ArrayListInitialize, LuaFixture)
+{
+
+    // Array items in a constructor are stored in bulk; check the cases where
+    // the items overwrite existing keys or include nils.
+
+    const char* code =
+        "local function f(...) return ... end\n"
+        "local x = 'x'\n"
+        "a = { [1] = 'one', [3] = 'three', x, x, f(x, nil, x, nil) }\n"
+        "b = { x, nil, x, [10] = x, f() }";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "a");
+    CHECK( lua_istable(L, -1) );
+    const char* a[] = { "x", "x", "x", NULL, "x", NULL };
+    for (int i = 0; i < 6; ++i)
+    {
+        lua_rawgeti(L, -1, i + 1);
+        CHECK( a[i] == NULL ? lua_isnil(L, -1) : lua_isstring(L, -1) );
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    lua_getglobal(L, "b");
+    CHECK( lua_istable(L, -1) );
+    lua_rawgeti(L, -1, 2);
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+    lua_rawgeti(L, -1, 3);
+    CHECK_EQ( lua_tostring(L, -1), "x" );
+    lua_pop(L, 1);
+    lua_rawgeti(L, -1, 10);
+    CHECK_EQ( lua_tostring(L, -1), "x" );
+    lua_pop(L, 1);
+
+}
+
 TEST_FIXTURE(LocalTable, LuaFixture)
 {
 
@@ -243,7 +282,381 @@ TEST_FIXTURE(LocalTable, LuaFixture)
 
 }
 
-/*
+TEST_FIXTURE(RecordFields, LuaFixture)
+{
+
+    // Tables built with the same keys share a shape; check that removing
+    // keys, iterating and growing beyond a record all behave normally.
+
+    const char* code =
+        "local a = { }\n"
+        "a.x = 1; a.y = 2; a.z = 3\n"
+        "local b = { }\n"
+        "b.x = 4; b.y = 5; b.z = 6\n"
+        "b.y = nil\n"
+        "local n = 0\n"
+        "for k, v in pairs(b) do n = n + v end\n"
+        "b.y = 7\n"
+        "for i = 1, 20 do a['k' .. i] = i end\n"
+        "a[true] = 8\n"
+        "x = a.x + a.z + a.k20 + a[true]\n"
+        "y = b.x + b.y + b.z\n"
+        "count = n";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "x");
+    CHECK( lua_tonumber(L, -1) == 32 );
+
+    lua_getglobal(L, "y");
+    CHECK( lua_tonumber(L, -1) == 17 );
+
+    lua_getglobal(L, "count");
+    CHECK( lua_tonumber(L, -1) == 10 );
+
+}
+
+TEST_FIXTURE(TableLibArray, LuaFixture)
+{
+
+    // Tests the table library functions which operate on the array part.
+
+    luaopen_table(L);
+
+    const char* code =
+        "local t = { 1, 2, 3, 4, 5 }\n"
+        "table.insert(t, 1, 0)\n"
+        "table.insert(t, 4, 'x')\n"
+        "local r = table.remove(t, 1) .. table.remove(t, 3)\n"
+        "local a, b = unpack(t, 2)\n"
+        "s = table.concat(t, ',') .. r .. a .. b\n"
+        "n = #t";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "s");
+    CHECK_EQ( lua_tostring(L, -1), "1,2,3,4,50x23" );
+
+    lua_getglobal(L, "n");
+    CHECK( lua_tonumber(L, -1) == 5 );
+
+}
+
+TEST_FIXTURE(TableLibSort, LuaFixture)
+{
+
+    luaopen_table(L);
+
+    const char* code =
+        "local n = { }\n"
+        "for i = 1, 200 do n[i] = (i * 37) % 101 end\n"
+        "table.sort(n)\n"
+        "sorted = true\n"
+        "for i = 2, #n do if n[i - 1] > n[i] then sorted = false end end\n"
+        "local t = { 'pear', 'apple', 'fig', 'banana', 'apple' }\n"
+        "table.sort(t)\n"
+        "local m = { 3, 'x', 1 }\n"
+        "ok = not pcall(table.sort, m)\n"
+        "table.sort(n, function(a, b) return a > b end)\n"
+        "s = table.concat(t, ',') .. n[1]";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "sorted");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "ok");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "s");
+    CHECK_EQ( lua_tostring(L, -1), "apple,apple,banana,fig,pear100" );
+
+}
+
+TEST_FIXTURE(TableLibSortLarge, LuaFixture)
+{
+
+    // Large arrays are sorted on multiple threads when the library is built
+    // with ROCKET_PARALLEL_SORT.
+
+    luaopen_table(L);
+
+    const char* code =
+        "local n = { }\n"
+        "for i = 1, 150000 do n[i] = (i * 7919) % 150001 end\n"
+        "table.sort(n)\n"
+        "sorted = #n == 150000\n"
+        "for i = 1, #n do if n[i] ~= i then sorted = false end end\n"
+        "local s = { }\n"
+        "for i = 1, 100002 do s[i] = 'k' .. (i * 7919) % 100003 end\n"
+        "table.sort(s)\n"
+        "if #s ~= 100002 then sorted = false end\n"
+        "for i = 2, #s do if s[i - 1] >= s[i] then sorted = false end end";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "sorted");
+    CHECK( lua_toboolean(L, -1) );
+
+}
+
+TEST_FIXTURE(TableLibMove, LuaFixture)
+{
+
+    luaopen_table(L);
+
+    const char* code =
+        "local a = { 1, 2, 3, 4, 5 }\n"
+        "table.move(a, 1, 3, 3)\n"
+        "local b = table.move(a, 2, 5, 1, { })\n"
+        "local c = table.move({ 'x', 'y' }, 1, 2, 3, { 'a', 'b' })\n"
+        "local m = setmetatable({ }, { __newindex = function(t, k, v) rawset(t, k, v * 10) end })\n"
+        "table.move({ 1, 2 }, 1, 2, 1, m)\n"
+        "local h = { 1, 2 }\n"
+        "for k = 8, 11 do h[k] = k end\n"
+        "table.move({ 'a', 'b', 'c', 'd', 'e' }, 1, 5, 3, h)\n"
+        "s = table.concat(a, ',') .. ';' .. table.concat(b, ',') .. ';' ..\n"
+        "    table.concat(c, ',') .. ';' .. table.concat(m, ',') .. ';' ..\n"
+        "    table.concat(h, ',', 1, 11)";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "s");
+    CHECK_EQ( lua_tostring(L, -1), "1,2,1,2,3;2,1,2,3;a,b,x,y;10,20;1,2,a,b,c,d,e,8,9,10,11" );
+
+}
+
+TEST_FIXTURE(TableLibClone, LuaFixture)
+{
+
+    luaopen_table(L);
+
+    const char* code =
+        "local mt = { }\n"
+        "local shared = { 1, 2 }\n"
+        "local t = setmetatable({ 10, 20, x = 'a', y = shared, z = shared }, mt)\n"
+        "t[100] = true\n"
+        "t.self = t\n"
+        "local s = table.clone(t)\n"
+        "local d = table.clone(t, true)\n"
+        "shallow = s ~= t and s.y == shared and s.self == t and s[2] == 20 and\n"
+        "          s[100] and getmetatable(s) == mt\n"
+        "deep = d.y ~= shared and d.y == d.z and d.y[2] == 2 and d.self == d and\n"
+        "       d.x == 'a' and d[100] and getmetatable(d) == mt\n"
+        "s.x = 'b'\n"
+        "d[1] = 0\n"
+        "unchanged = t.x == 'a' and t[1] == 10";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "shallow");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "deep");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "unchanged");
+    CHECK( lua_toboolean(L, -1) );
+
+}
+
+TEST_FIXTURE(TableLibFreeze, LuaFixture)
+{
+
+    luaopen_table(L);
+
+    const char* code =
+        "t = { 1, 2, 3 }\n"
+        "for i = 1, 1000 do t['k' .. i] = i end\n"
+        "t[2.5] = 'x'\n"
+        "t[true] = 'y'\n"
+        "t.k500 = nil\n"
+        "table.freeze(t)\n"
+        "frozen = table.isfrozen(t) and not table.isfrozen({ })\n"
+        "found = t.k1 == 1 and t.k1000 == 1000 and t.k500 == nil and\n"
+        "        t[2.5] == 'x' and t[true] == 'y' and t[2] == 2 and t.k1001 == nil\n"
+        "n = 0\n"
+        "for k, v in pairs(t) do n = n + 1 end\n"
+        "errors = not pcall(function() t.k1 = 5 end) and\n"
+        "         not pcall(function() t.k500 = 5 end) and\n"
+        "         not pcall(rawset, t, 4, 4) and\n"
+        "         not pcall(table.insert, t, 4) and\n"
+        "         not pcall(setmetatable, t, { })\n"
+        "c = table.clone(t)\n"
+        "c.k1 = 5\n"
+        "cloned = not table.isfrozen(c) and c.k1 == 5 and c.k1000 == 1000 and t.k1 == 1\n"
+        "p = { }\n"
+        "for i = 1, 1000 do p[i + 0.5] = i end\n"
+        "table.freeze(p)\n"
+        "for i = 1, 1000 do if p[i + 0.5] ~= i then found = false end end";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "frozen");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "found");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "n");
+    CHECK( lua_tointeger(L, -1) == 1004 );
+
+    lua_getglobal(L, "errors");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "cloned");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_HashStats stats;
+    lua_getglobal(L, "t");
+    lua_gettablehashstats(L, -1, &stats);
+    CHECK( stats.numKeys == 1001 );
+
+    // The keys in a frozen table are stored using a perfect hash. String
+    // hashes depend on the seed for the state, so number keys are used to
+    // make this deterministic (two keys with the same hash value can't be
+    // stored in a perfect hash).
+    lua_getglobal(L, "p");
+    lua_gettablehashstats(L, -1, &stats);
+    CHECK( stats.numKeys == 1000 );
+    CHECK( stats.numNodes == 1000 );
+    CHECK( stats.maxChainLength == 1 );
+
+}
+
+TEST_FIXTURE(LargeHash, LuaFixture)
+{
+
+    // Large hash tables are resized incrementally, so keys can be split
+    // between two sets of nodes for a while.
+
+    const char* code =
+        "local t = { }\n"
+        "for i = 1, 70000 do\n"
+        "  t['k' .. i] = i\n"
+        "  if i % 3 == 0 then t['k' .. (i - 1)] = nil end\n"
+        "end\n"
+        "count = 0\n"
+        "for k, v in pairs(t) do count = count + 1 end\n"
+        "found = 0\n"
+        "for i = 1, 70000 do if t['k' .. i] == i then found = found + 1 end end";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "count");
+    CHECK( lua_tonumber(L, -1) == 46667 );
+
+    lua_getglobal(L, "found");
+    CHECK( lua_tonumber(L, -1) == 46667 );
+
+}
+
+TEST_FIXTURE(HashStats, LuaFixture)
+{
+
+    // Long keys which only differ in a few characters should still be spread
+    // out across the hash.
+
+    const char* code =
+        "t = { }\n"
+        "for i = 1, 1000 do\n"
+        "  t['http://www.example.com/some/long/path/to/a/resource?id=' .. i .. '&x=1'] = i\n"
+        "end";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "t");
+
+    lua_HashStats stats;
+    lua_gettablehashstats(L, -1, &stats);
+    CHECK_EQ( stats.numKeys, 1000 );
+    CHECK( stats.numNodes >= 1000 );
+    CHECK( stats.maxChainLength < 10 );
+
+    // The keys are long strings, so they aren't stored in the string pool,
+    // but the short strings used to build them are.
+    lua_getstringhashstats(L, &stats);
+    CHECK( stats.maxChainLength < 10 );
+
+}
+
+TEST_FIXTURE(LongStringKeys, LuaFixture)
+{
+
+    // Long strings aren't interned, so the same key can be stored in more
+    // than one string object.
+
+    const char* code =
+        "local prefix = 'xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx'\n"
+        "t = { }\n"
+        "for i = 1, 100 do t[prefix .. i] = i end\n"
+        "count = 0\n"
+        "for i = 1, 100 do\n"
+        "  local k = prefix .. i\n"
+        "  if t[k] == i then count = count + 1 end\n"
+        "  t[k] = -i\n"
+        "end\n"
+        "size = 0\n"
+        "for k, v in pairs(t) do size = size + 1 end\n"
+        "equal = (prefix .. 1) == (prefix .. '1')\n"
+        "different = (prefix .. 1) ~= (prefix .. 2)\n"
+        "record = { }\n"
+        "record[prefix] = 1\n"
+        "record['xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx'] = 2";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "count");
+    CHECK_EQ( lua_tonumber(L, -1), 100 );
+
+    lua_getglobal(L, "size");
+    CHECK_EQ( lua_tonumber(L, -1), 100 );
+
+    lua_getglobal(L, "equal");
+    CHECK( lua_toboolean(L, -1) != 0 );
+
+    lua_getglobal(L, "different");
+    CHECK( lua_toboolean(L, -1) != 0 );
+
+    lua_getglobal(L, "record");
+    lua_pushstring(L, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+    lua_rawget(L, -2);
+    CHECK_EQ( lua_tonumber(L, -1), 2 );
+
+}
+
+TEST_FIXTURE(StringPoolResize, LuaFixture)
+{
+
+    // The string pool is resized incrementally, so strings created while the
+    // pool is growing (and strings collected during that time) can be split
+    // between two sets of nodes.
+
+    const char* code =
+        "local t = { }\n"
+        "for i = 1, 50000 do\n"
+        "  t[i] = 's' .. i\n"
+        "  local temp = 'temp' .. i\n"
+        "  if i % 1000 == 0 then collectgarbage() end\n"
+        "end\n"
+        "found = 0\n"
+        "for i = 1, 50000 do\n"
+        "  local k = 's' .. i\n"
+        "  if t[i] == k then found = found + 1 end\n"
+        "end";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "found");
+    CHECK( lua_tonumber(L, -1) == 50000 );
+
+    lua_HashStats stats;
+    lua_getstringhashstats(L, &stats);
+    CHECK( stats.numKeys >= 50000 );
+    CHECK( stats.maxChainLength < 10 );
+
+}
+
 TEST_FIXTURE(WeakKeys, LuaFixture)
 {
 
@@ -256,7 +669,7 @@ TEST_FIXTURE(WeakKeys, LuaFixture)
 
     lua_setmetatable(L, table);
 
-    void* p = lua_newuserdata(L, 10);
+    lua_newuserdata(L, 10);
     lua_pushstring(L, "value");
     lua_settable(L, table);
 
@@ -267,4 +680,161 @@ TEST_FIXTURE(WeakKeys, LuaFixture)
     CHECK( lua_next(L, table) == 0 );
 
 }
-*/
\ No newline at end of file
+
+TEST_FIXTURE(WeakValues, LuaFixture)
+{
+
+    const char* code =
+        "local t = setmetatable({ }, { __mode = 'v' })\n"
+        "local keep = { }\n"
+        "t[1] = { }\n"
+        "t[2] = keep\n"
+        "t.a = { }\n"
+        "t.b = 'string'\n"
+        "t[keep] = { }\n"
+        "collectgarbage()\n"
+        "n = 0\n"
+        "for k, v in pairs(t) do n = n + 1 end\n"
+        "r = t[2] == keep and t.b == 'string' and t[1] == nil and t.a == nil";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "n");
+    CHECK( lua_tonumber(L, -1) == 2 );
+
+    lua_getglobal(L, "r");
+    CHECK( lua_toboolean(L, -1) );
+
+}
+
+TEST_FIXTURE(WeakKeysEphemeron, LuaFixture)
+{
+
+    // A value in a weak keyed table which refers to its own key shouldn't
+    // keep the key alive.
+
+    lua_newtable(L);
+    int table = lua_gettop(L);
+
+    lua_newtable(L);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, table);
+
+    lua_newtable(L);
+    int key = lua_gettop(L);
+
+    lua_newtable(L);
+    lua_pushvalue(L, key);
+    lua_rawseti(L, -2, 1);
+    lua_rawset(L, table);
+
+    lua_newtable(L);
+    key = lua_gettop(L);
+    lua_pushvalue(L, key);
+    lua_newtable(L);
+    lua_rawset(L, table);
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    // Only the entry whose key is still on the stack should be left.
+    lua_pushnil(L);
+    CHECK( lua_next(L, table) != 0 );
+    CHECK( lua_rawequal(L, -2, key) );
+    lua_pop(L, 1);
+    CHECK( lua_next(L, table) == 0 );
+
+}
+
+TEST_FIXTURE(WeakModeSlice, LuaFixture)
+{
+
+    // The mode is read while the garbage collector is marking, so a mode which
+    // is a slice of a longer string is read without making a terminated copy.
+    // Only the characters in the slice should count.
+
+    lua_newtable(L);
+    int table = lua_gettop(L);
+
+    lua_newtable(L);
+    lua_pushstring(L, "____________________________________________vkkkk");
+    lua_pushsubstring(L, -1, 0, 45);
+    lua_setfield(L, -3, "__mode");
+    lua_pop(L, 1);
+    lua_setmetatable(L, table);
+
+    lua_newtable(L);
+    lua_rawseti(L, table, 1);
+
+    lua_newtable(L);
+    lua_pushboolean(L, 1);
+    lua_rawset(L, table);
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    // The value is weak but the key isn't.
+    lua_rawgeti(L, table, 1);
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+    lua_pushnil(L);
+    CHECK( lua_next(L, table) != 0 );
+    CHECK( lua_istable(L, -2) && lua_toboolean(L, -1) );
+    lua_pop(L, 1);
+    CHECK( lua_next(L, table) == 0 );
+
+}
+
+TEST_FIXTURE(TableShrink, LuaFixture)
+{
+
+    // Tables which have most of their elements removed should release their
+    // unused space when the garbage collector is asked to compact. Number keys
+    // are used so that no other objects are freed.
+
+    CHECK( DoString(L, "t = { } for i = 1, 10000 do t[i] = i; t[i + 0.5] = i end") );
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    int before = lua_gc(L, LUA_GCCOUNT, 0);
+
+    CHECK( DoString(L, "for i = 2, 10000 do t[i] = nil; t[i + 0.5] = nil end") );
+    lua_gc(L, LUA_GCCOMPACT, 0);
+    int after = lua_gc(L, LUA_GCCOUNT, 0);
+    CHECK( after < before / 2 );
+
+    lua_gc(L, LUA_GCCOMPACT, 0);
+
+    lua_getglobal(L, "t");
+    lua_rawgeti(L, -1, 1);
+    CHECK( lua_tonumber(L, -1) == 1 );
+    lua_pop(L, 1);
+    lua_pushnumber(L, 1.5);
+    lua_rawget(L, -2);
+    CHECK( lua_tonumber(L, -1) == 1 );
+    lua_pop(L, 2);
+
+}
+
+TEST_FIXTURE(TableNextCollect, LuaFixture)
+{
+
+    // An ordinary collection mustn't rebuild a table which is being iterated
+    // over, even when it isn't on the stack, since next is then given a key
+    // that has been removed.
+
+    const char* code =
+        "cfg = { items = { } }\n"
+        "for i = 1, 1000 do cfg.items['k' .. i] = i end\n"
+        "n = 0\n"
+        "local k = next(cfg.items)\n"
+        "while k do\n"
+        "  cfg.items[k] = nil\n"
+        "  n = n + 1\n"
+        "  if n % 100 == 0 then collectgarbage() end\n"
+        "  k = next(cfg.items, k)\n"
+        "end";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "n");
+    CHECK( lua_tonumber(L, -1) == 1000 );
+
+}
@@ -87,6 +87,90 @@ TEST_FIXTURE(ConcatTest, LuaFixture)
 
 }
 
+TEST_FIXTURE(BufferTest, LuaFixture)
+{
+
+    int top = lua_gettop(L);
+
+    // Build a string which is larger than the buffer array, so that it's
+    // moved into a buffer on the stack.
+    const int length = LUAL_BUFFERSIZE * 5 + 3;
+
+    luaL_Buffer b;
+    luaL_buffinit(L, &b);
+    for (int i = 0; i < length / 2; ++i)
+    {
+        luaL_addchar(&b, 'a' + i % 26);
+    }
+    lua_pushstring(L, "xyz");
+    luaL_addvalue(&b);
+    luaL_addlstring(&b, "abcdefghijklmnopqrstuvwxyz", length - length / 2 - 3);
+    luaL_pushresult(&b);
+
+    CHECK( lua_gettop(L) - top == 1 );
+
+    size_t resultLength;
+    const char* result = lua_tolstring(L, -1, &resultLength);
+    CHECK( resultLength == length );
+    CHECK( result[length] == 0 );
+    CHECK( result[0] == 'a' && result[length / 2 - 1] == 'a' + (length / 2 - 1) % 26 );
+    CHECK( memcmp(result + length / 2, "xyzabcdefghijklmnopqrstuvwxyz", 29) == 0 );
+
+    // Short results are interned like any other string.
+    luaL_buffinit(L, &b);
+    luaL_addstring(&b, "test");
+    luaL_pushresult(&b);
+    lua_pushstring(L, "test");
+    CHECK( lua_rawequal(L, -1, -2) );
+
+}
+
+static void ExternalStringTest_Free(void* ud, const char* data, size_t length)
+{
+    ++*static_cast<int*>(ud);
+}
+
+TEST_FIXTURE(ExternalStringTest, LuaFixture)
+{
+
+    static const char longData[]  = "This string is long enough that it won't be interned";
+    static const char shortData[] = "short";
+
+    int numFreed = 0;
+
+    lua_pushexternalstring(L, shortData, sizeof(shortData) - 1, ExternalStringTest_Free, &numFreed);
+    CHECK( numFreed == 1 );
+    CHECK( lua_tostring(L, -1) != shortData );
+    lua_setglobal(L, "s");
+
+    lua_pushexternalstring(L, longData, sizeof(longData) - 1, ExternalStringTest_Free, &numFreed);
+    CHECK( lua_tostring(L, -1) == longData );
+    CHECK( lua_objlen(L, -1) == sizeof(longData) - 1 );
+    lua_setglobal(L, "e");
+
+    const char* code =
+        "t = { [\"This string is long enough that it won't be interned\"] = 1 }\n"
+        "found = t[e]\n"
+        "equal = e == \"This string is long enough that it won't be interned\"\n"
+        "short = s == \"short\"\n"
+        "e = nil";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "found");
+    CHECK( lua_tonumber(L, -1) == 1 );
+    lua_getglobal(L, "equal");
+    CHECK( lua_toboolean(L, -1) );
+    lua_getglobal(L, "short");
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 3);
+
+    CHECK( numFreed == 1 );
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    CHECK( numFreed == 2 );
+
+}
+
 TEST_FIXTURE(InsertTest, LuaFixture)
 {
 
@@ -389,6 +473,46 @@ TEST_FIXTURE(GetTableMetamethod, LuaFixture)
 
 }
 
+TEST_FIXTURE(GetTableMetamethodChain, LuaFixture)
+{
+
+    // Look ups through chains of __index tables are cached, so check that
+    // changes anywhere along the chain are seen.
+
+    const char* code =
+        "local A = { } A.__index = A\n"
+        "local B = setmetatable({ }, A) B.__index = B\n"
+        "local C = setmetatable({ }, B) C.__index = C\n"
+        "local o = setmetatable({ }, C)\n"
+        "A.x = 'A'\n"
+        "r1 = o.x .. tostring(o.y)\n"
+        "B.x = 'B'\n"
+        "A.y = 'A'\n"
+        "r2 = o.x .. o.y\n"
+        "B.x = nil\n"
+        "setmetatable(B, { __index = { y = 'D' } })\n"
+        "r3 = tostring(o.x) .. o.y\n"
+        "setmetatable(B, A)\n"
+        "B.__index = function(t, k) return 'F' end\n"
+        "r4 = o.x .. o.y\n"
+        "B.__index = B\n"
+        "o.x = 'o'\n"
+        "r5 = o.x .. o.y";
+
+    CHECK( DoString(L, code) );
+
+    const char* expected[] = { "Anil", "BA", "nilD", "FF", "oA" };
+    for (int i = 0; i < 5; ++i)
+    {
+        char name[8];
+        sprintf(name, "r%d", i + 1);
+        lua_getglobal(L, name);
+        CHECK_EQ( lua_tostring(L, -1), expected[i] );
+        lua_pop(L, 1);
+    }
+
+}
+
 TEST_FIXTURE(UserDataGetTableMetamethod, LuaFixture)
 {
 
@@ -1091,6 +1215,32 @@ TEST_FIXTURE(NewIndexMetamethod, LuaFixture)
 
 }
 
+TEST_FIXTURE(NewIndexMetamethodAdded, LuaFixture)
+{
+
+    // Check that adding a tag method to a metatable which was previously
+    // used without it takes effect.
+
+    const char* code =
+        "local mt = { }\n"
+        "local t = setmetatable({ }, mt)\n"
+        "t.a = 1\n"
+        "t.a = 2\n"
+        "called = 0\n"
+        "mt.__newindex = function(t, k, v) called = called + 1 end\n"
+        "t.b = 3\n"
+        "t.a = 4\n"
+        "mt.__newindex = nil\n"
+        "t.c = 5\n"
+        "result = called == 1 and rawget(t, 'b') == nil and t.a == 4 and t.c == 5";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "result");
+    CHECK( lua_toboolean(L, -1) );
+
+}
+
 TEST_FIXTURE(GetUpValueCFunction, LuaFixture)
 {
 
@@ -1626,6 +1776,60 @@ TEST_FIXTURE(TableConstructorFunctionTrailingComma, LuaFixture)
 
 }
 
+TEST_FIXTURE(TableConstructorConstant, LuaFixture)
+{
+
+    // Constructors which only contain constants are created from a template,
+    // so make sure each evaluation produces a separate table.
+
+    const char* code =
+        "function f()\n"
+        "  return { 'one', 2, true, nil, 5, x = 'x', [10] = false }\n"
+        "end\n"
+        "a = f()\n"
+        "b = f()\n"
+        "a[1] = 'changed'\n"
+        "a.x = nil\n"
+        "same = a ~= b and b[1] == 'one' and b[2] == 2 and b[3] == true and\n"
+        "       b[4] == nil and b[5] == 5 and b.x == 'x' and b[10] == false";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "same");
+    CHECK( lua_toboolean(L, -1) );
+
+}
+
+TEST_FIXTURE(TableConstructorConstantLoop, LuaFixture)
+{
+
+    // The start of a loop which sets constant fields in a table created just
+    // before it mustn't be included in the template for the constructor.
+
+    const char* code =
+        "local t = {}\n"
+        "while true do\n"
+        "  t.x = 1\n"
+        "  t.n = (t.n or 0) + 1\n"
+        "  if t.n == 3 then break end\n"
+        "end\n"
+        "w = t.n\n"
+        "local u = {}\n"
+        "repeat\n"
+        "  u.x = 1\n"
+        "  u.n = (u.n or 0) + 1\n"
+        "until u.n == 3\n"
+        "r = u.n";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "w");
+    CHECK( lua_tonumber(L, -1) == 3 );
+    lua_getglobal(L, "r");
+    CHECK( lua_tonumber(L, -1) == 3 );
+
+}
+
 TEST_FIXTURE(EmptyReturn, LuaFixture)
 {
 
@@ -2348,6 +2552,71 @@ TEST_FIXTURE(ConcatOperatorNumber, LuaFixture)
 
 }
 
+TEST_FIXTURE(ConcatOperatorMany, LuaFixture)
+{
+
+    const char* code =
+        "local a, b, c = 'abcdefghijklmnopqrstuvwxyz', 'ABCDEFGHIJKLMNOPQRSTUVWXYZ', 1.5\n"
+        "s = a .. b .. c .. '-' .. 2 .. a";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "s");
+    CHECK_EQ( lua_tostring(L, -1), "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ1.5-2abcdefghijklmnopqrstuvwxyz" );
+
+}
+
+TEST_FIXTURE(ConcatOperatorAppend, LuaFixture)
+{
+
+    // Long strings built up in a loop share a buffer, so make sure the
+    // earlier strings aren't affected by appending to them.
+    const char* code =
+        "local s = ''\n"
+        "local t = { }\n"
+        "for i = 1, 1000 do\n"
+        "  s = s .. 'abcdefgh'\n"
+        "  t[i] = s\n"
+        "end\n"
+        "x = t[500] .. 'x'\n"
+        "y = t[500] .. 'y'\n"
+        "length = #s\n"
+        "equal = t[500] .. 'x' == x and x ~= y and #x == 4001 and t[501] == t[500] .. 'abcdefgh'";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "length");
+    CHECK_EQ( lua_tonumber(L, -1), 8000 );
+
+    lua_getglobal(L, "equal");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "y");
+    const char* y = lua_tostring(L, -1);
+    CHECK( strlen(y) == 4001 && y[4000] == 'y' );
+
+}
+
+TEST_FIXTURE(ConcatOperatorMetamethod, LuaFixture)
+{
+
+    // The strings on either side of the table should be joined before the
+    // metamethod is called, since concatenation is right associative.
+    const char* code =
+        "local mt = { __concat = function(x, y)\n"
+        "  if type(x) == 'table' then return '[' .. y .. ']' end\n"
+        "  return '(' .. x .. ')'\n"
+        "end }\n"
+        "local t = setmetatable({ }, mt)\n"
+        "s = 'a' .. 'b' .. t .. 'c' .. 1";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "s");
+    CHECK_EQ( lua_tostring(L, -1), "ab[c1]" );
+
+}
+
 TEST_FIXTURE(VarArg1, LuaFixture)
 {
 
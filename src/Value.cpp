@@ -11,6 +11,8 @@
 #include "Table.h"
 
 #include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
 
 void Value_SetMetatable(lua_State* L, Value* value, Table* table)
 {
@@ -26,6 +28,7 @@ void Value_SetMetatable(lua_State* L, Value* value, Table* table)
             Gc_DecrementReference(L, &L->gc, value->table->metatable);
         }
         value->table->metatable = table;
+        Table_UpdateVersion(value->table);
         break;
     case Tag_Userdata:
         if (table != NULL)
@@ -132,3 +135,32 @@ bool StringToNumber(const char* string, lua_Number* result)
     return false;
 
 }
+
+bool StringToNumber(const char* string, size_t length, lua_Number* result)
+{
+    
+    // Copy into a null terminated buffer. Numbers are short, so we only need
+    // to allocate for strings with a lot of padding.
+    char buffer[200];
+    char* data = buffer;
+    if (length >= sizeof(buffer))
+    {
+        data = static_cast<char*>(malloc(length + 1));
+        if (data == NULL)
+        {
+            return false;
+        }
+    }
+
+    memcpy(data, string, length);
+    data[length] = 0;
+
+    bool success = StringToNumber(data, result);
+
+    if (data != buffer)
+    {
+        free(data);
+    }
+    return success;
+
+}
@@ -28,6 +28,8 @@ struct Function;
 struct Prototype;
 struct Gc_Object;
 
+bool String_GetIsEqualLong(String* string1, String* string2);
+
 /**
  * Tag used to identify the type of a value. The ordering and the specific
  * values are significant to allow it to overlap with the least significant
@@ -75,6 +77,7 @@ enum TagMethod
     TagMethod_Le        = 11,
     TagMethod_Eq        = 12,
     TagMethod_Concat    = 13,
+    TagMethod_Mode      = 14,
     TagMethod_NumMethods,
 };
 
@@ -238,7 +241,13 @@ inline int Value_Equal(const Value* arg1, const Value* arg2)
     {
         return 1;
     }
-    return arg1->object == arg2->object;
+    else if (arg1->object == arg2->object)
+    {
+        return 1;
+    }
+    // Long strings aren't interned, so the same string can be stored in two
+    // different objects.
+    return Value_GetIsString(arg1) && String_GetIsEqualLong(arg1->string, arg2->string);
 }
 
 /**
@@ -268,4 +277,7 @@ trailing whitespace. This function can accomodate strings in any format that is
 permissiable by the Lua language and uses the current locale settings. */
 bool StringToNumber(const char* string, lua_Number* number);
 
+/** Converts a string which isn't null terminated into a number. */
+bool StringToNumber(const char* string, size_t length, lua_Number* number);
+
 #endif
\ No newline at end of file
@@ -168,7 +168,7 @@ static Value* GetTagMethod(lua_State* L, const Value* value, TagMethod method)
 {
     Table* metatable = Value_GetMetatable(L, value);
     Value* result = NULL;
-    if (metatable != NULL)
+    if (metatable != NULL && !Table_GetIsTagMethodAbsent(metatable, method))
     {
         result = Table_GetTagMethod(L, metatable, method);
         if (Value_GetIsNil(result))
@@ -254,6 +254,20 @@ void Vm_SetTable(lua_State* L, Value* dst, Value* key, Value* value)
 
             Table* table = dst->table;
 
+            if (table->frozen)
+            {
+                Vm_Error(L, "attempt to modify a frozen table");
+            }
+
+            // Without a __newindex tag method, it doesn't matter whether or not
+            // the key already exists.
+            Table* metatable = table->metatable;
+            if (metatable == NULL || Table_GetIsTagMethodAbsent(metatable, TagMethod_NewIndex))
+            {
+                Table_SetTable(L, table, key, value);
+                return;
+            }
+
             if (Table_Update(L, table, key, value))
             {
                 return;
@@ -295,6 +309,25 @@ void Vm_SetTable(lua_State* L, Value* dst, Value* key, Value* value)
 
 }
 
+/**
+ * Looks up a string key through the __index tables of the value's metatable
+ * using the index cache. Returns false if the look up needs to be done by
+ * following the tag methods.
+ */
+FORCE_INLINE static bool Vm_GetIndexChain(lua_State* L, const Value* value, const Value* key, Value* dst)
+{
+    if (!Value_GetIsString(key))
+    {
+        return false;
+    }
+    Table* metatable = Value_GetMetatable(L, value);
+    if (metatable == NULL || Table_GetIsTagMethodAbsent(metatable, TagMethod_Index))
+    {
+        return false;
+    }
+    return Table_GetIndexChain(L, metatable, key, dst);
+}
+
 /** 
  * Returns a hint for looking up the key in the table again.
  */
@@ -313,6 +346,10 @@ void Vm_GetTable(lua_State* L, const Value* value, const Value* key, Value* dst,
                 return;
             }
         }
+        if (Vm_GetIndexChain(L, value, key, dst))
+        {
+            return;
+        }
         method = GetTagMethod(L, value, TagMethod_Index);
         if (method == NULL)
         {
@@ -354,6 +391,10 @@ int Vm_GetTable(lua_State* L, const Value* value, const Value* key, Value* dst,
                 return Table_GetLookupHint(value->table, result);
             }
         }
+        if (Vm_GetIndexChain(L, value, key, dst))
+        {
+            return 0;
+        }
         method = GetTagMethod(L, value, TagMethod_Index);
         if (method == NULL)
         {
@@ -497,6 +538,8 @@ FORCE_INLINE int Vm_Less(lua_State* L, const Value* arg1, const Value* arg2)
     {
         if (Value_GetIsString(arg1))
         {
+            String_GetTerminatedData(L, arg1->string);
+            String_GetTerminatedData(L, arg2->string);
             return String_Compare(arg1->string, arg2->string) < 0;
         }
         int result = ComparisionTagMethod(L, arg1, arg2, TagMethod_Lt);
@@ -519,6 +562,8 @@ FORCE_INLINE int Vm_LessEqual(lua_State* L, const Value* arg1, const Value* arg2
     {
         if (Value_GetIsString(arg1))
         {
+            String_GetTerminatedData(L, arg1->string);
+            String_GetTerminatedData(L, arg2->string);
             return String_Compare(arg1->string, arg2->string) <= 0;
         }
         int result = ComparisionTagMethod(L, arg1, arg2, TagMethod_Le);
@@ -536,34 +581,111 @@ FORCE_INLINE int Vm_LessEqual(lua_State* L, const Value* arg1, const Value* arg2
     return 0;
 }
 
-void Vm_Concat(lua_State* L, Value* dst, Value* arg1, Value* arg2)
+/**
+ * Joins the strings from start to end into a single string, which is stored
+ * in start. The total length is computed first so that the result is built
+ * with a single allocation.
+ */
+static void Vm_ConcatStrings(lua_State* L, Value* start, Value* end)
 {
 
-    if ( (!Value_GetIsString(arg1) && !Value_GetIsNumber(arg1)) || !ToString(L, arg2) )
+    size_t length = 0;
+    for (const Value* value = start; value <= end; ++value)
     {
-        Value* method = GetBinaryTagMethod(L, arg1, arg2, TagMethod_Concat);
-        if (method == NULL)
+        size_t valueLength = value->string->length;
+        if (valueLength >= ~size_t(0) - length)
         {
-            ConcatError(L, arg1, arg2);
+            Vm_Error(L, "string length overflow");
         }
-        CallTagMethod2Result(L, method, arg1, arg2, dst);       
+        length += valueLength;
     }
-    else
+
+    if (length == start->string->length)
+    {
+        // Everything else is empty.
+        return;
+    }
+
+    char shortBuffer[String_maxShortLength];
+    String* buffer = NULL;
+    String* result = NULL;
+
+    const Value* value = start;
+    char* data = shortBuffer;
+
+    if (start->string->length >= String_minAppendLength)
+    {
+        // Append to the first string in place if we can, which avoids copying
+        // it when a string is built up in a loop.
+        result = String_Append(L, start->string, length - start->string->length, &data);
+        ++value;
+    }
+    else if (length > String_maxShortLength)
     {
+        // Long strings aren't interned, so the buffer becomes the result.
+        buffer = String_CreateBuffer(L, length);
+        data   = const_cast<char*>(buffer->data);
+    }
 
-        ToString(L, arg1);
+    for (; value <= end; ++value)
+    {
+        size_t valueLength = value->string->length;
+        memcpy(data, String_GetData(value->string), valueLength);
+        data += valueLength;
+    }
 
-        size_t length1 = arg1->string->length;
-        size_t length2 = arg2->string->length;
+    if (result != NULL)
+    {
+        SetValue( start, result );
+    }
+    else if (buffer != NULL)
+    {
+        SetValue( start, String_FinishBuffer(L, buffer, length) );
+    }
+    else
+    {
+        SetValue( start, String_Create(L, shortBuffer, length) );
+    }
 
-        // TODO: Create a reusable buffer for all concatenation operations.
-        char* buffer = static_cast<char*>( Allocate(L, length1 + length2) );
-        memcpy(buffer, String_GetData(arg1->string), length1);
-        memcpy(buffer + length1, String_GetData(arg2->string), length2);
+}
+
+void Vm_Concat(lua_State* L, Value* dst, Value* start, Value* end)
+{
 
-        SetValue( dst, String_Create(L, buffer, length1 + length2) );
-        Free(L, buffer, length1 + length2);
+    // Concatenation is right associative, so the values are combined starting
+    // from the end. Each run of strings and numbers is joined at once, and the
+    // __concat metamethod is only used for pairs which include another type.
+    Value* top = end;
+    while (top > start)
+    {
+        Value* arg1 = top - 1;
+        Value* arg2 = top;
+        if ( (!Value_GetIsString(arg1) && !Value_GetIsNumber(arg1)) || !ToString(L, arg2) )
+        {
+            Value* method = GetBinaryTagMethod(L, arg1, arg2, TagMethod_Concat);
+            if (method == NULL)
+            {
+                ConcatError(L, arg1, arg2);
+            }
+            CallTagMethod2Result(L, method, arg1, arg2, arg1);
+            top = arg1;
+        }
+        else
+        {
+            ToString(L, arg1);
+            Value* first = arg1;
+            while (first > start && ToString(L, first - 1))
+            {
+                --first;
+            }
+            Vm_ConcatStrings(L, first, top);
+            top = first;
+        }
+    }
 
+    if (dst != start)
+    {
+        Value_Copy(dst, start);
     }
 
 }
@@ -595,8 +717,13 @@ bool Vm_GetNumber(const Value* value, lua_Number* result)
     }
     else if (Value_GetIsString(value))
     {
-        const char* string = String_GetData(value->string);
-        return StringToNumber(string, result);
+        const String* string = value->string;
+        if (String_GetData(string)[string->length] != 0)
+        {
+            // A slice which isn't null terminated.
+            return StringToNumber(String_GetData(string), string->length, result);
+        }
+        return StringToNumber(String_GetData(string), result);
     }
     return false;
 }
@@ -1464,6 +1591,12 @@ Start:
                 SetValue( &stackBase[a], Table_Create(L, numArray, numHash) );
             }
             break;
+        case Opcode_NewTableT:
+            {
+                Table* table = prototype->tableTemplate[VM_GET_D(inst)];
+                SetValue( &stackBase[a], Table_Clone(L, table, false) );
+            }
+            break;
         case Opcode_Closure:
             {
 
@@ -1633,10 +1766,13 @@ Start:
                         // Restore the top of the stack from the previous call.
                         L->stackTop = frame->stackTop;
                     }
-                    for (int i = 1; i <= b; ++i)
+                    if (!Table_FillArray(L, table, offset + 1, &stackBase[a + 1], b))
                     {
-                        Value* value = &stackBase[a + i];
-                        Table_SetTable(L, table, i + offset, value);
+                        for (int i = 1; i <= b; ++i)
+                        {
+                            Value* value = &stackBase[a + i];
+                            Table_SetTable(L, table, i + offset, value);
+                        }
                     }
                 )
             }